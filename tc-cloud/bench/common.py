@@ -0,0 +1,65 @@
+"""Helpers shared by the benchmark scripts."""
+import os
+import socket
+import sqlite3
+import subprocess
+import sys
+import time
+from typing import Dict, Iterable, Optional, Sequence, Tuple
+
+import httpx
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+APP_DIR = os.path.dirname(HERE)
+sys.path.insert(0, APP_DIR)
+
+import partitions  # noqa: E402
+
+
+def free_port() -> int:
+    with socket.socket() as s:
+        s.bind(("127.0.0.1", 0))
+        return s.getsockname()[1]
+
+
+def start_app(db_path: str, env: Optional[Dict[str, str]] = None,
+              app: str = "main:app") -> Tuple[subprocess.Popen, str]:
+    """Run app (main:app, or a bench wrapper of it) with uvicorn on a free port
+    and wait until it is ready"""
+    port = free_port()
+    # benches replay one device far above its rate limit, bench/ingest_overload.py turns it back on
+    app_env = dict(os.environ, DATABASE_PATH=db_path, MQTT_ENABLED="false", LOG_LEVEL="WARNING",
+                   INGEST_DEVICE_RATE="0")
+    app_env.update(env or {})
+    proc = subprocess.Popen(
+        [sys.executable, "-m", "uvicorn", app, "--port", str(port), "--log-level", "warning"],
+        cwd=APP_DIR, env=app_env)
+    base = f"http://127.0.0.1:{port}"
+    for _ in range(1200):
+        try:
+            if httpx.get(f"{base}/health/ready", timeout=1.0).status_code == 200:
+                break
+        except httpx.HTTPError:
+            pass
+        time.sleep(0.05)
+    return proc, base
+
+
+def stop_app(proc: subprocess.Popen) -> None:
+    proc.terminate()
+    proc.wait()
+
+
+def seed(db_path: str, rows: Iterable[Tuple]) -> int:
+    """Insert (device_id, longitude, latitude, battery, date, time) rows into the
+    partitions of a database the app has already migrated, returns how many"""
+    conn = sqlite3.connect(db_path, timeout=30.0, factory=partitions.Connection)
+    try:
+        return partitions.seed(conn, (row + (None, None) for row in rows))
+    finally:
+        conn.close()
+
+
+def percentile(values: Sequence[float], q: float) -> float:
+    ordered = sorted(values)
+    return ordered[min(len(ordered) - 1, int(round(q * (len(ordered) - 1))))]
@@ -0,0 +1,117 @@
+"""Per-message CPU cost of telemetry decoding.
+
+Compares the original json.loads + dict validation + decode_payload path with
+main.decode_telemetry on a corpus of firmware-shaped messages, and checks that
+both produce the same values. Then times main.decode_telemetry on the same
+corpus with the payload in each encoding (hex, b64, b85), next to the mean
+message size.
+
+    python bench/decode.py --messages 200000
+"""
+import argparse
+import base64
+import json
+import os
+import random
+import struct
+import sys
+import tempfile
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+os.environ.setdefault("DATABASE_PATH", os.path.join(tempfile.mkdtemp(prefix="tc-bench-"), "bench.db"))
+os.environ.setdefault("LOG_LEVEL", "WARNING")
+
+import main  # noqa: E402
+
+
+def _legacy_decode_payload(payload_hex: str) -> dict:
+    h = payload_hex.strip().upper()
+    if len(h) != 10:
+        raise ValueError("Payload must be exactly 10 hex characters (5 bytes)")
+    lat_u16, lon_u16, batt = struct.unpack('!HHB', bytes.fromhex(h))
+    lat = (lat_u16 / 65535.0) * 180.0 - 90.0
+    lon = (lon_u16 / 65535.0) * 360.0 - 180.0
+    return {"latitude": round(lat, 2), "longitude": round(lon, 2), "battery": batt}
+
+
+def _legacy(raw: bytes) -> dict:
+    message = json.loads(raw.decode())
+    for field in ["id", "payload", "date", "time"]:
+        if field not in message:
+            raise ValueError(f"Missing required field: {field}")
+    decoded = _legacy_decode_payload(message["payload"])
+    return {
+        "seq": message.get("seq"),
+        "sample_ts": message.get("ts"),
+        "device_id": message["id"],
+        "longitude": decoded["longitude"],
+        "latitude": decoded["latitude"],
+        "battery": decoded["battery"],
+        "date": message["date"],
+        "time": message["time"],
+    }
+
+
+_ENCODERS = {
+    "hex": lambda b: b.hex().upper(),
+    "b64": lambda b: base64.b64encode(b).decode(),
+    "b85": lambda b: base64.b85encode(b).decode(),
+}
+
+
+def _corpus(n: int, enc: str = "hex") -> list:
+    rnd = random.Random(42)
+    encode = _ENCODERS[enc]
+    return [
+        json.dumps({
+            "id": f"ESP32_{rnd.randrange(1 << 24):06X}",
+            "payload": encode(struct.pack("!HHB", rnd.randrange(65536), rnd.randrange(65536), rnd.randrange(101))),
+            "date": "2025-11-07",
+            "time": f"{rnd.randrange(24):02d}:{rnd.randrange(60):02d}:{rnd.randrange(60):02d}",
+            # half the corpus carries the firmware trace context
+            **({"seq": i, "ts": 1762516800000 + i * 15000} if i % 2 else {}),
+        }, separators=(",", ":")).encode()
+        for i in range(n)
+    ]
+
+
+def _ns_per_message(fn, corpus: list) -> float:
+    start = time.perf_counter_ns()
+    for raw in corpus:
+        fn(raw)
+    return (time.perf_counter_ns() - start) / len(corpus)
+
+
+def main_() -> None:
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--messages", type=int, default=200000)
+    parser.add_argument("--repeat", type=int, default=5)
+    args = parser.parse_args()
+
+    corpus = _corpus(args.messages)
+    for raw in corpus[:10000]:
+        legacy = _legacy(raw)
+        record = main.decode_telemetry(raw)
+        assert tuple(legacy.get(k) for k in main.TelemetryRecord._fields) == record, raw
+
+    legacy_ns = min(_ns_per_message(_legacy, corpus) for _ in range(args.repeat))
+    fast_ns = min(_ns_per_message(main.decode_telemetry, corpus) for _ in range(args.repeat))
+    print(json.dumps({
+        "messages": args.messages,
+        "legacy_ns_per_msg": round(legacy_ns, 1),
+        "fast_ns_per_msg": round(fast_ns, 1),
+        "speedup": round(legacy_ns / fast_ns, 2),
+    }))
+
+    for enc in _ENCODERS:
+        encoded = _corpus(args.messages, enc)
+        for raw, hex_raw in zip(encoded[:10000], corpus):
+            assert main.decode_telemetry(raw) == main.decode_telemetry(hex_raw), raw
+        ns = min(_ns_per_message(main.decode_telemetry, encoded) for _ in range(args.repeat))
+        print(json.dumps({"enc": enc, "ns_per_msg": round(ns, 1),
+                          "bytes_per_msg": round(sum(map(len, encoded)) / len(encoded), 1)}))
+
+
+if __name__ == "__main__":
+    main_()
@@ -0,0 +1,111 @@
+"""Size, encode and decode time of the JSON, CBOR and msgpack envelopes.
+
+The corpus is the firmware host benchmark's (tc-firmware/bench, xorshift32
+from the same seed, float32 scaling like tc_encode_payload), with seq and the
+trace timestamp set. Every sample is encoded the way the firmware writes it:
+tc_format_json_payload for JSON, fixed width integers for CBOR and msgpack
+(see envelope.py). All three must decode to the same records with
+main.decode_envelope. Encode times are for these Python mirrors; the device
+side is measured by the firmware host benchmark.
+
+    python bench/envelope.py --samples 1024
+"""
+import argparse
+import json
+import math
+import os
+import struct
+import sys
+import tempfile
+import time
+
+import numpy as np
+
+sys.path.insert(0, os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+os.environ.setdefault("DATABASE_PATH", os.path.join(tempfile.mkdtemp(prefix="tc-bench-"), "bench.db"))
+os.environ.setdefault("LOG_LEVEL", "WARNING")
+
+import main  # noqa: E402
+
+DEVICE_STR = "ESP32_12ABCD"
+
+
+def _samples(n: int) -> list:
+    """(payload, unix seconds, seq, ts ms) like _generate_samples in bench_main.c"""
+    f32 = np.float32
+    state = 0x12345678
+    out = []
+    for i in range(n):
+        state ^= (state << 13) & 0xFFFFFFFF
+        state ^= state >> 17
+        state ^= (state << 5) & 0xFFFFFFFF
+        latitude = f32(13.40) + f32(state % 5000) / f32(10000.0)
+        longitude = f32(100.20) + f32((state >> 12) % 8000) / f32(10000.0)
+        # lroundf: half away from zero, the values are positive
+        lat_u16 = math.floor(((latitude + f32(90.0)) / f32(180.0)) * f32(65535.0) + 0.5)
+        lon_u16 = math.floor(((longitude + f32(180.0)) / f32(360.0)) * f32(65535.0) + 0.5)
+        timestamp = 1762516800 + i * 15
+        out.append((struct.pack("!HHB", lat_u16, lon_u16, 10 + state % 91), timestamp, i + 1,
+                    timestamp * 1000 + state % 1000))
+    return out
+
+
+def _json(payload: bytes, t: int, seq: int, ts: int) -> bytes:
+    tm = time.gmtime(t)
+    return (f'{{"id":"{DEVICE_STR}","payload":"{payload.hex().upper()}",'
+            f'"date":"{tm.tm_year:04d}-{tm.tm_mon:02d}-{tm.tm_mday:02d}",'
+            f'"time":"{tm.tm_hour:02d}:{tm.tm_min:02d}:{tm.tm_sec:02d}","seq":{seq},"ts":{ts}}}').encode()
+
+
+def _cbor(payload: bytes, t: int, seq: int, ts: int) -> bytes:
+    return b"".join((b"\xa5\x62id", bytes((0x60 | len(DEVICE_STR),)), DEVICE_STR.encode(),
+                     b"\x67payload\x45", payload, b"\x61t\x1a", struct.pack("!I", t),
+                     b"\x63seq\x1a", struct.pack("!I", seq), b"\x62ts\x1b", struct.pack("!Q", ts)))
+
+
+def _msgpack(payload: bytes, t: int, seq: int, ts: int) -> bytes:
+    return b"".join((b"\x85\xa2id", bytes((0xA0 | len(DEVICE_STR),)), DEVICE_STR.encode(),
+                     b"\xa7payload\xc4\x05", payload, b"\xa1t\xce", struct.pack("!I", t),
+                     b"\xa3seq\xce", struct.pack("!I", seq), b"\xa2ts\xcf", struct.pack("!Q", ts)))
+
+
+ENCODERS = {"json": _json, "cbor": _cbor, "msgpack": _msgpack}
+
+
+def _ns_per_item(fn, items: list, star: bool = False) -> float:
+    start = time.perf_counter_ns()
+    if star:
+        for item in items:
+            fn(*item)
+    else:
+        for item in items:
+            fn(item)
+    return (time.perf_counter_ns() - start) / len(items)
+
+
+def main_() -> None:
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--samples", type=int, default=1024)
+    parser.add_argument("--rounds", type=int, default=100, help="passes over the corpus per timing")
+    parser.add_argument("--repeat", type=int, default=5)
+    args = parser.parse_args()
+
+    samples = _samples(args.samples)
+    corpus = {fmt: [encode(*s) for s in samples] for fmt, encode in ENCODERS.items()}
+    expected = [main.decode_envelope(raw) for raw in corpus["json"]]
+    for fmt, bodies in corpus.items():
+        assert [main.decode_envelope(raw) for raw in bodies] == expected, fmt
+        assert all(main.envelope.detect(raw) == fmt for raw in bodies), fmt
+
+    for fmt, encode in ENCODERS.items():
+        samples_n = samples * args.rounds
+        bodies = corpus[fmt] * args.rounds
+        encode_ns = min(_ns_per_item(encode, samples_n, star=True) for _ in range(args.repeat))
+        decode_ns = min(_ns_per_item(main.decode_envelope, bodies) for _ in range(args.repeat))
+        print(json.dumps({"format": fmt, "bytes_per_msg": round(sum(map(len, corpus[fmt])) / len(samples), 1),
+                          "encode_ns_per_msg": round(encode_ns, 1), "decode_ns_per_msg": round(decode_ns, 1)}),
+              flush=True)
+
+
+if __name__ == "__main__":
+    main_()
@@ -0,0 +1,99 @@
+"""Compare the CSV export with the Parquet and Arrow exports.
+
+Starts the app with uvicorn on a scratch database, seeds --rows rows over
+--devices devices and 30 days, then downloads every format --repeat times.
+Prints one JSON object per format with the best download time, the size, and
+the time to load the download into a pandas DataFrame, the step analysts
+repeat on every CSV.
+
+The CSV export is then timed again for every --parallel shard count, each
+with one more database reader than it reads shards on. Expect it to scale up
+to the number of cores.
+
+    python bench/export.py --rows 1000000 --parallel 1 2 4 8
+"""
+import argparse
+import io
+import json
+import math
+import os
+import random
+import tempfile
+import time
+
+import httpx
+import pandas as pd
+import pyarrow as pa
+import pyarrow.parquet as pq
+
+from common import seed, start_app, stop_app
+
+DAY = 86400
+START = 1762473600  # 2025-11-07T00:00:00Z
+
+FORMATS = {
+    "csv": ("/download-csv-raw", lambda body: pd.read_csv(io.BytesIO(body))),
+    "parquet snappy": ("/export.parquet?compression=snappy", lambda body: pq.read_table(pa.BufferReader(body)).to_pandas()),
+    "parquet zstd": ("/export.parquet?compression=zstd", lambda body: pq.read_table(pa.BufferReader(body)).to_pandas()),
+    "arrow": ("/export.arrow", lambda body: pa.ipc.open_stream(body).read_all().to_pandas()),
+    "arrow zstd": ("/export.arrow?compression=zstd", lambda body: pa.ipc.open_stream(body).read_all().to_pandas()),
+}
+
+
+def _rows(rows: int, devices: int):
+    rng = random.Random(1)
+    for i in range(rows):
+        t = START + rng.randrange(30 * DAY)
+        yield (f"ESP32_{i % devices:06X}", round(rng.uniform(98.0, 108.0), 2), round(rng.uniform(5.0, 15.0), 2),
+               rng.randrange(101), time.strftime("%Y-%m-%d", time.gmtime(t)), time.strftime("%H:%M:%S", time.gmtime(t)))
+
+
+def _download(client: httpx.Client, url: str, repeat: int):
+    best, body = math.inf, b""
+    for _ in range(repeat):
+        start = time.perf_counter()
+        r = client.get(url)
+        r.raise_for_status()
+        best = min(best, time.perf_counter() - start)
+        body = r.content
+    return best, body
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--rows", type=int, default=1000000)
+    parser.add_argument("--devices", type=int, default=1000)
+    parser.add_argument("--repeat", type=int, default=3)
+    parser.add_argument("--parallel", type=int, nargs="*", default=[1, 2, 4, 8])
+    args = parser.parse_args()
+
+    db_path = os.path.join(tempfile.mkdtemp(prefix="tc-bench-"), "bench.db")
+    proc, base = start_app(db_path)
+    try:
+        seed_start = time.perf_counter()
+        seed(db_path, _rows(args.rows, args.devices))
+        print(json.dumps({"rows": args.rows, "seed_s": round(time.perf_counter() - seed_start, 1)}), flush=True)
+        with httpx.Client(base_url=base, timeout=600.0) as client:
+            for name, (url, load) in FORMATS.items():
+                best, body = _download(client, url, args.repeat)
+                start = time.perf_counter()
+                frame = load(body)
+                load_s = time.perf_counter() - start
+                print(json.dumps({"format": name, "export_s": round(best, 2), "mb": round(len(body) / 1e6, 1),
+                                  "rows": len(frame), "load_s": round(load_s, 2)}), flush=True)
+    finally:
+        stop_app(proc)
+
+    for parallel in args.parallel:
+        proc, base = start_app(db_path, {"EXPORT_PARALLEL": str(parallel), "DATABASE_READERS": str(parallel + 1)})
+        try:
+            with httpx.Client(base_url=base, timeout=600.0) as client:
+                best, body = _download(client, "/download-csv-raw", args.repeat)
+            print(json.dumps({"format": "csv", "parallel": parallel, "export_s": round(best, 2),
+                              "mb_per_s": round(len(body) / 1e6 / best, 1)}), flush=True)
+        finally:
+            stop_app(proc)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,93 @@
+"""Time /query/bbox and /query/radius against a full table scan.
+
+Starts the app with uvicorn on a scratch database, seeds --rows points spread
+over --devices devices, a 10 x 10 degree area and 30 days (the insert triggers
+maintain the partitions' R*Trees), then runs every query --repeat times. For comparison,
+the same box is answered by scanning telemetry directly. Prints one JSON object
+per query with p50/max milliseconds and the number of devices found.
+
+    python bench/geo_query.py --rows 1000000 --devices 1000
+"""
+import argparse
+import json
+import os
+import random
+import sqlite3
+import statistics
+import tempfile
+import time
+
+import httpx
+
+from common import seed, start_app, stop_app
+
+DAY = 86400
+START = 1762473600  # 2025-11-07T00:00:00Z
+
+
+def _seed(db_path: str, rows: int, devices: int) -> None:
+    rng = random.Random(1)
+
+    def _rows():
+        for i in range(rows):
+            t = START + rng.randrange(30 * DAY)
+            yield (f"ESP32_{i % devices:06X}", round(rng.uniform(98.0, 108.0), 2), round(rng.uniform(5.0, 15.0), 2),
+                   rng.randrange(101), time.strftime("%Y-%m-%d", time.gmtime(t)), time.strftime("%H:%M:%S", time.gmtime(t)))
+
+    seed(db_path, _rows())
+
+
+def _time(fn, repeat: int) -> dict:
+    durations, found = [], 0
+    for _ in range(repeat):
+        start = time.perf_counter()
+        found = fn()
+        durations.append((time.perf_counter() - start) * 1000.0)
+    return {"p50_ms": round(statistics.median(durations), 2), "max_ms": round(max(durations), 2), "devices": found}
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--rows", type=int, default=1000000)
+    parser.add_argument("--devices", type=int, default=1000)
+    parser.add_argument("--repeat", type=int, default=20)
+    args = parser.parse_args()
+
+    db_path = os.path.join(tempfile.mkdtemp(prefix="tc-bench-"), "bench.db")
+    proc, base = start_app(db_path)
+    try:
+        seed_start = time.perf_counter()
+        _seed(db_path, args.rows, args.devices)
+        print(json.dumps({"rows": args.rows, "seed_s": round(time.perf_counter() - seed_start, 1)}), flush=True)
+
+        day = time.strftime("%Y-%m-%dT%H:%M:%S", time.gmtime(START + 10 * DAY))
+        day_end = time.strftime("%Y-%m-%dT%H:%M:%S", time.gmtime(START + 11 * DAY))
+        queries = {
+            "bbox 0.1deg, 1 day": f"/query/bbox?min_lat=10&min_lon=103&max_lat=10.1&max_lon=103.1&start={day}&end={day_end}",
+            "bbox 0.1deg, all time": "/query/bbox?min_lat=10&min_lon=103&max_lat=10.1&max_lon=103.1",
+            "bbox 1deg, 1 day": f"/query/bbox?min_lat=10&min_lon=103&max_lat=11&max_lon=104&start={day}&end={day_end}",
+            "radius 5km, 1 day": f"/query/radius?lat=10&lon=103&radius_m=5000&start={day}&end={day_end}",
+            "radius 50km, all time": "/query/radius?lat=10&lon=103&radius_m=50000",
+        }
+        with httpx.Client(base_url=base, timeout=120.0) as client:
+            for name, url in queries.items():
+                def _query() -> int:
+                    r = client.get(url)
+                    r.raise_for_status()
+                    return r.json()["count"]
+                print(json.dumps({"query": name, **_time(_query, args.repeat)}), flush=True)
+
+        # what the index saves: the same 0.1 degree, one day box without it
+        conn = sqlite3.connect(db_path)
+        scan = ("SELECT COUNT(DISTINCT device_id) FROM telemetry WHERE latitude BETWEEN 10 AND 10.1 "
+                "AND longitude BETWEEN 103 AND 103.1 AND date || 'T' || time BETWEEN ? AND ?")
+        print(json.dumps({"query": "full scan 0.1deg, 1 day",
+                          **_time(lambda: conn.execute(scan, (day, day_end)).fetchone()[0], max(1, args.repeat // 10))}),
+              flush=True)
+        conn.close()
+    finally:
+        stop_app(proc)
+
+
+if __name__ == "__main__":
+    main()
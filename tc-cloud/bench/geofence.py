@@ -0,0 +1,95 @@
+"""Microbenchmark of the geofence engine against a linear scan.
+
+Builds --fences random polygons (12 to 32 vertices, 100 m to 5 km across, 1%
+up to 50 km) over a 10 x 10 degree area and evaluates --messages positions
+from --devices devices walking around it. Checks the index against testing
+every fence on a sample, then prints one JSON object with the build time,
+microseconds per message for the engine and for a linear scan, and the
+enter/exit transitions seen.
+
+    python bench/geofence.py --fences 10000 --messages 200000
+"""
+import argparse
+import json
+import math
+import os
+import random
+import sys
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+
+from geofence import Fence, GeofenceEngine, GeofenceIndex, _Shape  # noqa: E402
+
+AREA = (98.0, 5.0, 108.0, 15.0)  # min_lon, min_lat, max_lon, max_lat
+
+
+def _fences(n: int, rng: random.Random):
+    for i in range(n):
+        lon, lat = rng.uniform(AREA[0], AREA[2]), rng.uniform(AREA[1], AREA[3])
+        radius = rng.uniform(0.05, 0.25) if rng.random() < 0.01 else rng.uniform(0.0005, 0.025)
+        vertices = rng.randint(12, 32)
+        ring = []
+        for v in range(vertices):
+            angle = 2.0 * math.pi * v / vertices
+            r = radius * rng.uniform(0.5, 1.0)  # star shaped, not convex
+            ring.append((round(lon + r * math.cos(angle), 5), round(lat + r * math.sin(angle), 5)))
+        yield Fence(i + 1, f"fence-{i + 1}", tuple(ring))
+
+
+def _positions(messages: int, devices: int, rng: random.Random):
+    walkers = [[rng.uniform(AREA[0], AREA[2]), rng.uniform(AREA[1], AREA[3])] for _ in range(devices)]
+    out = []
+    for i in range(messages):
+        w = walkers[i % devices]
+        w[0] = min(AREA[2], max(AREA[0], w[0] + rng.uniform(-0.01, 0.01)))
+        w[1] = min(AREA[3], max(AREA[1], w[1] + rng.uniform(-0.01, 0.01)))
+        # telemetry positions are rounded to 0.01 degrees
+        out.append((f"ESP32_{i % devices:06X}", round(w[1], 2), round(w[0], 2)))
+    return out
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--fences", type=int, default=10000)
+    parser.add_argument("--messages", type=int, default=200000)
+    parser.add_argument("--devices", type=int, default=1000)
+    args = parser.parse_args()
+
+    rng = random.Random(1)
+    fences = list(_fences(args.fences, rng))
+    positions = _positions(args.messages, args.devices, rng)
+
+    start = time.perf_counter()
+    index = GeofenceIndex(fences)
+    build_s = time.perf_counter() - start
+
+    shapes = [_Shape(f) for f in fences]
+    sample = positions[:: max(1, len(positions) // 2000)]
+    linear_start = time.perf_counter()
+    for _, lat, lon in sample:
+        expected = frozenset(s.id for s in shapes if s.contains(lon, lat))
+        assert index.containing(lat, lon) == expected, (lat, lon)
+    linear_us = (time.perf_counter() - linear_start) / len(sample) * 1e6
+
+    engine = GeofenceEngine(index)
+    transitions = 0
+    evaluate = engine.evaluate
+    start = time.perf_counter()
+    for device_id, lat, lon in positions:
+        transitions += len(evaluate(device_id, lat, lon))
+    engine_us = (time.perf_counter() - start) / len(positions) * 1e6
+
+    print(json.dumps({
+        "fences": args.fences,
+        "messages": args.messages,
+        "build_s": round(build_s, 2),
+        "engine_us_per_message": round(engine_us, 2),
+        "linear_us_per_message": round(linear_us, 1),
+        "transitions": transitions,
+        "devices_inside": len(engine.state),
+    }))
+
+
+if __name__ == "__main__":
+    main()
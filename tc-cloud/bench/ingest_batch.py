@@ -0,0 +1,92 @@
+"""Compare rows/s for /ingest (one record per request) and /ingest/batch.
+
+    python bench/ingest_batch.py --rows 100000 --batch 5000
+"""
+import argparse
+import asyncio
+import json
+import os
+import struct
+import tempfile
+import time
+
+import httpx
+
+from common import start_app, stop_app
+
+PAYLOAD = bytes.fromhex("9A3FC7A040")
+
+
+def _message(i: int) -> dict:
+    return {
+        "id": f"ESP32_{i % 1000:06X}",
+        "payload": PAYLOAD.hex().upper(),
+        "date": "2025-11-07",
+        "time": f"{(i // 3600) % 24:02d}:{(i // 60) % 60:02d}:{i % 60:02d}",
+    }
+
+
+def _frame(i: int) -> bytes:
+    device_id = f"ESP32_{i % 1000:06X}".encode()
+    body = bytes([len(device_id)]) + device_id + struct.pack("!I", 1762516800 + i) + PAYLOAD
+    return struct.pack("!H", len(body)) + body
+
+
+async def _single(base: str, rows: int, concurrency: int) -> float:
+    async with httpx.AsyncClient(base_url=base, timeout=120.0) as client:
+        async def _worker(w: int) -> None:
+            for i in range(w, rows, concurrency):
+                (await client.post("/ingest", json=_message(i))).raise_for_status()
+
+        start = time.perf_counter()
+        await asyncio.gather(*(_worker(w) for w in range(concurrency)))
+        return time.perf_counter() - start
+
+
+async def _batched(base: str, rows: int, batch: int, fmt: str) -> float:
+    bodies = []
+    for first in range(0, rows, batch):
+        idx = range(first, min(rows, first + batch))
+        if fmt == "ndjson":
+            bodies.append("\n".join(json.dumps(_message(i), separators=(",", ":")) for i in idx).encode())
+        else:
+            bodies.append(b"".join(_frame(i) for i in idx))
+    content_type = "application/x-ndjson" if fmt == "ndjson" else "application/octet-stream"
+
+    async with httpx.AsyncClient(base_url=base, timeout=120.0) as client:
+        start = time.perf_counter()
+        for body in bodies:
+            r = await client.post("/ingest/batch", content=body, headers={"content-type": content_type})
+            r.raise_for_status()
+            assert r.json()["rejected"] == 0, r.text
+        return time.perf_counter() - start
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--rows", type=int, default=50000)
+    parser.add_argument("--batch", type=int, default=5000)
+    parser.add_argument("--concurrency", type=int, default=16, help="parallel clients for /ingest")
+    args = parser.parse_args()
+
+    for mode in ("single", "ndjson", "binary"):
+        db_path = os.path.join(tempfile.mkdtemp(prefix="tc-bench-"), "bench.db")
+        proc, base = start_app(db_path)
+        try:
+            if mode == "single":
+                elapsed = asyncio.run(_single(base, args.rows, args.concurrency))
+            else:
+                elapsed = asyncio.run(_batched(base, args.rows, args.batch, mode))
+        finally:
+            stop_app(proc)
+        print(json.dumps({
+            "mode": mode,
+            "rows": args.rows,
+            "batch": 1 if mode == "single" else args.batch,
+            "seconds": round(elapsed, 3),
+            "rows_per_s": round(args.rows / elapsed, 1),
+        }), flush=True)
+
+
+if __name__ == "__main__":
+    main()
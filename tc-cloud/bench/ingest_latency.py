@@ -0,0 +1,93 @@
+"""Measure /ingest latency while a full CSV export is running.
+
+Starts the app with uvicorn on a scratch database, seeds --rows rows, then
+posts telemetry at a fixed rate twice: once idle and once while clients keep
+downloading /download-csv-raw. Prints p50/p99/max latency per phase as JSON.
+
+    python bench/ingest_latency.py --rows 500000 --rate 200 --seconds 10
+"""
+import argparse
+import asyncio
+import json
+import os
+import statistics
+import tempfile
+import time
+
+import httpx
+
+from common import percentile, seed, start_app, stop_app
+
+BODY = {"id": "ESP32_BENCH0", "payload": "9A3FC7A040", "date": "2025-11-07", "time": "12:00:00"}
+
+
+def _seed(db_path: str, rows: int) -> None:
+    seed(db_path, ((f"ESP32_{i % 1000:06X}", 100.5, 13.6, i % 100, "2025-11-07",
+                    f"{(i // 3600) % 24:02d}:{(i // 60) % 60:02d}:{i % 60:02d}") for i in range(rows)))
+
+
+async def _phase(base: str, rate: float, seconds: float, exporters: int) -> dict:
+    latencies = []
+    exports = 0
+    stop = asyncio.Event()
+
+    async with httpx.AsyncClient(base_url=base, timeout=120.0) as client:
+        async def _export() -> None:
+            nonlocal exports
+            while not stop.is_set():
+                r = await client.get("/download-csv-raw")
+                r.raise_for_status()
+                exports += 1
+
+        async def _post() -> None:
+            start = time.perf_counter()
+            r = await client.post("/ingest", json=BODY)
+            r.raise_for_status()
+            latencies.append((time.perf_counter() - start) * 1000.0)
+
+        export_tasks = [asyncio.create_task(_export()) for _ in range(exporters)]
+        posts = []
+        interval = 1.0 / rate
+        deadline = time.perf_counter() + seconds
+        next_at = time.perf_counter()
+        while next_at < deadline:
+            posts.append(asyncio.create_task(_post()))
+            next_at += interval
+            await asyncio.sleep(max(0.0, next_at - time.perf_counter()))
+        await asyncio.gather(*posts)
+        stop.set()
+        await asyncio.gather(*export_tasks)
+
+    return {
+        "exporters": exporters,
+        "requests": len(latencies),
+        "exports_completed": exports,
+        "p50_ms": round(statistics.median(latencies), 2),
+        "p99_ms": round(percentile(latencies, 0.99), 2),
+        "max_ms": round(max(latencies), 2),
+    }
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--rows", type=int, default=200000)
+    parser.add_argument("--rate", type=float, default=200.0, help="ingest requests per second")
+    parser.add_argument("--seconds", type=float, default=10.0)
+    parser.add_argument("--exporters", type=int, default=1)
+    args = parser.parse_args()
+
+    db_path = os.path.join(tempfile.mkdtemp(prefix="tc-bench-"), "bench.db")
+    proc, base = start_app(db_path)
+    try:
+        _seed(db_path, args.rows)
+
+        for exporters in (0, args.exporters):
+            result = asyncio.run(_phase(base, args.rate, args.seconds, exporters))
+            result["rows"] = args.rows
+            print(json.dumps(result), flush=True)
+    finally:
+        stop_app(proc)
+
+
+if __name__ == "__main__":
+    main()
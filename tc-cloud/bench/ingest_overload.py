@@ -0,0 +1,176 @@
+"""/ingest latency at twice its capacity, with and without admission control.
+
+Starts the app with uvicorn on a scratch database and first measures capacity:
+--clients clients post back to back for --seconds. Then it offers twice that
+rate, open loop, once with the default INGEST_MAX_PENDING and once unbounded
+(INGEST_MAX_PENDING=0). Latency is counted from the moment a request was due,
+so requests stuck behind others are not hidden. Records cycle over --devices
+devices, which keeps them under the per device rate limit.
+
+Without the bound every request is accepted, the backlog and latency grow for
+as long as the overload lasts. With it, the excess is answered 503 at once and
+accepted requests stay at about INGEST_MAX_PENDING / capacity.
+
+The bound is on requests waiting, for the database mostly. If the load
+generator shares the app's CPUs, the CPU saturates first and latency builds
+up in the kernel's accept queue and the event loop, where no bound applies.
+--slow-disk-ms runs the app as bench/slow_disk.py, with a database that
+takes that long per written record, which makes it the bottleneck.
+
+    python bench/ingest_overload.py --seconds 10 --slow-disk-ms 2
+"""
+import argparse
+import asyncio
+import json
+import os
+import statistics
+import tempfile
+import time
+from typing import Dict, List, Tuple
+
+from common import percentile, start_app, stop_app
+
+
+def _body(i: int, devices: int) -> bytes:
+    return json.dumps({"id": f"ESP32_{i % devices:06X}", "payload": "9A3FC7A040", "date": "2025-11-07",
+                       "time": f"{(i // 3600) % 24:02d}:{(i // 60) % 60:02d}:{i % 60:02d}", "seq": i}).encode()
+
+
+class _Connections:
+    """Pool of keep-alive HTTP/1.1 connections for raw requests, httpx costs
+    more CPU per request than the app and could not offer the load. A request
+    waits for a free connection once `size` are busy, like a fleet of that
+    many clients."""
+
+    def __init__(self, base: str, size: int) -> None:
+        host, port = base.rsplit("//", 1)[1].split(":")
+        self._host, self._port = host, int(port)
+        self._idle: List[Tuple[asyncio.StreamReader, asyncio.StreamWriter]] = []
+        self._free = asyncio.Semaphore(size)
+
+    async def post(self, path: str, body: bytes) -> int:
+        async with self._free:
+            if self._idle:
+                reader, writer = self._idle.pop()
+            else:
+                reader, writer = await asyncio.open_connection(self._host, self._port)
+            writer.write(b"POST %b HTTP/1.1\r\nHost: bench\r\nContent-Type: application/json\r\n"
+                         b"Content-Length: %d\r\n\r\n%b" % (path.encode(), len(body), body))
+            head = await reader.readuntil(b"\r\n\r\n")
+            length = 0
+            for line in head.split(b"\r\n"):
+                if line[:15].lower() == b"content-length:":
+                    length = int(line[15:])
+            await reader.readexactly(length)
+            self._idle.append((reader, writer))
+            return int(head[9:12])
+
+    def close(self) -> None:
+        for _, writer in self._idle:
+            writer.close()
+
+
+async def _capacity(base: str, clients: int, seconds: float, devices: int) -> float:
+    done = 0
+    deadline = time.perf_counter() + seconds
+    connections = _Connections(base, clients)
+
+    async def _client(k: int) -> None:
+        nonlocal done
+        i = k
+        while time.perf_counter() < deadline:
+            status = await connections.post("/ingest", _body(i, devices))
+            if status != 200:
+                raise RuntimeError(f"/ingest answered {status}")
+            done += 1
+            i += clients
+
+    start = time.perf_counter()
+    await asyncio.gather(*(_client(k) for k in range(clients)))
+    elapsed = time.perf_counter() - start
+    connections.close()
+    return done / elapsed
+
+
+async def _overload(base: str, rate: float, seconds: float, devices: int, offset: int, clients: int) -> dict:
+    latencies: Dict[int, List[float]] = {200: [], 503: []}
+    other = 0
+    connections = _Connections(base, clients)
+    bodies = [_body(offset + i, devices) for i in range(int(rate * seconds) + 1)]
+
+    async def _post(i: int, due: float) -> None:
+        nonlocal other
+        try:
+            status = await connections.post("/ingest", bodies[i])
+        except (OSError, asyncio.IncompleteReadError):
+            other += 1
+            return
+        if status in latencies:
+            latencies[status].append((time.perf_counter() - due) * 1000.0)
+        else:
+            other += 1
+
+    posts = []
+    interval = 1.0 / rate
+    start = time.perf_counter()
+    due = start
+    while due < start + seconds and len(posts) < len(bodies):
+        posts.append(asyncio.create_task(_post(len(posts), due)))
+        due += interval
+        await asyncio.sleep(max(0.0, due - time.perf_counter()))
+    await asyncio.gather(*posts)
+    elapsed = time.perf_counter() - start
+    connections.close()
+
+    accepted = latencies[200]
+    return {
+        "offered": len(posts),
+        "accepted": len(accepted),
+        "rejected_503": len(latencies[503]),
+        "errors": other,
+        "accepted_per_s": round(len(accepted) / elapsed, 1),
+        "p50_ms": round(statistics.median(accepted), 1) if accepted else None,
+        "p99_ms": round(percentile(accepted, 0.99), 1) if accepted else None,
+        "max_ms": round(max(accepted), 1) if accepted else None,
+        "rejected_p99_ms": round(percentile(latencies[503], 0.99), 1) if latencies[503] else None,
+    }
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--seconds", type=float, default=10.0)
+    parser.add_argument("--clients", type=int, default=32, help="connections posting back to back for the capacity")
+    parser.add_argument("--fleet", type=int, default=2000, help="connections the overload is offered over")
+    parser.add_argument("--devices", type=int, default=100000)
+    parser.add_argument("--factor", type=float, default=2.0, help="offered load as a multiple of capacity")
+    parser.add_argument("--slow-disk-ms", type=float, default=0.0, help="database time per written record")
+    args = parser.parse_args()
+
+    rate = None
+    offset = 0
+    for max_pending in (None, "0"):
+        db_path = os.path.join(tempfile.mkdtemp(prefix="tc-bench-"), "bench.db")
+        env = {"INGEST_DEVICE_RATE": os.getenv("INGEST_DEVICE_RATE", "1.0")}
+        if max_pending is not None:
+            env["INGEST_MAX_PENDING"] = max_pending
+        app = "main:app"
+        if args.slow_disk_ms:
+            env["SLOW_DISK_MS"] = str(args.slow_disk_ms)
+            app = "bench.slow_disk:app"
+        proc, base = start_app(db_path, env, app)
+        try:
+            if rate is None:
+                capacity = asyncio.run(_capacity(base, args.clients, args.seconds, args.devices))
+                rate = capacity * args.factor
+                print(json.dumps({"capacity_per_s": round(capacity, 1), "offered_per_s": round(rate, 1)}),
+                      flush=True)
+                offset = args.devices
+            result = asyncio.run(_overload(base, rate, args.seconds, args.devices, offset, args.fleet))
+            result["max_pending"] = "default" if max_pending is None else "unbounded"
+            print(json.dumps(result), flush=True)
+        finally:
+            stop_app(proc)
+
+
+if __name__ == "__main__":
+    main()
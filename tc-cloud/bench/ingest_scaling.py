@@ -0,0 +1,125 @@
+"""Measure MQTT ingest throughput against a local broker for 1..N workers.
+
+Needs a broker on MQTT_HOST:MQTT_PORT (e.g. `mosquitto -p 1883`). For every
+worker count it starts `ingest_worker.py`, publishes --messages telemetry
+messages spread over --devices devices and reports how long it takes until all
+rows are in the database. One JSON object per line is printed.
+
+    python bench/ingest_scaling.py --workers 1 2 4 8 --messages 50000
+"""
+import argparse
+import asyncio
+import json
+import os
+import sqlite3
+import subprocess
+import sys
+import tempfile
+import time
+import uuid
+
+from gmqtt import Client as MQTTClient
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+APP_DIR = os.path.dirname(HERE)
+
+
+def _message(device: int, i: int) -> bytes:
+    return json.dumps({
+        "id": f"ESP32_{device:06X}",
+        "payload": "9A3FC7A040",
+        "date": "2025-11-07",
+        "time": f"{(i // 3600) % 24:02d}:{(i // 60) % 60:02d}:{i % 60:02d}",
+    }, separators=(",", ":")).encode()
+
+
+async def _publish(host: str, port: int, messages: int, devices: int, publishers: int) -> None:
+    async def _one(p: int) -> None:
+        client = MQTTClient(f"bench-pub-{uuid.uuid4().hex[:8]}")
+        await client.connect(host, port)
+        for i in range(p, messages, publishers):
+            device = i % devices
+            client.publish(f"tc-bn/telemetry/ESP32_{device:06X}", _message(device, i), qos=1)
+            if i % 1000 == 0:
+                await asyncio.sleep(0)
+        await client.disconnect()
+
+    await asyncio.gather(*(_one(p) for p in range(publishers)))
+
+
+def _count(db_path: str) -> int:
+    try:
+        conn = sqlite3.connect(db_path, timeout=30.0)
+        try:
+            return conn.execute("SELECT COUNT(*) FROM telemetry").fetchone()[0]
+        finally:
+            conn.close()
+    except sqlite3.Error:
+        return 0
+
+
+def run(workers: int, args: argparse.Namespace) -> dict:
+    db_path = os.path.join(tempfile.mkdtemp(prefix="tc-bench-"), "bench.db")
+    env = dict(os.environ,
+               DATABASE_PATH=db_path,
+               MQTT_HOST=args.host,
+               MQTT_PORT=str(args.port),
+               MQTT_CLIENT_ID=f"bench-{uuid.uuid4().hex[:8]}",
+               MQTT_CLEAN_SESSION="true",
+               LOG_LEVEL="WARNING")
+    proc = subprocess.Popen(
+        [sys.executable, "ingest_worker.py", "--workers", str(workers),
+         "--mode", args.mode, "--group", f"bench-{uuid.uuid4().hex[:8]}"],
+        cwd=APP_DIR, env=env)
+    try:
+        time.sleep(args.warmup)
+        start = time.perf_counter()
+        asyncio.run(_publish(args.host, args.port, args.messages, args.devices, args.publishers))
+        published = time.perf_counter()
+
+        deadline = published + args.timeout
+        stored = 0
+        while time.perf_counter() < deadline:
+            stored = _count(db_path)
+            if stored >= args.messages:
+                break
+            time.sleep(0.05)
+        elapsed = time.perf_counter() - start
+    finally:
+        proc.terminate()
+        proc.wait()
+
+    return {
+        "workers": workers,
+        "mode": args.mode,
+        "messages": args.messages,
+        "stored": stored,
+        "publish_s": round(published - start, 3),
+        "total_s": round(elapsed, 3),
+        "rows_per_s": round(stored / elapsed, 1),
+    }
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--host", default=os.getenv("MQTT_HOST", "127.0.0.1"))
+    parser.add_argument("--port", type=int, default=int(os.getenv("MQTT_PORT", "1883")))
+    parser.add_argument("--workers", type=int, nargs="+", default=[1, 2, 4, 8])
+    parser.add_argument("--mode", choices=("partition", "shared"), default="partition")
+    parser.add_argument("--messages", type=int, default=20000)
+    parser.add_argument("--devices", type=int, default=1000)
+    parser.add_argument("--publishers", type=int, default=4)
+    parser.add_argument("--warmup", type=float, default=2.0, help="seconds to wait for workers to subscribe")
+    parser.add_argument("--timeout", type=float, default=120.0)
+    args = parser.parse_args()
+
+    baseline = None
+    for n in args.workers:
+        result = run(n, args)
+        baseline = baseline or result["rows_per_s"]
+        result["speedup"] = round(result["rows_per_s"] / baseline, 2) if baseline else None
+        print(json.dumps(result), flush=True)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,89 @@
+"""Check resample.py against the pandas code it replaced, and time both.
+
+Generates --rows records over --devices devices and --days days, with whole
+minute times so that half hours (rounded to the even hour), equal distances
+on both sides of an hour and equal times are common. Both versions get the
+rows in the order the app reads them (newest id first); the CSVs must be
+identical. Prints one JSON object per run with both timings. Needs pandas.
+
+The old code sorted by time with pandas' default unstable quicksort, so which
+of several records with the very same date and time it kept was up to numpy.
+The reference here sorts stably, which keeps the first one read, the newest.
+
+    python bench/resample.py --rows 1000000 --days 30
+"""
+import argparse
+import io
+import json
+import os
+import random
+import sys
+import time
+
+import pandas as pd
+
+sys.path.insert(0, os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+
+from resample import HourlyResampler  # noqa: E402
+
+
+def _pandas(items):
+    # the /download-csv-processed implementation before resample.py, with a stable first sort
+    df = pd.DataFrame(items)
+    df['datetime'] = pd.to_datetime(df['date'] + ' ' + df['time'])
+    df = df.sort_values(by='datetime', ascending=False, kind='stable')
+    df['hour'] = df['datetime'].dt.round('h')
+    df['distance_to_hour'] = abs(df['datetime'] - df['hour'])
+    df = df.sort_values(by=['hour', 'distance_to_hour'], ascending=[False, True])
+    df = df.drop_duplicates(subset=['hour'])
+    df = df.head(12)
+    df.drop(['id', 'datetime', 'distance_to_hour'], axis=1, inplace=True)
+    buffer = io.StringIO()
+    df.to_csv(buffer, index=False)
+    return buffer.getvalue()
+
+
+def _rows(rows: int, devices: int, days: int, seed: int):
+    rng = random.Random(seed)
+    start = 1762473600 - days * 86400
+    out = []
+    for i in range(rows):
+        t = start + rng.randrange(days * 1440) * 60
+        tm = time.gmtime(t)
+        out.append((i + 1, f"ESP32_{rng.randrange(devices):06X}", round(rng.uniform(98.0, 108.0), 2),
+                    round(rng.uniform(5.0, 15.0), 2), rng.randrange(101), time.strftime("%Y-%m-%d", tm),
+                    time.strftime("%H:%M:%S", tm), time.strftime("%Y-%m-%d %H:%M:%S", time.gmtime(start + i))))
+    out.reverse()
+    return out
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--rows", type=int, default=1000000)
+    parser.add_argument("--devices", type=int, default=1000)
+    parser.add_argument("--days", type=int, default=30)
+    parser.add_argument("--seeds", type=int, default=3)
+    args = parser.parse_args()
+
+    keys = ("id", "device_id", "longitude", "latitude", "battery", "date", "time", "inserted_at")
+    for seed in range(args.seeds):
+        rows = _rows(args.rows, args.devices, args.days, seed)
+        start = time.perf_counter()
+        expected = _pandas([dict(zip(keys, r)) for r in rows])
+        pandas_s = time.perf_counter() - start
+
+        start = time.perf_counter()
+        resampler = HourlyResampler(12)
+        for r in rows:
+            resampler.add(r[1:])
+        got = resampler.to_csv()
+        single_pass_s = time.perf_counter() - start
+        print(json.dumps({"rows": args.rows, "seed": seed, "identical": got == expected,
+                          "pandas_s": round(pandas_s, 2), "single_pass_s": round(single_pass_s, 2)}), flush=True)
+        if got != expected:
+            print(expected, got, sep="\n---\n")
+            sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
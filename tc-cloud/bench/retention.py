@@ -0,0 +1,115 @@
+"""/ingest latency as history grows, and while retention drops old partitions.
+
+Starts the app with uvicorn on a scratch database. Growth: seeds --rows-per-day
+rows for each of --days past days in --steps steps, and after every step posts
+--posts records for today one at a time; latency should stay flat, an insert
+only touches today's partition. Retention: restarts the app with
+RETENTION_DAYS=1 and posts at --rate for --seconds while the retention job
+rolls up and drops every seeded day. Prints one JSON object per measurement.
+
+    python bench/retention.py --days 30 --rows-per-day 50000 --steps 3
+"""
+import argparse
+import json
+import os
+import random
+import sqlite3
+import statistics
+import tempfile
+import time
+
+import httpx
+
+from common import percentile, seed, start_app, stop_app
+
+DAY = 86400
+
+
+def _seed_days(db_path: str, first_day: int, days: int, rows_per_day: int, devices: int) -> None:
+    rng = random.Random(first_day)
+
+    def _rows():
+        for day in range(first_day, first_day + days):
+            base = int(time.time()) // DAY * DAY - day * DAY
+            date = time.strftime("%Y-%m-%d", time.gmtime(base))
+            for i in range(rows_per_day):
+                s = i * DAY // rows_per_day
+                yield (f"ESP32_{rng.randrange(devices):06X}", round(rng.uniform(98.0, 108.0), 2),
+                       round(rng.uniform(5.0, 15.0), 2), rng.randrange(101), date,
+                       f"{s // 3600:02d}:{s // 60 % 60:02d}:{s % 60:02d}")
+
+    seed(db_path, _rows())
+
+
+def _body(i: int) -> dict:
+    return {"id": f"ESP32_BENCH{i % 10}", "payload": "9A3FC7A040", "date": time.strftime("%Y-%m-%d", time.gmtime()),
+            "time": time.strftime("%H:%M:%S", time.gmtime()), "seq": i}
+
+
+def _latencies(client: httpx.Client, start: int, posts: int, interval: float = 0.0) -> list:
+    latencies = []
+    for i in range(start, start + posts):
+        began = time.perf_counter()
+        client.post("/ingest", json=_body(i)).raise_for_status()
+        latencies.append((time.perf_counter() - began) * 1000.0)
+        if interval:
+            time.sleep(max(0.0, interval - (time.perf_counter() - began)))
+    return latencies
+
+
+def _summary(latencies: list) -> dict:
+    return {"posts": len(latencies), "p50_ms": round(statistics.median(latencies), 2),
+            "p99_ms": round(percentile(latencies, 0.99), 2), "max_ms": round(max(latencies), 2)}
+
+
+def _partitions(db_path: str) -> int:
+    conn = sqlite3.connect(db_path)
+    try:
+        return conn.execute("SELECT COUNT(*) FROM telemetry_partitions").fetchone()[0]
+    finally:
+        conn.close()
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--days", type=int, default=30)
+    parser.add_argument("--rows-per-day", type=int, default=50000)
+    parser.add_argument("--devices", type=int, default=1000)
+    parser.add_argument("--steps", type=int, default=3)
+    parser.add_argument("--posts", type=int, default=1000)
+    parser.add_argument("--rate", type=float, default=100.0, help="posts per second during retention")
+    parser.add_argument("--seconds", type=float, default=30.0)
+    args = parser.parse_args()
+
+    db_path = os.path.join(tempfile.mkdtemp(prefix="tc-bench-"), "bench.db")
+    seq = 0
+    proc, base = start_app(db_path)
+    try:
+        with httpx.Client(base_url=base, timeout=120.0) as client:
+            print(json.dumps({"history_rows": 0, **_summary(_latencies(client, seq, args.posts))}), flush=True)
+            seq += args.posts
+            per_step = -(-args.days // args.steps)
+            for first in range(1, args.days + 1, per_step):
+                days = min(per_step, args.days + 1 - first)
+                seed_start = time.perf_counter()
+                _seed_days(db_path, first, days, args.rows_per_day, args.devices)
+                seed_s = time.perf_counter() - seed_start
+                print(json.dumps({"history_rows": (first + days - 1) * args.rows_per_day, "seed_s": round(seed_s, 1),
+                                  **_summary(_latencies(client, seq, args.posts))}), flush=True)
+                seq += args.posts
+    finally:
+        stop_app(proc)
+
+    before = _partitions(db_path)
+    proc, base = start_app(db_path, {"RETENTION_DAYS": "1", "RETENTION_INTERVAL": "1"})
+    try:
+        with httpx.Client(base_url=base, timeout=120.0) as client:
+            latencies = _latencies(client, seq, int(args.rate * args.seconds), 1.0 / args.rate)
+        print(json.dumps({"retention": True, "partitions_before": before, "partitions_after": _partitions(db_path),
+                          **_summary(latencies)}), flush=True)
+    finally:
+        stop_app(proc)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,132 @@
+"""Time the track simplification behind /tracks/simplified.
+
+Generates a --points track on the payload's uint16 grid and simplifies it at
+every --tolerance, in process. Two tracks: "vehicle" drives trips at city
+and highway speeds with stops, sampled every --interval seconds; "random walk"
+moves to another grid cell on every sample, the worst case for the
+preprocessing and for Douglas-Peucker. Prints one JSON object per track and
+tolerance with the points left after dropping repeated cells, the points kept
+and the milliseconds taken.
+
+With --http the vehicle track is also stored for one device in a scratch
+database and fetched through the endpoint, which adds reading it from SQLite.
+
+    python bench/simplify.py --points 1000000 --tolerance 0 100 500 2000
+"""
+import argparse
+import json
+import math
+import os
+import tempfile
+import time
+
+import httpx
+import numpy as np
+
+from common import seed, start_app, stop_app
+from simplify import GRID_STEPS, simplify_track  # the app's, common puts it first on sys.path
+
+START = 1762473600  # 2025-11-07T00:00:00Z
+_M_PER_DEG = 111320.0
+
+
+def _vehicle(points: int, interval: float, rng: np.random.Generator) -> np.ndarray:
+    # speed in m/s per sample: trips of 10 min to 2 h, stops of 5 min to 10 h
+    speed = np.zeros(points)
+    i = 0
+    while i < points:
+        trip = int(rng.uniform(600, 7200) / interval)
+        speed[i:i + trip] = rng.choice([8.0, 14.0, 30.0]) * rng.uniform(0.5, 1.0, size=len(speed[i:i + trip]))
+        i += trip + int(rng.uniform(300, 36000) / interval)
+    heading = np.cumsum(rng.normal(0.0, 0.15, size=points))
+    lat = 13.75 + np.cumsum(speed * interval * np.cos(heading)) / _M_PER_DEG
+    lat = 90.0 - np.abs(180.0 - np.mod(lat + 90.0, 360.0))  # bounce off the poles
+    lon = 100.5 + np.cumsum(speed * interval * np.sin(heading) / (_M_PER_DEG * np.maximum(0.01, np.cos(np.radians(lat)))))
+    lon = np.mod(lon + 180.0, 360.0) - 180.0
+    return _grid(lon, lat, interval)
+
+
+def _random_walk(points: int, interval: float, rng: np.random.Generator) -> np.ndarray:
+    steps = rng.integers(-3, 4, size=(points, 2))
+    steps[(steps == 0).all(axis=1), 0] = 1
+    lon = np.mod(30000 + np.cumsum(steps[:, 0]), GRID_STEPS + 1)
+    lat = np.clip(45000 + np.cumsum(steps[:, 1]), 0, GRID_STEPS)
+    t = (np.arange(points) * interval).astype(np.int64)
+    return np.stack([lon, lat, t], axis=1).astype(np.int64)
+
+
+def _grid(lon: np.ndarray, lat: np.ndarray, interval: float) -> np.ndarray:
+    lon_q = np.round((lon + 180.0) / 360.0 * GRID_STEPS)
+    lat_q = np.round((lat + 90.0) / 180.0 * GRID_STEPS)
+    t = np.arange(len(lon)) * interval
+    return np.stack([lon_q, lat_q, t], axis=1).astype(np.int64)
+
+
+def _moved(points: np.ndarray) -> int:
+    return 1 + int(np.count_nonzero(np.any(points[1:, :2] != points[:-1, :2], axis=1)))
+
+
+def _time(points: np.ndarray, tolerance: float, repeat: int):
+    best, kept = math.inf, 0
+    for _ in range(repeat):
+        start = time.perf_counter()
+        kept = len(simplify_track(points, tolerance))
+        best = min(best, time.perf_counter() - start)
+    return kept, best * 1000.0
+
+
+def _seed(db_path: str, points: np.ndarray) -> None:
+    def _rows():
+        for lon_q, lat_q, t in points.tolist():
+            ts = time.gmtime(START + t)
+            yield ("ESP32_000001", round(lon_q / GRID_STEPS * 360.0 - 180.0, 2),
+                   round(lat_q / GRID_STEPS * 180.0 - 90.0, 2), 50,
+                   time.strftime("%Y-%m-%d", ts), time.strftime("%H:%M:%S", ts))
+
+    seed(db_path, _rows())
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--points", type=int, default=1000000)
+    parser.add_argument("--interval", type=float, default=15.0, help="seconds between samples")
+    parser.add_argument("--tolerance", type=float, nargs="+", default=[0.0, 100.0, 500.0, 2000.0])
+    parser.add_argument("--repeat", type=int, default=3)
+    parser.add_argument("--http", action="store_true", help="also time /tracks/simplified end to end")
+    args = parser.parse_args()
+
+    rng = np.random.default_rng(1)
+    tracks = {
+        "vehicle": _vehicle(args.points, args.interval, rng),
+        "random walk": _random_walk(args.points, args.interval, rng),
+    }
+    for name, points in tracks.items():
+        moved = _moved(points)
+        for tolerance in args.tolerance:
+            kept, ms = _time(points, tolerance, args.repeat)
+            print(json.dumps({"track": name, "points": len(points), "moved": moved, "tolerance_m": tolerance,
+                              "kept": kept, "ms": round(ms, 1)}), flush=True)
+
+    if not args.http:
+        return
+    db_path = os.path.join(tempfile.mkdtemp(prefix="tc-bench-"), "bench.db")
+    proc, base = start_app(db_path)
+    try:
+        seed_start = time.perf_counter()
+        _seed(db_path, tracks["vehicle"])
+        print(json.dumps({"rows": args.points, "seed_s": round(time.perf_counter() - seed_start, 1)}), flush=True)
+        with httpx.Client(base_url=base, timeout=300.0) as client:
+            for tolerance in args.tolerance:
+                start = time.perf_counter()
+                r = client.get("/tracks/simplified", params={"device_id": "ESP32_000001", "tolerance_m": tolerance})
+                r.raise_for_status()
+                line = json.loads(r.text)
+                print(json.dumps({"track": "vehicle via /tracks/simplified", "points": line["points"],
+                                  "tolerance_m": tolerance, "kept": line["kept"],
+                                  "ms": round((time.perf_counter() - start) * 1000.0, 1)}), flush=True)
+    finally:
+        stop_app(proc)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,25 @@
+"""main:app with a slow disk, for benches that need the database to be the
+bottleneck on a machine whose disk is fast.
+
+Every write the SQLite writer commits first sleeps SLOW_DISK_MS milliseconds,
+without holding the GIL, so capacity is about 1000 / SLOW_DISK_MS records per
+second and the CPU stays free for the load generator.
+
+    start_app(db_path, {"SLOW_DISK_MS": "2"}, app="bench.slow_disk:app")
+"""
+import os
+import time
+
+import main
+
+_DELAY = float(os.getenv("SLOW_DISK_MS", "0")) / 1000.0
+_commit = main.SQLite._commit
+
+
+def _slow_commit(self, batch):
+    time.sleep(_DELAY * len(batch))
+    _commit(self, batch)
+
+
+main.SQLite._commit = _slow_commit
+app = main.app
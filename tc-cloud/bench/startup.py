@@ -0,0 +1,87 @@
+"""Time a cold start of the app, from process start to its first served request.
+
+Seeds a scratch database with --rows rows over --devices devices, then starts
+uvicorn on it --repeat times. Every start polls /health/live until the first
+200 (the app serves requests) and then /health/ready until the latest state
+has been loaded in the background. MQTT is disabled, the broker connection is
+not on the startup path any more. Prints one JSON object per start and the
+medians, next to the time `python -c "import fastapi, uvicorn"` alone takes,
+the floor any FastAPI app pays on this machine; app_ms is the rest.
+
+    python bench/startup.py --rows 1000000 --devices 10000
+"""
+import argparse
+import json
+import os
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+import httpx
+
+from common import APP_DIR, free_port, seed, start_app, stop_app
+
+
+def _wait(client: httpx.Client, url: str, proc: subprocess.Popen) -> None:
+    while proc.poll() is None:
+        try:
+            if client.get(url).status_code == 200:
+                return
+        except httpx.HTTPError:
+            pass
+        time.sleep(0.002)
+    raise RuntimeError(f"app exited with {proc.returncode}")
+
+
+def _start(db_path: str) -> dict:
+    port = free_port()
+    env = dict(os.environ, DATABASE_PATH=db_path, MQTT_ENABLED="false", LOG_LEVEL="WARNING")
+    start = time.perf_counter()
+    proc = subprocess.Popen(
+        [sys.executable, "-m", "uvicorn", "main:app", "--port", str(port), "--log-level", "warning"],
+        cwd=APP_DIR, env=env)
+    try:
+        with httpx.Client(base_url=f"http://127.0.0.1:{port}", timeout=5.0) as client:
+            _wait(client, "/health/live", proc)
+            first = time.perf_counter() - start
+            _wait(client, "/health/ready", proc)
+            ready = time.perf_counter() - start
+    finally:
+        stop_app(proc)
+    return {"first_request_ms": round(first * 1000), "ready_ms": round(ready * 1000)}
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--rows", type=int, default=1000000)
+    parser.add_argument("--devices", type=int, default=10000)
+    parser.add_argument("--repeat", type=int, default=5)
+    args = parser.parse_args()
+
+    db_path = os.path.join(tempfile.mkdtemp(prefix="tc-bench-"), "bench.db")
+    proc, _ = start_app(db_path)
+    stop_app(proc)
+    seed(db_path, ((f"ESP32_{i % args.devices:06X}", 100.5, 13.6, i % 100, "2025-11-07",
+                    f"{(i // 3600) % 24:02d}:{(i // 60) % 60:02d}:{i % 60:02d}") for i in range(args.rows)))
+
+    floor = []
+    for _ in range(args.repeat):
+        start = time.perf_counter()
+        subprocess.run([sys.executable, "-c", "import fastapi, uvicorn"], check=True)
+        floor.append(time.perf_counter() - start)
+
+    runs = []
+    for _ in range(args.repeat):
+        runs.append(_start(db_path))
+        print(json.dumps(runs[-1]), flush=True)
+    floor_ms = round(statistics.median(floor) * 1000)
+    first_ms = statistics.median(r["first_request_ms"] for r in runs)
+    print(json.dumps({"rows": args.rows, "devices": args.devices, "import_fastapi_uvicorn_ms": floor_ms,
+                      "first_request_ms": first_ms, "app_ms": first_ms - floor_ms,
+                      "ready_ms": statistics.median(r["ready_ms"] for r in runs)}), flush=True)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,147 @@
+"""Measure /ingest throughput with many /stream viewers connected.
+
+Starts the app with uvicorn on a scratch database and runs two phases: without
+viewers, then with --viewers SSE connections held open by a separate process.
+--slow of those viewers never read their stream, so their sockets fill up and
+the server has to drop records for them instead of waiting. Each phase posts
+telemetry from --concurrency clients for --seconds and prints one JSON object
+with rows/s, latency percentiles, the CPU seconds the app spent and how many
+bytes the viewers received.
+
+On a machine with few cores the viewer process competes with the app for the
+CPU, compare app_cpu_s per request between the phases rather than rows/s.
+
+    python bench/stream_viewers.py --viewers 1000 --slow 100 --seconds 10
+"""
+import argparse
+import asyncio
+import json
+import multiprocessing
+import os
+import resource
+import statistics
+import tempfile
+import time
+
+import httpx
+
+from common import percentile, start_app, stop_app
+
+
+def _body(i: int) -> dict:
+    return {
+        "id": f"ESP32_{i % 1000:06X}",
+        "payload": "9A3FC7A040",
+        "date": "2025-11-07",
+        "time": f"{(i // 3600) % 24:02d}:{(i // 60) % 60:02d}:{i % 60:02d}",
+    }
+
+
+def _viewers(base: str, viewers: int, slow: int, ready, stop, results) -> None:
+    async def _run() -> None:
+        received = 0
+        limits = httpx.Limits(max_connections=None, max_keepalive_connections=None)
+        async with httpx.AsyncClient(base_url=base, timeout=None, limits=limits) as client:
+            async def _view(reads: bool) -> None:
+                nonlocal received
+                async with client.stream("GET", "/stream") as r:
+                    if not reads:
+                        await asyncio.Event().wait()
+                    async for chunk in r.aiter_raw():
+                        received += len(chunk)
+
+            tasks = [asyncio.create_task(_view(i >= slow)) for i in range(viewers)]
+            # give every viewer time to connect before the ingest phase starts
+            await asyncio.sleep(max(2.0, viewers / 200.0))
+            ready.set()
+            await asyncio.get_running_loop().run_in_executor(None, stop.wait)
+            for task in tasks:
+                task.cancel()
+            await asyncio.gather(*tasks, return_exceptions=True)
+        results.put({"bytes_received": received})
+
+    asyncio.run(_run())
+
+
+async def _ingest(base: str, seconds: float, concurrency: int) -> dict:
+    latencies = []
+    async with httpx.AsyncClient(base_url=base, timeout=60.0) as client:
+        deadline = time.perf_counter() + seconds
+
+        async def _worker(w: int) -> None:
+            i = w
+            while time.perf_counter() < deadline:
+                start = time.perf_counter()
+                r = await client.post("/ingest", json=_body(i))
+                r.raise_for_status()
+                latencies.append((time.perf_counter() - start) * 1000.0)
+                i += concurrency
+
+        start = time.perf_counter()
+        await asyncio.gather(*(_worker(w) for w in range(concurrency)))
+        elapsed = time.perf_counter() - start
+
+    return {
+        "requests": len(latencies),
+        "rows_per_s": round(len(latencies) / elapsed, 1),
+        "p50_ms": round(statistics.median(latencies), 2),
+        "p99_ms": round(percentile(latencies, 0.99), 2),
+        "max_ms": round(max(latencies), 2),
+    }
+
+
+def _cpu_seconds(pid: int) -> float:
+    with open(f"/proc/{pid}/stat") as f:
+        fields = f.read().rsplit(")", 1)[1].split()
+    return (int(fields[11]) + int(fields[12])) / os.sysconf("SC_CLK_TCK")
+
+
+def _stream_dropped(base: str) -> int:
+    for line in httpx.get(f"{base}/metrics").text.splitlines():
+        if line.startswith("tc_stream_dropped_total"):
+            return int(float(line.split()[-1]))
+    return 0
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--viewers", type=int, default=1000)
+    parser.add_argument("--slow", type=int, default=100, help="viewers that never read their stream")
+    parser.add_argument("--seconds", type=float, default=10.0)
+    parser.add_argument("--concurrency", type=int, default=16, help="concurrent /ingest clients")
+    args = parser.parse_args()
+
+    # one socket per viewer on both sides, uvicorn inherits the limit
+    _, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    resource.setrlimit(resource.RLIMIT_NOFILE, (hard, hard))
+
+    db_path = os.path.join(tempfile.mkdtemp(prefix="tc-bench-"), "bench.db")
+    proc, base = start_app(db_path)
+    try:
+        for viewers in (0, args.viewers):
+            ready, stop = multiprocessing.Event(), multiprocessing.Event()
+            results = multiprocessing.Queue()
+            viewer_proc = None
+            if viewers:
+                viewer_proc = multiprocessing.Process(
+                    target=_viewers, args=(base, viewers, min(args.slow, viewers), ready, stop, results))
+                viewer_proc.start()
+                ready.wait()
+
+            result = {"viewers": viewers, "slow_viewers": min(args.slow, viewers) if viewers else 0}
+            cpu, dropped = _cpu_seconds(proc.pid), _stream_dropped(base)
+            result.update(asyncio.run(_ingest(base, args.seconds, args.concurrency)))
+            result["app_cpu_s"] = round(_cpu_seconds(proc.pid) - cpu, 2)
+            result["stream_dropped"] = _stream_dropped(base) - dropped
+            if viewer_proc is not None:
+                time.sleep(1.0)
+                stop.set()
+                result.update(results.get())
+                viewer_proc.join()
+            print(json.dumps(result), flush=True)
+    finally:
+        stop_app(proc)
+
+
+if __name__ == "__main__":
+    main()
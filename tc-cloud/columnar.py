@@ -0,0 +1,106 @@
+"""Columnar (Arrow / Parquet) encoding of telemetry exports.
+
+Rows come from SQLite in keyset batches, are turned into Arrow record
+batches with real types (sample and insert times as UTC timestamps, battery
+as an integer) and written with an Arrow IPC stream or Parquet writer whose
+output is handed back chunk by chunk, so an export streams in about one
+batch of memory. Parquet gets one row group per batch.
+
+pyarrow is imported on first use, the rest of the app never pays for it.
+"""
+from typing import Any, List, Optional, Sequence, Tuple
+
+# columns read by SQLite.export_batch, in this order
+SQL_COLUMNS = ("id, device_id, longitude, latitude, battery, t, "
+               "CAST(strftime('%s', inserted_at) AS INTEGER), seq")
+PARQUET_COMPRESSION = ("none", "snappy", "zstd")
+ARROW_COMPRESSION = ("none", "lz4", "zstd")
+
+_schema = None
+
+
+def _pa():
+    import pyarrow
+    return pyarrow
+
+
+def schema():
+    global _schema
+    if _schema is None:
+        pa = _pa()
+        _schema = pa.schema([
+            ("id", pa.int64()),
+            ("device_id", pa.string()),
+            ("longitude", pa.float64()),
+            ("latitude", pa.float64()),
+            ("battery", pa.int16()),
+            ("sample_time", pa.timestamp("s", tz="UTC")),
+            ("inserted_at", pa.timestamp("s", tz="UTC")),
+            ("seq", pa.int64()),
+        ])
+    return _schema
+
+
+def record_batch(rows: Sequence[Tuple]) -> Any:
+    """Record batch of rows shaped like SQL_COLUMNS"""
+    columns = list(zip(*rows)) if rows else [()] * len(schema())
+    return _pa().RecordBatch.from_arrays(
+        [_pa().array(c, type=f.type) for c, f in zip(columns, schema())], schema=schema())
+
+
+class _Chunks:
+    """Write-only file that collects what the writer produced since the last take()"""
+
+    def __init__(self) -> None:
+        self._parts: List[bytes] = []
+        self._pos = 0
+        self.closed = False
+
+    def write(self, data) -> int:
+        data = bytes(data)
+        self._parts.append(data)
+        self._pos += len(data)
+        return len(data)
+
+    def tell(self) -> int:
+        return self._pos
+
+    def flush(self) -> None:
+        pass
+
+    def close(self) -> None:
+        self.closed = True
+
+    def take(self) -> bytes:
+        data = b"".join(self._parts)
+        self._parts = []
+        return data
+
+
+class Encoder:
+    """Incremental Parquet or Arrow IPC stream encoder, not thread safe"""
+
+    def __init__(self, fmt: str, compression: str) -> None:
+        pa = _pa()
+        self._chunks = _Chunks()
+        sink = pa.PythonFile(self._chunks, mode="w")
+        codec: Optional[str] = None if compression == "none" else compression
+        if fmt == "parquet":
+            import pyarrow.parquet as pq
+            self._writer = pq.ParquetWriter(sink, schema(), compression=codec or "none")
+            self._write = self._writer.write_batch
+        else:
+            options = pa.ipc.IpcWriteOptions(compression=codec)
+            self._writer = pa.ipc.new_stream(sink, schema(), options=options)
+            self._write = self._writer.write_batch
+
+    def write(self, batch: Any) -> bytes:
+        """Encode one record batch, returns the bytes ready to send"""
+        if batch.num_rows:
+            self._write(batch)
+        return self._chunks.take()
+
+    def close(self) -> bytes:
+        """Finish the file (Parquet footer, IPC end of stream), returns the last bytes"""
+        self._writer.close()
+        return self._chunks.take()
@@ -0,0 +1,283 @@
+"""CBOR and MessagePack telemetry envelopes.
+
+The binary envelope is a map with the same fields as the JSON one, except that
+the payload is its 5 raw bytes and the sample time is one integer:
+
+    {"id": text, "payload": bytes(5), "t": unix seconds, "seq": uint, "ts": uint ms}
+
+"seq" and "ts" are optional, as in JSON. The firmware writes every integer in
+its full fixed width (CBOR allows that, and msgpack uint32/uint64 are ordinary
+encodings), so the layout only depends on the id length. firmware_fields reads
+that layout with a few slice compares; anything else goes through the general
+decoders.
+
+Only the subset an envelope needs is decoded: maps, arrays, integers, byte and
+text strings, booleans, null and floats, all of definite length. Anything else
+(indefinite lengths, msgpack ext types, nesting deeper than MAX_DEPTH, bytes
+left over) is a ValueError, like a JSON body that does not parse.
+
+The format of a body comes from its content type when there is one (HTTP
+Content-Type, the MQTT 5 content type property), otherwise from its first byte:
+JSON starts with "{" (0x7B), a CBOR map with 0xA0-0xBF and a msgpack map with
+0x80-0x8F, 0xDE or 0xDF, so they cannot be confused.
+"""
+import struct
+from typing import Any, Dict, NamedTuple, Optional, Tuple
+
+JSON = "json"
+CBOR = "cbor"
+MSGPACK = "msgpack"
+
+CONTENT_TYPES = {
+    "application/json": JSON,
+    "application/cbor": CBOR,
+    "application/msgpack": MSGPACK,
+    "application/x-msgpack": MSGPACK,
+    "application/vnd.msgpack": MSGPACK,
+}
+MAX_DEPTH = 8
+TS_MAX = 2 ** 63 - 1
+
+_U16 = struct.Struct("!H")
+_U32 = struct.Struct("!I")
+_U64 = struct.Struct("!Q")
+_I8 = struct.Struct("!b")
+_I16 = struct.Struct("!h")
+_I32 = struct.Struct("!i")
+_I64 = struct.Struct("!q")
+_F16 = struct.Struct("!e")
+_F32 = struct.Struct("!f")
+_F64 = struct.Struct("!d")
+
+
+def detect(raw: bytes, content_type: Optional[str] = None) -> str:
+    """JSON, CBOR or MSGPACK for a body, see the module docstring"""
+    if content_type:
+        fmt = CONTENT_TYPES.get(content_type.split(";", 1)[0].strip().lower())
+        if fmt is not None:
+            return fmt
+    if raw:
+        first = raw[0]
+        if 0xA0 <= first <= 0xBF:
+            return CBOR
+        if 0x80 <= first <= 0x8F or first in (0xDE, 0xDF):
+            return MSGPACK
+    return JSON
+
+
+def _key(key: Any) -> Any:
+    if not isinstance(key, (str, int)):
+        raise ValueError("Map keys must be text or integers")
+    return key
+
+
+# ------------------------------------------------------------
+# CBOR (RFC 8949)
+# ------------------------------------------------------------
+def _cbor_item(buf: bytes, pos: int, depth: int) -> Tuple[Any, int]:
+    initial = buf[pos]
+    major, info = initial >> 5, initial & 0x1F
+    pos += 1
+    if info < 24:
+        arg = info
+    elif info == 24:
+        arg = buf[pos]
+        pos += 1
+    elif info == 25:
+        arg = _U16.unpack_from(buf, pos)[0]
+        pos += 2
+    elif info == 26:
+        arg = _U32.unpack_from(buf, pos)[0]
+        pos += 4
+    elif info == 27:
+        arg = _U64.unpack_from(buf, pos)[0]
+        pos += 8
+    else:
+        raise ValueError("Indefinite length CBOR items are not supported")
+
+    if major == 0:
+        return arg, pos
+    if major == 1:
+        return -1 - arg, pos
+    if major == 2 or major == 3:
+        end = pos + arg
+        if end > len(buf):
+            raise ValueError("Truncated CBOR string")
+        value = buf[pos:end]
+        return (bytes(value) if major == 2 else value.decode("utf-8")), end
+    if major == 7:
+        if info == 20 or info == 21:
+            return info == 21, pos
+        if info == 22:
+            return None, pos
+        if info == 25:
+            return _F16.unpack_from(buf, pos - 2)[0], pos
+        if info == 26:
+            return _F32.unpack_from(buf, pos - 4)[0], pos
+        if info == 27:
+            return _F64.unpack_from(buf, pos - 8)[0], pos
+        raise ValueError("Unsupported CBOR simple value")
+    if depth >= MAX_DEPTH:
+        raise ValueError("CBOR nested too deep")
+    if major == 4:
+        items = []
+        for _ in range(arg):
+            item, pos = _cbor_item(buf, pos, depth + 1)
+            items.append(item)
+        return items, pos
+    if major == 5:
+        mapping = {}
+        for _ in range(arg):
+            key, pos = _cbor_item(buf, pos, depth + 1)
+            mapping[_key(key)], pos = _cbor_item(buf, pos, depth + 1)
+        return mapping, pos
+    # major 6: a tag, the tagged item stands for itself
+    return _cbor_item(buf, pos, depth + 1)
+
+
+def decode_cbor(raw: bytes) -> Any:
+    """The one CBOR item in raw"""
+    try:
+        value, end = _cbor_item(raw, 0, 0)
+    except (IndexError, struct.error):
+        raise ValueError("Truncated CBOR") from None
+    except UnicodeDecodeError:
+        raise ValueError("CBOR text is not UTF-8") from None
+    if end != len(raw):
+        raise ValueError("Trailing bytes after CBOR item")
+    return value
+
+
+# ------------------------------------------------------------
+# MessagePack
+# ------------------------------------------------------------
+# fixed width numbers: first byte -> struct
+_MSGPACK_NUMBERS = {
+    0xCA: _F32, 0xCB: _F64,
+    0xCC: struct.Struct("!B"), 0xCD: _U16, 0xCE: _U32, 0xCF: _U64,
+    0xD0: _I8, 0xD1: _I16, 0xD2: _I32, 0xD3: _I64,
+}
+# length prefixed items: first byte -> (length struct, kind)
+_MSGPACK_SIZED = {
+    0xC4: (struct.Struct("!B"), bytes), 0xC5: (_U16, bytes), 0xC6: (_U32, bytes),
+    0xD9: (struct.Struct("!B"), str), 0xDA: (_U16, str), 0xDB: (_U32, str),
+    0xDC: (_U16, list), 0xDD: (_U32, list),
+    0xDE: (_U16, dict), 0xDF: (_U32, dict),
+}
+
+
+def _msgpack_item(buf: bytes, pos: int, depth: int) -> Tuple[Any, int]:
+    first = buf[pos]
+    pos += 1
+    if first <= 0x7F:
+        return first, pos
+    if first >= 0xE0:
+        return first - 0x100, pos
+    if 0xA0 <= first <= 0xBF:
+        kind, n = str, first & 0x1F
+    elif first <= 0x8F:
+        kind, n = dict, first & 0x0F
+    elif first <= 0x9F:
+        kind, n = list, first & 0x0F
+    elif first == 0xC0:
+        return None, pos
+    elif first == 0xC2 or first == 0xC3:
+        return first == 0xC3, pos
+    elif first in _MSGPACK_NUMBERS:
+        number = _MSGPACK_NUMBERS[first]
+        return number.unpack_from(buf, pos)[0], pos + number.size
+    elif first in _MSGPACK_SIZED:
+        length, kind = _MSGPACK_SIZED[first]
+        n = length.unpack_from(buf, pos)[0]
+        pos += length.size
+    else:
+        raise ValueError("Unsupported msgpack type")
+
+    if kind is bytes or kind is str:
+        end = pos + n
+        if end > len(buf):
+            raise ValueError("Truncated msgpack string")
+        value = buf[pos:end]
+        return (bytes(value) if kind is bytes else value.decode("utf-8")), end
+    if depth >= MAX_DEPTH:
+        raise ValueError("msgpack nested too deep")
+    if kind is list:
+        items = []
+        for _ in range(n):
+            item, pos = _msgpack_item(buf, pos, depth + 1)
+            items.append(item)
+        return items, pos
+    mapping: Dict[Any, Any] = {}
+    for _ in range(n):
+        key, pos = _msgpack_item(buf, pos, depth + 1)
+        mapping[_key(key)], pos = _msgpack_item(buf, pos, depth + 1)
+    return mapping, pos
+
+
+def decode_msgpack(raw: bytes) -> Any:
+    """The one msgpack item in raw"""
+    try:
+        value, end = _msgpack_item(raw, 0, 0)
+    except (IndexError, struct.error):
+        raise ValueError("Truncated msgpack") from None
+    except UnicodeDecodeError:
+        raise ValueError("msgpack text is not UTF-8") from None
+    if end != len(raw):
+        raise ValueError("Trailing bytes after msgpack item")
+    return value
+
+
+# ------------------------------------------------------------
+# Firmware layout
+# ------------------------------------------------------------
+class _Layout(NamedTuple):
+    map_base: int        # map header with 0 entries
+    id_key: bytes        # "id" and the header of a short text, minus its length
+    text_base: int
+    payload_key: bytes   # "payload" and the header of 5 bytes
+    t_key: bytes         # "t" and the header of a uint32
+    seq_key: bytes       # "seq" and the header of a uint32
+    ts_key: bytes        # "ts" and the header of a uint64
+
+
+_LAYOUTS = {
+    CBOR: _Layout(0xA0, b"\x62id", 0x60, b"\x67payload\x45", b"\x61t\x1a", b"\x63seq\x1a", b"\x62ts\x1b"),
+    MSGPACK: _Layout(0x80, b"\xa2id", 0xA0, b"\xa7payload\xc4\x05", b"\xa1t\xce", b"\xa3seq\xce", b"\xa2ts\xcf"),
+}
+
+
+def firmware_fields(raw: bytes, fmt: str) -> Optional[Tuple[str, bytes, int, Optional[int], Optional[int]]]:
+    """(id, payload, t, seq, ts) when raw is in exactly the layout the firmware
+    writes, keys in this order and fixed width integers, else None"""
+    layout = _LAYOUTS[fmt]
+    id_len = raw[4] - layout.text_base if len(raw) > 4 else -1
+    if not 0 < id_len < 24 or raw[1:4] != layout.id_key:
+        return None
+    pos = 5 + id_len
+    key = layout.payload_key
+    if raw[pos:pos + len(key)] != key:
+        return None
+    pos += len(key)
+    payload = raw[pos:pos + 5]
+    pos += 5
+    if raw[pos:pos + 3] != layout.t_key or len(raw) < pos + 7:
+        return None
+    t = _U32.unpack_from(raw, pos + 3)[0]
+    pos += 7
+    entries = 3
+    seq = ts = None
+    if raw[pos:pos + 5] == layout.seq_key and len(raw) >= pos + 9:
+        seq = _U32.unpack_from(raw, pos + 5)[0]
+        pos += 9
+        entries += 1
+    if raw[pos:pos + 4] == layout.ts_key and len(raw) >= pos + 12:
+        ts = _U64.unpack_from(raw, pos + 4)[0]
+        pos += 12
+        entries += 1
+    # a ts beyond int64 does not fit the database, the general path rejects it
+    if pos != len(raw) or raw[0] != layout.map_base + entries or (ts is not None and ts > TS_MAX):
+        return None
+    try:
+        return raw[5:5 + id_len].decode(), payload, t, seq, ts
+    except UnicodeDecodeError:
+        return None
@@ -0,0 +1,189 @@
+"""Geofence evaluation for the ingest pipeline.
+
+GeofenceIndex answers "which fences contain this point" in time independent of
+the number of fences, and GeofenceEngine turns that into enter/exit transitions
+per device. Both are plain Python and only touched from the event loop.
+
+Index layout: a hierarchical grid. Level k has square cells of
+BASE_CELL_DEG * 2**k degrees and every fence is registered at the smallest
+level where its bounding box spans at most CELLS_PER_SIDE cells each way, so
+a lookup is one dict probe per level in use whatever the fence sizes. Cells
+lying entirely inside a fence match without further tests; for the others the
+candidate is checked against its bounding box and the polygon, whose edges are
+kept in horizontal slabs so the ray cast only visits the few edges crossing
+the point's latitude.
+
+Polygons are [longitude, latitude] rings (GeoJSON order) without holes that do
+not cross the antimeridian.
+"""
+import math
+from typing import Dict, FrozenSet, Iterable, List, NamedTuple, Optional, Sequence, Tuple
+
+BASE_CELL_DEG = 0.01
+MAX_LEVEL = 16  # 0.01 * 2**16 degrees covers the globe in one cell
+CELLS_PER_SIDE = 4
+_SLAB_EDGES = 4  # target edges per slab
+
+EMPTY: FrozenSet[int] = frozenset()
+
+
+class Fence(NamedTuple):
+    id: int
+    name: str
+    polygon: Tuple[Tuple[float, float], ...]
+
+
+class Transition(NamedTuple):
+    device_id: str
+    fence_id: int
+    event: str  # "enter" or "exit"
+
+
+def validate_polygon(polygon: Sequence[Sequence[float]]) -> Tuple[Tuple[float, float], ...]:
+    """Normalized ring of (lon, lat) pairs, raises ValueError if unusable"""
+    try:
+        ring = tuple((float(p[0]), float(p[1])) for p in polygon)
+    except (TypeError, ValueError, IndexError):
+        raise ValueError("Polygon must be a list of [longitude, latitude] pairs")
+    if len(ring) > 1 and ring[0] == ring[-1]:
+        ring = ring[:-1]
+    if len(ring) < 3:
+        raise ValueError("Polygon needs at least 3 distinct points")
+    for lon, lat in ring:
+        if not (-180.0 <= lon <= 180.0 and -90.0 <= lat <= 90.0) or math.isnan(lon) or math.isnan(lat):
+            raise ValueError("Polygon points must be within [-180, 180] longitude and [-90, 90] latitude")
+    if max(lon for lon, _ in ring) - min(lon for lon, _ in ring) > 180.0:
+        raise ValueError("Polygons crossing the antimeridian are not supported")
+    return ring
+
+
+class _Shape:
+    """Bounding box plus edges bucketed by latitude slab"""
+    __slots__ = ("id", "min_lon", "min_lat", "max_lon", "max_lat", "slab_h", "slabs")
+
+    def __init__(self, fence: Fence) -> None:
+        ring = fence.polygon
+        self.id = fence.id
+        self.min_lon = min(p[0] for p in ring)
+        self.max_lon = max(p[0] for p in ring)
+        self.min_lat = min(p[1] for p in ring)
+        self.max_lat = max(p[1] for p in ring)
+
+        n = max(1, len(ring) // _SLAB_EDGES)
+        self.slab_h = (self.max_lat - self.min_lat) / n or 1.0
+        self.slabs: List[List[Tuple[float, float, float, float]]] = [[] for _ in range(n)]
+        for i, (x1, y1) in enumerate(ring):
+            x2, y2 = ring[(i + 1) % len(ring)]
+            if y1 == y2:
+                continue  # horizontal edges never cross a horizontal ray
+            lo, hi = min(y1, y2), max(y1, y2)
+            # (y1, y2, x at y1, dx/dy) in every slab the edge spans
+            edge = (y1, y2, x1, (x2 - x1) / (y2 - y1))
+            for s in range(self._slab(lo), self._slab(hi) + 1):
+                self.slabs[s].append(edge)
+
+    def covers(self, min_lon: float, min_lat: float, max_lon: float, max_lat: float) -> bool:
+        """True if the rectangle is certainly inside: corners inside, no edge near it"""
+        if not all(self.contains(x, y) for x in (min_lon, max_lon) for y in (min_lat, max_lat)):
+            return False
+        for slab in self.slabs:
+            for y1, y2, x1, dxdy in slab:
+                x2 = x1 + (y2 - y1) * dxdy
+                if (min(y1, y2) <= max_lat and max(y1, y2) >= min_lat
+                        and min(x1, x2) <= max_lon and max(x1, x2) >= min_lon):
+                    return False
+        return True
+
+    def _slab(self, lat: float) -> int:
+        return min(len(self.slabs) - 1, max(0, int((lat - self.min_lat) / self.slab_h)))
+
+    def contains(self, lon: float, lat: float) -> bool:
+        if not (self.min_lon <= lon <= self.max_lon and self.min_lat <= lat <= self.max_lat):
+            return False
+        inside = False
+        for y1, y2, x1, dxdy in self.slabs[self._slab(lat)]:
+            # half-open in latitude so a vertex on the ray counts once
+            if (y1 > lat) != (y2 > lat) and lon < x1 + (lat - y1) * dxdy:
+                inside = not inside
+        return inside
+
+
+class GeofenceIndex:
+    """Fences containing a point, see the module docstring"""
+
+    def __init__(self, fences: Iterable[Fence]) -> None:
+        self.fences: Dict[int, Fence] = {}
+        # level -> cell key -> [(shape, cell inside the fence)]
+        grid: Dict[int, Dict[int, List[Tuple[_Shape, bool]]]] = {}
+        for fence in fences:
+            self.fences[fence.id] = fence
+            shape = _Shape(fence)
+            level = self._level(shape)
+            size = BASE_CELL_DEG * (1 << level)
+            inv_size = 1.0 / size
+            cells = grid.setdefault(level, {})
+            # same arithmetic as containing() so boundary points land in the same cell
+            for cx in range(int((shape.min_lon + 180.0) * inv_size), int((shape.max_lon + 180.0) * inv_size) + 1):
+                for cy in range(int((shape.min_lat + 90.0) * inv_size), int((shape.max_lat + 90.0) * inv_size) + 1):
+                    interior = shape.covers(cx * size - 180.0, cy * size - 90.0,
+                                            (cx + 1) * size - 180.0, (cy + 1) * size - 90.0)
+                    cells.setdefault(cx << 20 | cy, []).append((shape, interior))
+        # (1 / cell size, cells) per level in use
+        self._levels = tuple((1.0 / (BASE_CELL_DEG * (1 << level)), cells) for level, cells in sorted(grid.items()))
+
+    @staticmethod
+    def _level(shape: _Shape) -> int:
+        extent = max(shape.max_lon - shape.min_lon, shape.max_lat - shape.min_lat)
+        level = 0
+        while level < MAX_LEVEL and extent > BASE_CELL_DEG * (1 << level) * (CELLS_PER_SIDE - 1):
+            level += 1
+        return level
+
+    def __len__(self) -> int:
+        return len(self.fences)
+
+    def containing(self, lat: float, lon: float) -> FrozenSet[int]:
+        # cell coordinates count from (-180, -90), so int() floors
+        x, y = lon + 180.0, lat + 90.0
+        found: Optional[List[int]] = None
+        for inv_size, cells in self._levels:
+            entries = cells.get(int(x * inv_size) << 20 | int(y * inv_size))
+            if entries:
+                for shape, interior in entries:
+                    if interior or shape.contains(lon, lat):
+                        if found is None:
+                            found = [shape.id]
+                        else:
+                            found.append(shape.id)
+        return EMPTY if found is None else frozenset(found)
+
+
+class GeofenceEngine:
+    """Per device fence membership, yields a Transition when it changes"""
+
+    def __init__(self, index: GeofenceIndex, state: Optional[Dict[str, FrozenSet[int]]] = None) -> None:
+        self.index = index
+        # device_id -> fences it is inside, devices outside every fence are absent
+        self.state: Dict[str, FrozenSet[int]] = state if state is not None else {}
+
+    def evaluate(self, device_id: str, lat: float, lon: float) -> List[Transition]:
+        inside = self.index.containing(lat, lon)
+        before = self.state.get(device_id, EMPTY)
+        if inside == before:
+            return []
+        if inside:
+            self.state[device_id] = inside
+        else:
+            del self.state[device_id]
+        return ([Transition(device_id, f, "exit") for f in sorted(before - inside)]
+                + [Transition(device_id, f, "enter") for f in sorted(inside - before)])
+
+    def replace_index(self, index: GeofenceIndex) -> None:
+        """Swap in a rebuilt index, deleted fences leave the state without exit events"""
+        self.index = index
+        for device_id, fences in list(self.state.items()):
+            kept = frozenset(f for f in fences if f in index.fences)
+            if not kept:
+                del self.state[device_id]
+            elif kept != fences:
+                self.state[device_id] = kept
@@ -0,0 +1,125 @@
+"""Headless MQTT ingest workers.
+
+Runs N processes that only consume telemetry from MQTT and write it to the
+database, without serving HTTP. Each worker has its own MQTT client and its own
+SQLite writer connection.
+
+    python ingest_worker.py --workers 4
+
+Modes:
+  partition  (default) every worker subscribes to the plain topic and keeps
+             only the devices where crc32(device_id) % workers == index. Per
+             device ordering holds on any broker at the cost of N times the
+             fan-out.
+  shared     every worker joins `$share/<group>/tc-bn/telemetry/+`. The broker
+             picks the worker per message. Only when it hashes by topic (e.g.
+             EMQX `shared_subscription_strategy = hash_topic`) does every
+             device stay on one worker; otherwise the per device state each
+             process keeps (last seq, geofence membership) goes wrong.
+
+With --metrics-port P, worker i serves its /metrics on port P + i.
+"""
+import argparse
+import asyncio
+import logging
+import multiprocessing
+import os
+import signal
+import threading
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+
+def _serve_metrics(port: int, metrics) -> None:
+    class _Handler(BaseHTTPRequestHandler):
+        def do_GET(self) -> None:
+            body = metrics.REGISTRY.render().encode()
+            self.send_response(200)
+            self.send_header("Content-Type", metrics.CONTENT_TYPE)
+            self.send_header("Content-Length", str(len(body)))
+            self.end_headers()
+            self.wfile.write(body)
+
+        def log_message(self, *args) -> None:
+            pass
+
+    server = ThreadingHTTPServer(("0.0.0.0", port), _Handler)
+    threading.Thread(target=server.serve_forever, name="metrics-http", daemon=True).start()
+
+
+def _run_worker(index: int, workers: int, mode: str, group: str, metrics_port: int) -> None:
+    base_client_id = os.getenv("MQTT_CLIENT_ID", f"tc-cloud-{os.uname().nodename}")
+    os.environ["MQTT_CLIENT_ID"] = f"{base_client_id}-{index}"
+    if mode == "shared":
+        os.environ["MQTT_SHARE_GROUP"] = group
+        os.environ.pop("MQTT_PARTITIONS", None)
+        os.environ.pop("MQTT_PARTITION", None)
+    else:
+        os.environ.pop("MQTT_SHARE_GROUP", None)
+        os.environ["MQTT_PARTITIONS"] = str(workers)
+        os.environ["MQTT_PARTITION"] = str(index)
+
+    # import after the environment is set, main reads it at import time
+    import main as tc_cloud
+
+    if metrics_port:
+        _serve_metrics(metrics_port + index, tc_cloud.metrics)
+
+    async def _serve() -> None:
+        stop = asyncio.Event()
+        loop = asyncio.get_running_loop()
+        for sig in (signal.SIGINT, signal.SIGTERM):
+            loop.add_signal_handler(sig, stop.set)
+
+        tc_cloud.db.open()
+        lag_watcher = asyncio.create_task(tc_cloud._watch_event_loop_lag())
+        await tc_cloud.load_geofences()
+        geofence_watcher = asyncio.create_task(tc_cloud.watch_geofences())
+        connect = asyncio.create_task(tc_cloud._connect_mqtt())
+        tc_cloud.logger.info("Ingest worker %d/%d started (%s)", index, workers, mode)
+        try:
+            await stop.wait()
+        finally:
+            lag_watcher.cancel()
+            geofence_watcher.cancel()
+            connect.cancel()
+            try:
+                if tc_cloud.fast_mqtt is not None and tc_cloud.fast_mqtt.client.is_connected:
+                    await tc_cloud.fast_mqtt.mqtt_shutdown()
+            finally:
+                tc_cloud.db.close()
+
+    asyncio.run(_serve())
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description="Run MQTT ingest workers")
+    parser.add_argument("--workers", type=int, default=os.cpu_count() or 1)
+    parser.add_argument("--mode", choices=("partition", "shared"), default="partition")
+    parser.add_argument("--group", default=os.getenv("MQTT_SHARE_GROUP") or "tc-ingest")
+    parser.add_argument("--metrics-port", type=int, default=0, help="serve worker i metrics on this port + i")
+    args = parser.parse_args()
+
+    logging.basicConfig(level=os.getenv("LOG_LEVEL", "INFO").upper())
+
+    ctx = multiprocessing.get_context("spawn")
+    procs = [
+        ctx.Process(target=_run_worker, args=(i, args.workers, args.mode, args.group, args.metrics_port), daemon=False)
+        for i in range(args.workers)
+    ]
+    for p in procs:
+        p.start()
+
+    def _forward(signum, _frame):
+        for p in procs:
+            if p.is_alive():
+                os.kill(p.pid, signum)
+
+    signal.signal(signal.SIGINT, _forward)
+    signal.signal(signal.SIGTERM, _forward)
+
+    for p in procs:
+        p.join()
+
+
+if __name__ == "__main__":
+    main()
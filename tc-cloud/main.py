@@ -1,42 +1,281 @@
 import asyncio
-import io
+import binascii
+import functools
+import itertools
 import json
 import logging
+import math
 import os
+import queue
+import random
+import re
+import socket
 import sqlite3
+import sys
+import threading
+import time
+from collections import deque
+from concurrent.futures import Future, ThreadPoolExecutor
 from contextlib import asynccontextmanager
-from datetime import datetime
+from datetime import datetime, timezone
 import struct
-from typing import Any, Dict, List
+import zlib
+from typing import Any, AsyncIterator, Dict, List, NamedTuple, Optional, Tuple
 
 from dotenv import load_dotenv
 from fastapi import FastAPI, HTTPException, Request
-from fastapi.responses import JSONResponse, Response
-from fastapi.templating import Jinja2Templates
-from fastapi_mqtt import FastMQTT, MQTTConfig
-import pandas as pd
+from fastapi.responses import JSONResponse, Response, StreamingResponse
+
+import columnar
+import envelope
+import metrics
+from geofence import Fence, GeofenceEngine, GeofenceIndex, validate_polygon
+import partitions
+import resample
+from partitions import GEO_EPOCH
 
 # ------------------------------------------------------------
 # Setup
 # ------------------------------------------------------------
 load_dotenv()
 logger = logging.getLogger(__name__)
-logging.basicConfig(level=logging.INFO)
+logging.basicConfig(level=os.getenv("LOG_LEVEL", "INFO").upper())
 
 MQTT_HOST = os.getenv("MQTT_HOST", "localhost")
 MQTT_PORT = int(os.getenv("MQTT_PORT", "1883"))
 MQTT_ENABLED = os.getenv("MQTT_ENABLED", "true").lower() not in {"0", "false", "no", "off"}
+# A stable client id plus clean_session=false keeps our subscription alive on the
+# broker while the app restarts, so QoS 1 telemetry is queued instead of dropped.
+MQTT_CLIENT_ID = os.getenv("MQTT_CLIENT_ID", f"tc-cloud-{socket.gethostname()}")
+MQTT_CLEAN_SESSION = os.getenv("MQTT_CLEAN_SESSION", "false").lower() not in {"0", "false", "no", "off"}
+MQTT_SESSION_EXPIRY = int(os.getenv("MQTT_SESSION_EXPIRY", "86400"))
+MQTT_QOS = int(os.getenv("MQTT_QOS", "1"))
+# The app starts serving before MQTT is connected and keeps retrying in the
+# background, backing off up to MQTT_RETRY_MAX seconds between attempts
+MQTT_RETRY_MAX = float(os.getenv("MQTT_RETRY_MAX", "30"))
+# Horizontal scaling: every worker joins the same shared subscription group and the
+# broker spreads the fleet across them. See ingest_worker.py.
+MQTT_SHARE_GROUP = os.getenv("MQTT_SHARE_GROUP", "")
+# Optional device partitioning for brokers that cannot hash shared subscriptions by
+# topic: worker MQTT_PARTITION of MQTT_PARTITIONS only keeps its own devices.
+MQTT_PARTITIONS = int(os.getenv("MQTT_PARTITIONS", "1"))
+MQTT_PARTITION = int(os.getenv("MQTT_PARTITION", "0"))
+# a shared subscription hands each message to one member only, which would
+# drop it whenever the device belongs to another member's partition
+if MQTT_SHARE_GROUP and MQTT_PARTITIONS > 1:
+    raise ValueError("MQTT_SHARE_GROUP and MQTT_PARTITIONS > 1 cannot be combined, use one or the other")
+TELEMETRY_TOPIC = "tc-bn/telemetry/+"
+TELEMETRY_SUBSCRIPTION = f"$share/{MQTT_SHARE_GROUP}/{TELEMETRY_TOPIC}" if MQTT_SHARE_GROUP else TELEMETRY_TOPIC
+METRICS_TOPIC = "tc-bn/metrics/+"
+METRICS_SUBSCRIPTION = f"$share/{MQTT_SHARE_GROUP}/{METRICS_TOPIC}" if MQTT_SHARE_GROUP else METRICS_TOPIC
 DATABASE_PATH = os.getenv("DATABASE_PATH", os.path.join(os.getcwd(), "database.db"))
+DATABASE_READERS = int(os.getenv("DATABASE_READERS", "4"))
+DATABASE_WRITE_BATCH = int(os.getenv("DATABASE_WRITE_BATCH", "256"))
+# Telemetry is stored in one table per PARTITION_DAYS of sample time (see
+# partitions.py). Partitions entirely older than RETENTION_DAYS (0 keeps
+# everything) are rolled up to hourly rows, RETENTION_ROLLUP_ROWS rows per
+# write, and dropped, checked every RETENTION_INTERVAL seconds. Free pages go
+# back to the file system RETENTION_VACUUM_PAGES at a time.
+PARTITION_DAYS = int(os.getenv("PARTITION_DAYS", "1"))
+RETENTION_DAYS = float(os.getenv("RETENTION_DAYS", "0"))
+RETENTION_INTERVAL = float(os.getenv("RETENTION_INTERVAL", "3600"))
+RETENTION_ROLLUP_ROWS = int(os.getenv("RETENTION_ROLLUP_ROWS", "10000"))
+RETENTION_VACUUM_PAGES = int(os.getenv("RETENTION_VACUUM_PAGES", "1000"))
+INGEST_BATCH_MAX_RECORDS = int(os.getenv("INGEST_BATCH_MAX_RECORDS", "50000"))
+# Admission control for /ingest and /ingest/batch: at most INGEST_MAX_PENDING
+# requests wait for the database, the rest get 503 with Retry-After
+# INGEST_RETRY_AFTER (0 = unbounded). /ingest is also limited to
+# INGEST_DEVICE_RATE records per second per device, bursts of
+# INGEST_DEVICE_BURST, over 429 (rate 0 = no limit).
+INGEST_MAX_PENDING = int(os.getenv("INGEST_MAX_PENDING", "512"))
+INGEST_RETRY_AFTER = int(os.getenv("INGEST_RETRY_AFTER", "2"))
+INGEST_DEVICE_RATE = float(os.getenv("INGEST_DEVICE_RATE", "1.0"))
+INGEST_DEVICE_BURST = float(os.getenv("INGEST_DEVICE_BURST", "60"))
+# Largest page /records/page serves, the dashboard asks for DASHBOARD_PAGE_SIZE
+RECORDS_PAGE_MAX = int(os.getenv("RECORDS_PAGE_MAX", "1000"))
+DASHBOARD_PAGE_SIZE = int(os.getenv("DASHBOARD_PAGE_SIZE", "200"))
+# Rows per record batch (and Parquet row group) of /export.parquet and /export.arrow
+EXPORT_BATCH_ROWS = int(os.getenv("EXPORT_BATCH_ROWS", "65536"))
+# /download-csv-raw reads shards of EXPORT_SHARD_ROWS ids, EXPORT_PARALLEL at a
+# time on the reader pool; the default leaves one reader for everything else
+EXPORT_SHARD_ROWS = int(os.getenv("EXPORT_SHARD_ROWS", "50000"))
+EXPORT_PARALLEL = int(os.getenv("EXPORT_PARALLEL", str(max(1, DATABASE_READERS - 1))))
+# Fraction of MQTT and /ingest messages traced from receive to commit
+TRACE_SAMPLE_RATE = float(os.getenv("TRACE_SAMPLE_RATE", "0.01"))
+TRACE_BUFFER = int(os.getenv("TRACE_BUFFER", "10000"))
+# (device_id, seq, t) keys per generation of the in-memory duplicate filter
+DEDUP_WINDOW = int(os.getenv("DEDUP_WINDOW", "100000"))
+# Latest state per device for /devices/latest: devices kept in memory, and how
+# often rows committed by other processes (ingest_worker.py) are picked up
+LATEST_MAX_DEVICES = int(os.getenv("LATEST_MAX_DEVICES", "1000000"))
+LATEST_REFRESH_INTERVAL = float(os.getenv("LATEST_REFRESH_INTERVAL", "2.0"))
+# Seconds between checks for geofences added or deleted by another process
+GEOFENCE_RELOAD_INTERVAL = float(os.getenv("GEOFENCE_RELOAD_INTERVAL", "10.0"))
+# /stream: records a viewer may fall behind before it drops them, and how often
+# viewers are woken up with what arrived since
+STREAM_BUFFER = int(os.getenv("STREAM_BUFFER", "1000"))
+STREAM_INTERVAL = float(os.getenv("STREAM_INTERVAL", "0.5"))
+
+# ------------------------------------------------------------
+# Metrics
+# ------------------------------------------------------------
+_LATENCY_BUCKETS = (0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5)
+
+INGEST_RECORDS = metrics.Counter("tc_ingest_records", "Telemetry records accepted", ["transport"])
+INGEST_MQTT = INGEST_RECORDS.labels("mqtt")
+INGEST_HTTP = INGEST_RECORDS.labels("http")
+INGEST_HTTP_BATCH = INGEST_RECORDS.labels("http_batch")
+DECODE_FAILURES = metrics.Counter("tc_ingest_decode_failures", "Telemetry messages that failed to decode", ["transport"])
+DECODE_FAILURES_MQTT = DECODE_FAILURES.labels("mqtt")
+DECODE_FAILURES_HTTP = DECODE_FAILURES.labels("http")
+DECODE_FAILURES_HTTP_BATCH = DECODE_FAILURES.labels("http_batch")
+DB_COMMIT_SECONDS = metrics.Histogram("tc_db_commit_seconds", "Duration of one SQLite group commit", _LATENCY_BUCKETS).labels()
+DB_COMMIT_WRITES = metrics.Counter("tc_db_commit_writes", "Write requests committed by the SQLite writer").labels()
+EVENT_LOOP_LAG = metrics.Histogram("tc_event_loop_lag_seconds", "Delay of a periodic event loop wakeup", _LATENCY_BUCKETS).labels()
+EVENT_LOOP_LAG_INTERVAL = 0.5
+DUPLICATES = metrics.Counter("tc_ingest_duplicates", "Records dropped as already stored (device_id, seq, t)",
+                             ["transport"])
+DUPLICATES_MQTT = DUPLICATES.labels("mqtt")
+DUPLICATES_HTTP = DUPLICATES.labels("http")
+DUPLICATES_HTTP_BATCH = DUPLICATES.labels("http_batch")
+DEDUP_DB_CHECKS = metrics.Counter("tc_dedup_db_checks", "Filter hits confirmed against the database").labels()
+SEQ_GAPS = metrics.Counter("tc_seq_gaps", "Jumps in a device sequence").labels()
+SEQ_MISSING = metrics.Counter("tc_seq_missing", "Sequence numbers skipped by jumps").labels()
+SEQ_LATE = metrics.Counter("tc_seq_late", "Records older than the newest seen for the device").labels()
+SEQ_RESETS = metrics.Counter("tc_seq_resets", "Device sequences that started over with newer samples").labels()
+STREAM_DROPPED = metrics.Counter("tc_stream_dropped", "Records skipped for /stream viewers that fell behind").labels()
+GEOFENCE_EVENTS = metrics.Counter("tc_geofence_events", "Geofence transitions", ["event"])
+GEOFENCE_ENTER = GEOFENCE_EVENTS.labels("enter")
+GEOFENCE_EXIT = GEOFENCE_EVENTS.labels("exit")
+INGEST_REJECTED = metrics.Counter("tc_ingest_rejected", "HTTP ingest requests turned away", ["reason"])
+INGEST_REJECTED_OVERLOAD = INGEST_REJECTED.labels("overload")
+INGEST_REJECTED_RATE_LIMIT = INGEST_REJECTED.labels("rate_limit")
+PARTITIONS_RETIRED = metrics.Counter("tc_partitions_retired", "Telemetry partitions rolled up and dropped by retention").labels()
+LATEST_EVICTIONS = metrics.Counter("tc_latest_evictions", "Devices dropped from the latest state, least recently updated first").labels()
+# device_id -> unix time of the last accepted record, at most LATEST_MAX_DEVICES
+DEVICE_LAST_SEEN: Dict[str, float] = {}
+
+
+def _remember(devices: Dict[str, Any], device_id: str, value: Any) -> None:
+    """devices[device_id] = value, keeping dict order least recently updated
+    first and dropping the oldest above LATEST_MAX_DEVICES, like LatestState"""
+    if devices.pop(device_id, None) is None and len(devices) >= LATEST_MAX_DEVICES:
+        del devices[next(iter(devices))]
+    devices[device_id] = value
 
 # ------------------------------------------------------------
 # SQLite Database
 # ------------------------------------------------------------
+# telemetry_geo indexes every row as a point in (longitude, latitude, time).
+# Coordinates are the payload's uint16 steps and time is whole seconds since
+# GEO_EPOCH, all exact in rtree_i32: sample_ts when the device sent one, else
+# date + time, else the insert time. Clamped to int32, good until 2088. Every
+# partition has its own, see partitions.py.
+_GEO_LON_Q = partitions.LON_Q
+_GEO_LAT_Q = partitions.LAT_Q
+_GEO_T = (f"max(-2147483648, min(2147483647, COALESCE({{row}}sample_ts / 1000, "
+          f"CAST(strftime('%s', {{row}}date || ' ' || {{row}}time) AS INTEGER), "
+          f"CAST(strftime('%s', 'now') AS INTEGER)) - {GEO_EPOCH}))")
+_GEO_POINT = f"{_GEO_LON_Q}, {_GEO_LON_Q}, {_GEO_LAT_Q}, {_GEO_LAT_Q}, {_GEO_T}, {_GEO_T}"
+
+def _geo_t_range(start: Optional[float], end: Optional[float]) -> Tuple[int, int]:
+    """Inclusive unix seconds window as telemetry_geo times, open ends unbounded"""
+    t_min = -2147483648 if start is None else max(-2147483648, math.ceil(start) - GEO_EPOCH)
+    t_max = 2147483647 if end is None else min(2147483647, math.floor(end) - GEO_EPOCH)
+    return t_min, t_max
+
+# Schema changes on top of the CREATE TABLEs in SQLite._init, applied in order
+# once per database file. PRAGMA user_version counts how many have run.
+MIGRATIONS = (
+    # 1: firmware trace context, sample counter and sample time in unix ms
+    ("ALTER TABLE telemetry ADD COLUMN seq INTEGER",
+     "ALTER TABLE telemetry ADD COLUMN sample_ts INTEGER"),
+    # 2: (device_id, seq) is the natural key, later copies of a seq lose it
+    ("UPDATE telemetry SET seq = NULL WHERE seq IS NOT NULL AND id NOT IN "
+     "(SELECT MIN(id) FROM telemetry WHERE seq IS NOT NULL GROUP BY device_id, seq)",
+     "CREATE UNIQUE INDEX IF NOT EXISTS idx_telemetry_device_seq ON telemetry (device_id, seq)"),
+    # 3: newest row per device, rowid order within a device_id
+    ("CREATE INDEX IF NOT EXISTS idx_telemetry_device ON telemetry (device_id)",),
+    # 4: R*Tree over position and sample time, kept in step by triggers so
+    # every writer (ingest workers included) maintains it in its transaction
+    ("CREATE VIRTUAL TABLE IF NOT EXISTS telemetry_geo USING rtree_i32(id, min_lon, max_lon, min_lat, max_lat, min_t, max_t)",
+     "CREATE TRIGGER IF NOT EXISTS telemetry_geo_insert AFTER INSERT ON telemetry BEGIN "
+     f"INSERT INTO telemetry_geo VALUES (new.id, {_GEO_POINT.format(row='new.')}); END",
+     "CREATE TRIGGER IF NOT EXISTS telemetry_geo_delete AFTER DELETE ON telemetry BEGIN "
+     "DELETE FROM telemetry_geo WHERE id = old.id; END",
+     f"INSERT INTO telemetry_geo SELECT id, {_GEO_POINT.format(row='')} FROM telemetry"),
+    # 5: geofences, which fences every device is inside, and the enter/exit log
+    ("CREATE TABLE IF NOT EXISTS geofences (id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT NOT NULL, "
+     "polygon TEXT NOT NULL, created_at TEXT NOT NULL DEFAULT (datetime('now')))",
+     "CREATE TABLE IF NOT EXISTS geofence_state (device_id TEXT NOT NULL, fence_id INTEGER NOT NULL, "
+     "PRIMARY KEY (device_id, fence_id)) WITHOUT ROWID",
+     "CREATE TABLE IF NOT EXISTS geofence_events (id INTEGER PRIMARY KEY AUTOINCREMENT, device_id TEXT NOT NULL, "
+     "fence_id INTEGER NOT NULL, event TEXT NOT NULL, latitude REAL, longitude REAL, date TEXT, time TEXT, "
+     "created_at TEXT NOT NULL DEFAULT (datetime('now')))"),
+    # 6: one table per PARTITION_DAYS behind the telemetry view, ids from
+    # telemetry_ids, hourly rollups of dropped partitions
+    (partitions.migrate,),
+    # 7: the sample time joins the natural key, a device whose NVS was erased
+    # numbers from 1 again
+    (partitions.rekey_seq,),
+)
+
+_EARTH_RADIUS_M = 6371008.8
+
+def _distance_m(lat1: float, lon1: float, lat2: float, lon2: float) -> float:
+    """Great circle (haversine) distance, registered in SQLite as tc_distance_m"""
+    p1, p2 = math.radians(lat1), math.radians(lat2)
+    a = (math.sin((p2 - p1) / 2.0) ** 2
+         + math.cos(p1) * math.cos(p2) * math.sin(math.radians(lon2 - lon1) / 2.0) ** 2)
+    return 2.0 * _EARTH_RADIUS_M * math.asin(min(1.0, math.sqrt(a)))
+
 class SQLite:
-    def __init__(self, path: str):
+    """SQLite access that never runs on the event loop.
+
+    All writes go through one writer thread that owns the only read-write
+    connection and commits whatever is queued as one transaction. Reads run on a
+    small thread pool where every thread has its own read-only WAL connection, so
+    a full-table export never waits for, or blocks, ingest.
+    """
+
+    def __init__(self, path: str, readers: int = DATABASE_READERS):
         self._path = path
-        self._conn = sqlite3.connect(self._path, check_same_thread=False)
-        self._conn.row_factory = sqlite3.Row
-        self._init()
+        self._conn: Optional[sqlite3.Connection] = None
+        self._local = threading.local()
+        self._readers = ThreadPoolExecutor(max_workers=readers, thread_name_prefix="sqlite-reader")
+        self._writes: "queue.Queue[Any]" = queue.Queue()
+        self._writer = threading.Thread(target=self._write_loop, name="sqlite-writer", daemon=True)
+
+    def open(self) -> None:
+        """Connect, bring the schema up to date and start the writer; writes
+        queued before this wait for it. Does nothing when already open."""
+        if self._conn is not None:
+            return
+        self._conn = self._connect()
+        # user_version doubles as the schema stamp: a file that is up to date
+        # is opened without the CREATEs or the write lock of _migrate
+        if self._conn.execute("PRAGMA user_version").fetchone()[0] != len(MIGRATIONS):
+            self._init()
+        self._writer.start()
+
+    @property
+    def is_open(self) -> bool:
+        return self._conn is not None
+
+    def _connect(self, readonly: bool = False) -> sqlite3.Connection:
+        if readonly:
+            conn = sqlite3.connect(f"file:{self._path}?mode=ro", uri=True, check_same_thread=False, timeout=30.0,
+                                   factory=partitions.Connection)
+        else:
+            conn = sqlite3.connect(self._path, check_same_thread=False, timeout=30.0, factory=partitions.Connection)
+            # only takes effect on a new file, before WAL writes its header; lets retention shrink it
+            conn.execute("PRAGMA auto_vacuum = INCREMENTAL")
+            # WAL lets readers and several ingest workers share the file
+            conn.execute("PRAGMA journal_mode=WAL")
+            conn.execute("PRAGMA synchronous=NORMAL")
+        conn.row_factory = sqlite3.Row
+        conn.create_function("tc_distance_m", 4, _distance_m, deterministic=True)
+        return conn
 
     def _init(self) -> None:
         cur = self._conn.cursor()
@@ -54,163 +293,2043 @@ class SQLite:
             )
             """
         )
-        self._conn.commit()
-
-    def insert(self, record: Dict[str, Any]) -> None:
-        self._conn.execute(
-            "INSERT INTO telemetry (device_id, longitude, latitude, battery, date, time) VALUES (?, ?, ?, ?, ?, ?)",
-            (record["device_id"], record["longitude"], record["latitude"], record["battery"], record["date"], record["time"]),
+        cur.execute(
+            """
+            CREATE TABLE IF NOT EXISTS device_metrics (
+                id INTEGER PRIMARY KEY AUTOINCREMENT,
+                device_id TEXT NOT NULL,
+                uptime_s INTEGER NOT NULL,
+                free_heap INTEGER NOT NULL,
+                min_free_heap INTEGER NOT NULL,
+                queue_depth INTEGER NOT NULL,
+                counters TEXT NOT NULL,
+                histograms TEXT NOT NULL,
+                received_at TEXT NOT NULL DEFAULT (datetime('now'))
+            )
+            """
         )
+        cur.execute("CREATE INDEX IF NOT EXISTS idx_device_metrics_device ON device_metrics (device_id, id)")
         self._conn.commit()
+        self._migrate()
 
-    def list(self) -> List[Dict[str, Any]]:
+    def _migrate(self) -> None:
+        # BEGIN IMMEDIATE so ingest workers starting together migrate only once
+        conn = self._conn
+        conn.execute("BEGIN IMMEDIATE")
+        try:
+            version = conn.execute("PRAGMA user_version").fetchone()[0]
+            for statements in MIGRATIONS[version:]:
+                for sql in statements:
+                    if callable(sql):
+                        sql(conn)
+                    else:
+                        conn.execute(sql)
+            if version < len(MIGRATIONS):
+                conn.execute(f"PRAGMA user_version = {len(MIGRATIONS)}")
+                logger.info("Database schema migrated from version %d to %d", version, len(MIGRATIONS))
+            conn.commit()
+        except Exception:
+            conn.rollback()
+            raise
+
+    def close(self) -> None:
+        if self._conn is not None:
+            self._writes.put(None)
+            self._writer.join()
+        self._readers.shutdown(wait=True)
+        if self._conn is not None:
+            self._conn.close()
+
+    # -------------------- writer thread --------------------
+    def _write_loop(self) -> None:
+        while True:
+            item = self._writes.get()
+            if item is None:
+                return
+            batch = [item]
+            while len(batch) < DATABASE_WRITE_BATCH:
+                try:
+                    item = self._writes.get_nowait()
+                except queue.Empty:
+                    break
+                if item is None:
+                    self._commit(batch)
+                    return
+                batch.append(item)
+            self._commit(batch)
+
+    def _commit(self, batch: List[Any]) -> None:
+        """Run the queued writes as one transaction (group commit)"""
+        start = time.perf_counter()
+        try:
+            with self._conn:
+                results = [fn(self._conn, *args) for fn, args, _, _ in batch]
+            DB_COMMIT_SECONDS.observe(time.perf_counter() - start)
+            DB_COMMIT_WRITES.inc(len(batch))
+        except Exception:
+            partitions.forget(self._conn)
+            if len(batch) == 1:
+                fut = batch[0][2]
+                fut.set_exception(sys.exc_info()[1])
+                return
+            # isolate the failing write so the rest of the batch still lands
+            for item in batch:
+                self._commit([item])
+            return
+        committed = time.time()
+        for (_, _, fut, trace), result in zip(batch, results):
+            if trace is not None:
+                trace.committed = committed
+            fut.set_result(result)
+
+    def _write(self, fn, *args, trace: Optional["Trace"] = None) -> "asyncio.Future[Any]":
+        fut: Future = Future()
+        self._writes.put((fn, args, fut, trace))
+        return asyncio.wrap_future(fut)
+
+    # -------------------- reader pool --------------------
+    def _reader(self) -> sqlite3.Connection:
+        conn = getattr(self._local, "conn", None)
+        if conn is None:
+            conn = self._local.conn = self._connect(readonly=True)
+        return conn
+
+    def _read(self, fn, *args) -> "asyncio.Future[Any]":
+        loop = asyncio.get_running_loop()
+        return loop.run_in_executor(self._readers, lambda: fn(self._reader(), *args))
+
+    # -------------------- queries --------------------
+    @staticmethod
+    def _insert(conn: sqlite3.Connection, record: Tuple) -> int:
+        return partitions.insert_one(conn, record, PARTITION_DAYS)
+
+    @staticmethod
+    def _list(conn: sqlite3.Connection) -> List[Dict[str, Any]]:
         sql = """
             SELECT id, device_id, longitude, latitude, battery, date, time, inserted_at 
             FROM telemetry 
             ORDER BY inserted_at DESC 
         """
-        cur = self._conn.execute(sql,)
+        cur = conn.execute(sql,)
         rows = cur.fetchall()
         return [dict(r) for r in rows]
 
+    @staticmethod
+    def _page(conn: sqlite3.Connection, before: Optional[int], limit: int) -> List[Dict[str, Any]]:
+        # keyset on the rowid, a page costs one seek per partition however deep it is
+        parts = partitions.catalog(conn)
+        if not parts:
+            return []
+        sql = partitions.union_all(parts, "SELECT id, device_id, longitude, latitude, battery, date, time, "
+                                          "inserted_at FROM {name} WHERE id < :before", "id DESC")
+        before = (1 << 63) - 1 if before is None else before
+        return [dict(r) for r in conn.execute(sql, {"before": before, "limit": limit})]
+
+    @staticmethod
+    def _export_batch(conn: sqlite3.Connection, after: int, start: Optional[float], end: Optional[float],
+                      device_id: Optional[str], limit: int) -> Tuple[int, Any]:
+        # keyset on the rowid like _page, filters go into every partition arm so
+        # a device export seeks its index instead of scanning
+        cond = ["id > :after"]
+        if start is not None:
+            cond.append("t >= :start")
+        if end is not None:
+            cond.append("t <= :end")
+        if device_id is not None:
+            cond.append("device_id = :device_id")
+        parts = partitions.catalog(conn, start, end)
+        rows: List[Tuple] = []
+        if parts:
+            sql = partitions.union_all(parts, f"SELECT {columnar.SQL_COLUMNS} FROM {{name}} WHERE {' AND '.join(cond)}",
+                                       "id")
+            cur = conn.cursor()
+            cur.row_factory = None
+            rows = cur.execute(sql, {"after": after, "start": start, "end": end, "device_id": device_id,
+                                     "limit": limit}).fetchall()
+        return (rows[-1][0] if rows else after), columnar.record_batch(rows)
+
+    @staticmethod
+    def _id_range(conn: sqlite3.Connection, start: Optional[float], end: Optional[float]) -> Tuple[int, int]:
+        # bounds of the partitions in the window, two seeks each; shards
+        # outside the window just come back empty
+        parts = partitions.catalog(conn, start, end)
+        if not parts:
+            return 0, -1
+        sql = partitions.union_all(parts, "SELECT MIN(id) AS lo, MAX(id) AS hi FROM {name}")
+        lo, hi = conn.execute(f"SELECT MIN(lo), MAX(hi) FROM ({sql})").fetchone()
+        return (0, -1) if lo is None else (lo, hi)
+
+    @staticmethod
+    def _csv_shard(conn: sqlite3.Connection, lo: int, hi: int, start: Optional[float], end: Optional[float]) -> bytes:
+        # SQLite formats the lines in C while the GIL is released, Python only
+        # joins one string per row, so shards on several readers run in parallel
+        cond = "id >= :lo AND id < :hi"
+        if start is not None:
+            cond += " AND t >= :start"
+        if end is not None:
+            cond += " AND t <= :end"
+        parts = partitions.catalog(conn, start, end)
+        if not parts:
+            return b""
+        sql = partitions.union_all(
+            parts, "SELECT id, printf('%s,%s,%s,%s,%s,%s,%s' || char(10), device_id, longitude, latitude, battery, "
+                   f"date, time, inserted_at) FROM {{name}} WHERE {cond}", "id DESC")
+        cur = conn.cursor()
+        cur.row_factory = None
+        rows = cur.execute(sql, {"lo": lo, "hi": hi, "start": start, "end": end, "limit": -1}).fetchall()
+        return "".join([r[1] for r in rows]).encode()
+
+    @staticmethod
+    def _resample_hourly(conn: sqlite3.Connection, hours: int, device_id: Optional[str]) -> str:
+        # one pass over a cursor, newest first so equal times keep the newest row
+        parts = partitions.catalog(conn)
+        resampler = resample.HourlyResampler(hours)
+        if parts:
+            cond = "WHERE device_id = :device_id" if device_id is not None else ""
+            sql = partitions.union_all(parts, "SELECT id, device_id, longitude, latitude, battery, date, time, "
+                                              f"inserted_at FROM {{name}} {cond}", "id DESC")
+            cur = conn.cursor()
+            cur.row_factory = None
+            for row in cur.execute(sql, {"device_id": device_id, "limit": -1}):
+                resampler.add(row[1:])
+        return resampler.to_csv()
+
+    @staticmethod
+    def _insert_many(conn: sqlite3.Connection, records: List[Tuple]) -> List[int]:
+        inserted: List[int] = []
+        partitions.insert_many(conn, records, PARTITION_DAYS, inserted)
+        return inserted
+
+    @staticmethod
+    def _existing_seqs(conn: sqlite3.Connection, keys: List[Tuple[str, int, int]]) -> set:
+        parts = partitions.catalog(conn)
+        if not parts:
+            return set()
+        arms = partitions.union_all(
+            parts, "SELECT device_id, seq, t FROM {name} "
+                   "WHERE (device_id, seq, t) IN (SELECT device_id, seq, t FROM keys)")
+        found = set()
+        for i in range(0, len(keys), 400):
+            chunk = keys[i:i + 400]
+            values = ", ".join("(?, ?, ?)" for _ in chunk)
+            rows = conn.execute(f"WITH keys(device_id, seq, t) AS (VALUES {values}) {arms}",
+                                [v for key in chunk for v in key])
+            found.update((r[0], r[1], r[2]) for r in rows)
+        return found
+
+    @staticmethod
+    def _latest_rows(conn: sqlite3.Connection) -> Tuple[int, List[Tuple]]:
+        # Skip scan over each partition's device index, two index seeks per
+        # device instead of reading every row. A late sample can give an old
+        # partition the newest row of a device, so all of them are read. The
+        # high-water mark is read first, rows committed in between are applied
+        # twice, which LatestState ignores.
+        parts = partitions.catalog(conn)
+        if not parts:
+            return 0, []
+        max_id = conn.execute(
+            f"SELECT COALESCE(MAX(m), 0) FROM ({partitions.union_all(parts, 'SELECT MAX(id) AS m FROM {name}')})"
+        ).fetchone()[0]
+        sql = """
+            WITH RECURSIVE devices(device_id) AS (
+                SELECT MIN(device_id) FROM {name}
+                UNION ALL
+                SELECT (SELECT MIN(device_id) FROM {name} WHERE device_id > devices.device_id)
+                FROM devices WHERE devices.device_id IS NOT NULL
+            )
+            SELECT t.id, t.device_id, t.longitude, t.latitude, t.battery, t.date, t.time
+            FROM devices
+            JOIN {name} t ON t.id = (SELECT MAX(id) FROM {name} WHERE device_id = devices.device_id)
+        """
+        latest: Dict[str, Tuple] = {}
+        for part in parts:
+            for r in conn.execute(sql.format(name=part.name)):
+                known = latest.get(r[1])
+                if known is None or r[0] > known[0]:
+                    latest[r[1]] = tuple(r)
+        return max_id, sorted(latest.values())
+
+    @staticmethod
+    def _rows_after(conn: sqlite3.Connection, after_id: int, limit: int) -> List[Tuple]:
+        parts = partitions.catalog(conn)
+        if not parts:
+            return []
+        sql = partitions.union_all(parts, "SELECT id, device_id, longitude, latitude, battery, date, time "
+                                          "FROM {name} WHERE id > :after", "id")
+        return [tuple(r) for r in conn.execute(sql, {"after": after_id, "limit": limit})]
+
+    @staticmethod
+    def _devices_in_area(conn: sqlite3.Connection, lon_ranges: List[Tuple[float, float]], min_lat: float,
+                         max_lat: float, start: Optional[float], end: Optional[float],
+                         center: Optional[Tuple[float, float, float]], limit: int) -> List[Dict[str, Any]]:
+        # The R*Tree of every partition in the time window narrows down to
+        # candidate rows by quantized box and time, the real columns then
+        # decide. Quantization is monotonic, so the floor/ceil of the bounds
+        # never misses a row.
+        parts = partitions.catalog(conn, start, end)
+        if not parts:
+            return []
+        t_min, t_max = _geo_t_range(start, end)
+        params: Dict[str, Any] = {
+            "lat_lo_q": math.floor((min_lat + 90.0) / 180.0 * 65535),
+            "lat_hi_q": math.ceil((max_lat + 90.0) / 180.0 * 65535),
+            "t_min": t_min, "t_max": t_max, "min_lat": min_lat, "max_lat": max_lat, "limit": limit,
+        }
+        candidates, lon_filter = [], []
+        for i, (lo, hi) in enumerate(lon_ranges):
+            candidates.append(f"SELECT id, min_t FROM {{geo}} WHERE min_lon >= :lo_q{i} AND max_lon <= :hi_q{i} "
+                              "AND min_lat >= :lat_lo_q AND max_lat <= :lat_hi_q AND min_t >= :t_min AND max_t <= :t_max")
+            lon_filter.append(f"t.longitude BETWEEN :lo{i} AND :hi{i}")
+            params.update({f"lo_q{i}": math.floor((lo + 180.0) / 360.0 * 65535),
+                           f"hi_q{i}": math.ceil((hi + 180.0) / 360.0 * 65535), f"lo{i}": lo, f"hi{i}": hi})
+        distance_filter = ""
+        if center is not None:
+            distance_filter = "AND tc_distance_m(t.latitude, t.longitude, :c_lat, :c_lon) <= :c_radius"
+            params.update(c_lat=center[0], c_lon=center[1], c_radius=center[2])
+        arm = (f"SELECT t.id, t.device_id, c.min_t, t.latitude, t.longitude FROM ({' UNION ALL '.join(candidates)}) c "
+               f"JOIN {{name}} t ON t.id = c.id "
+               f"WHERE ({' OR '.join(lon_filter)}) AND t.latitude BETWEEN :min_lat AND :max_lat {distance_filter}")
+        # the position is the one of the newest sample (last = 1), latest id on a tie
+        sql = f"""
+            SELECT device_id, COUNT(*) AS points,
+                   MIN(min_t) + {GEO_EPOCH} AS first_seen, MAX(min_t) + {GEO_EPOCH} AS last_seen,
+                   MAX(CASE WHEN last = 1 THEN latitude END) AS latitude,
+                   MAX(CASE WHEN last = 1 THEN longitude END) AS longitude
+            FROM (SELECT device_id, min_t, latitude, longitude,
+                         ROW_NUMBER() OVER (PARTITION BY device_id ORDER BY min_t DESC, id DESC) AS last
+                  FROM ({partitions.union_all(parts, arm)}))
+            GROUP BY device_id
+            ORDER BY device_id
+            LIMIT :limit
+        """
+        return [dict(r) for r in conn.execute(sql, params)]
+
+    @staticmethod
+    def _device_ids(conn: sqlite3.Connection, start: Optional[float], end: Optional[float]) -> List[str]:
+        # same skip scan as _latest_rows, over the partitions in the window
+        sql = """
+            WITH RECURSIVE devices(device_id) AS (
+                SELECT MIN(device_id) FROM {name}
+                UNION ALL
+                SELECT (SELECT MIN(device_id) FROM {name} WHERE device_id > devices.device_id)
+                FROM devices WHERE devices.device_id IS NOT NULL
+            )
+            SELECT device_id FROM devices WHERE device_id IS NOT NULL
+        """
+        found = set()
+        for part in partitions.catalog(conn, start, end):
+            found.update(r[0] for r in conn.execute(sql.format(name=part.name)))
+        return sorted(found)
+
+    @staticmethod
+    def _simplified_track(conn: sqlite3.Connection, device_id: str, start: Optional[float], end: Optional[float],
+                          tolerance_m: float) -> Tuple[int, Any]:
+        # Grid position and time relative to GEO_EPOCH, as in telemetry_geo,
+        # from the partitions in the window. Plain tuples, numpy takes them directly.
+        parts = partitions.catalog(conn, start, end)
+        if not parts:
+            return 0, None
+        t_min, t_max = _geo_t_range(start, end)
+        arm = (f"SELECT {_GEO_LON_Q.format(row='')}, {_GEO_LAT_Q.format(row='')}, t - {GEO_EPOCH} FROM {{name}} "
+               "WHERE device_id = :device_id AND t BETWEEN :t_min AND :t_max")
+        cur = conn.cursor()
+        cur.row_factory = None
+        rows = cur.execute(partitions.union_all(parts, arm),
+                           {"device_id": device_id, "t_min": t_min + GEO_EPOCH, "t_max": t_max + GEO_EPOCH}).fetchall()
+        import simplify  # and numpy, on the first track query instead of at startup
+        points, total = simplify.track_array(rows)
+        del rows
+        return total, simplify.simplify_track(points, tolerance_m)
+
+    async def insert(self, record: Tuple, trace: Optional["Trace"] = None) -> int:
+        """Insert a TelemetryRecord, stamping trace with the commit time.
+
+        Returns the new row id, or 0 if a record with the same (device_id, seq, t)
+        already exists.
+        """
+        return await self._write(self._insert, record, trace=trace)
+
+    async def insert_many(self, records: List[Tuple]) -> List[int]:
+        """Insert all records in one transaction, returns the positions of the
+        new ones; replays the unique index ignored are left out"""
+        return await self._write(self._insert_many, records)
+
+    async def existing_seqs(self, keys: List[Tuple[str, int, int]]) -> set:
+        """The (device_id, seq, t) keys that are already stored"""
+        return await self._read(self._existing_seqs, keys)
+
+    async def list(self) -> List[Dict[str, Any]]:
+        return await self._read(self._list)
+
+    async def page(self, before: Optional[int], limit: int) -> List[Dict[str, Any]]:
+        """Up to limit records with id < before (newest first when None), highest id first"""
+        return await self._read(self._page, before, limit)
+
+    async def export_batch(self, after: int, start: Optional[float], end: Optional[float], device_id: Optional[str],
+                           limit: int) -> Tuple[int, Any]:
+        """(last id, Arrow record batch) of up to limit rows with id > after in the
+        window (unix seconds, inclusive), optionally of one device, in id order"""
+        return await self._read(self._export_batch, after, start, end, device_id, limit)
+
+    async def id_range(self, start: Optional[float], end: Optional[float]) -> Tuple[int, int]:
+        """(lowest, highest) id of the partitions overlapping the window, (0, -1) if none"""
+        return await self._read(self._id_range, start, end)
+
+    def csv_shard(self, lo: int, hi: int, start: Optional[float], end: Optional[float]) -> "asyncio.Future[bytes]":
+        """CSV lines of the rows with lo <= id < hi in the window, highest id first.
+        Returns the reader's future so several shards can be in flight."""
+        return self._read(self._csv_shard, lo, hi, start, end)
+
+    async def resample_hourly(self, hours: int, device_id: Optional[str]) -> str:
+        """CSV of the record closest to each of the newest hours, see resample.py"""
+        return await self._read(self._resample_hourly, hours, device_id)
+
+    async def devices_in_area(self, lon_ranges: List[Tuple[float, float]], min_lat: float, max_lat: float,
+                              start: Optional[float], end: Optional[float],
+                              center: Optional[Tuple[float, float, float]] = None,
+                              limit: int = 1000) -> List[Dict[str, Any]]:
+        """Devices with points inside the box and time window (unix seconds, inclusive).
+
+        lon_ranges holds one (min, max) range, or two when the box crosses the
+        antimeridian. center (lat, lon, meters) further limits to a circle.
+        Per device: point count, first/last sample time and last position.
+        """
+        return await self._read(self._devices_in_area, lon_ranges, min_lat, max_lat, start, end, center, limit)
+
+    async def device_ids(self, start: Optional[float] = None, end: Optional[float] = None) -> List[str]:
+        """Devices stored in the partitions overlapping the window, sorted"""
+        return await self._read(self._device_ids, start, end)
+
+    async def simplified_track(self, device_id: str, start: Optional[float], end: Optional[float],
+                               tolerance_m: float) -> Tuple[int, Any]:
+        """Points of the device in the time window, and the (lon_q, lat_q, t) rows
+        of its track simplified to tolerance_m, see simplify.py"""
+        return await self._read(self._simplified_track, device_id, start, end, tolerance_m)
+
+    # -------------------- geofences --------------------
+    @staticmethod
+    def _geofence_signature(conn: sqlite3.Connection) -> Tuple[int, int, int]:
+        # fences are never edited, count/max/sum of the ids changes on every insert or delete
+        return tuple(conn.execute(
+            "SELECT COUNT(*), COALESCE(MAX(id), 0), COALESCE(SUM(id), 0) FROM geofences").fetchone())
+
+    @staticmethod
+    def _geofences(conn: sqlite3.Connection) -> Tuple[Tuple[int, int, int], List[Dict[str, Any]]]:
+        signature = SQLite._geofence_signature(conn)
+        rows = conn.execute("SELECT id, name, polygon, created_at FROM geofences ORDER BY id")
+        return signature, [dict(r, polygon=json.loads(r["polygon"])) for r in rows]
+
+    @staticmethod
+    def _geofence_state(conn: sqlite3.Connection) -> List[Tuple[str, int]]:
+        return [tuple(r) for r in conn.execute("SELECT device_id, fence_id FROM geofence_state")]
+
+    @staticmethod
+    def _insert_geofence(conn: sqlite3.Connection, name: str, polygon: str) -> int:
+        return conn.execute("INSERT INTO geofences (name, polygon) VALUES (?, ?)", (name, polygon)).lastrowid
+
+    @staticmethod
+    def _delete_geofence(conn: sqlite3.Connection, fence_id: int) -> bool:
+        conn.execute("DELETE FROM geofence_state WHERE fence_id = ?", (fence_id,))
+        return conn.execute("DELETE FROM geofences WHERE id = ?", (fence_id,)).rowcount > 0
+
+    @staticmethod
+    def _insert_geofence_events(conn: sqlite3.Connection, events: List[Tuple]) -> None:
+        # (device_id, fence_id, event, latitude, longitude, date, time)
+        conn.executemany(
+            "INSERT INTO geofence_events (device_id, fence_id, event, latitude, longitude, date, time) "
+            "VALUES (?, ?, ?, ?, ?, ?, ?)", events)
+        conn.executemany("INSERT OR IGNORE INTO geofence_state (device_id, fence_id) VALUES (?, ?)",
+                         [e[:2] for e in events if e[2] == "enter"])
+        conn.executemany("DELETE FROM geofence_state WHERE device_id = ? AND fence_id = ?",
+                         [e[:2] for e in events if e[2] == "exit"])
+
+    @staticmethod
+    def _geofence_events(conn: sqlite3.Connection, after: int, limit: int) -> List[Dict[str, Any]]:
+        sql = """
+            SELECT id, device_id, fence_id, event, latitude, longitude, date, time, created_at
+            FROM geofence_events WHERE id > ? ORDER BY id LIMIT ?
+        """
+        return [dict(r) for r in conn.execute(sql, (after, limit))]
+
+    async def geofences(self) -> Tuple[Tuple[int, int, int], List[Dict[str, Any]]]:
+        """(signature, every geofence with its polygon decoded)"""
+        return await self._read(self._geofences)
+
+    async def geofence_signature(self) -> Tuple[int, int, int]:
+        return await self._read(self._geofence_signature)
+
+    async def geofence_state(self) -> List[Tuple[str, int]]:
+        """(device_id, fence_id) pairs of devices currently inside a fence"""
+        return await self._read(self._geofence_state)
+
+    async def insert_geofence(self, name: str, polygon: List[Tuple[float, float]]) -> int:
+        return await self._write(self._insert_geofence, name, json.dumps(polygon))
+
+    async def delete_geofence(self, fence_id: int) -> bool:
+        return await self._write(self._delete_geofence, fence_id)
+
+    async def insert_geofence_events(self, events: List[Tuple]) -> None:
+        """Log transitions and apply them to geofence_state in one transaction"""
+        await self._write(self._insert_geofence_events, events)
+
+    async def geofence_events(self, after: int, limit: int) -> List[Dict[str, Any]]:
+        return await self._read(self._geofence_events, after, limit)
+
+    async def latest_rows(self) -> Tuple[int, List[Tuple]]:
+        """(max id, newest row of every device) as (id, device_id, longitude, latitude, battery, date, time)"""
+        return await self._read(self._latest_rows)
+
+    async def rows_after(self, after_id: int, limit: int) -> List[Tuple]:
+        """Rows with id > after_id in id order, same columns as latest_rows"""
+        return await self._read(self._rows_after, after_id, limit)
+
+    # -------------------- retention --------------------
+    @staticmethod
+    def _hourly(conn: sqlite3.Connection, device_id: Optional[str], start: Optional[float], end: Optional[float],
+                limit: int) -> List[Dict[str, Any]]:
+        sql = """
+            SELECT device_id, hour, points, last_t, longitude, latitude, battery, battery_avg
+            FROM telemetry_hourly
+            WHERE (:device_id IS NULL OR device_id = :device_id) AND hour BETWEEN :start AND :end
+            ORDER BY device_id, hour
+            LIMIT :limit
+        """
+        params = {"device_id": device_id, "limit": limit,
+                  "start": partitions.T_MIN if start is None else start // 3600 * 3600,
+                  "end": partitions.T_MAX if end is None else end}
+        return [dict(r) for r in conn.execute(sql, params)]
+
+    async def hourly(self, device_id: Optional[str], start: Optional[float], end: Optional[float],
+                     limit: int) -> List[Dict[str, Any]]:
+        """Hourly rollups of retired partitions, hours overlapping the window (unix seconds)"""
+        return await self._read(self._hourly, device_id, start, end, limit)
+
+    async def expired_partitions(self, before_t: float) -> List[partitions.Partition]:
+        return await self._read(partitions.expired, before_t)
+
+    async def rollup(self, part: partitions.Partition, rows: int) -> Tuple[int, int, List[Tuple]]:
+        """Hourly rollup of the next rows of a partition, computed on a reader"""
+        return await self._read(partitions.rollup, part, rows)
+
+    async def merge_rollup(self, part: partitions.Partition, after: int, up_to: int, rows: List[Tuple]) -> bool:
+        return await self._write(partitions.merge_rollup, part, after, up_to, rows)
+
+    async def retire(self, part: partitions.Partition) -> None:
+        await self._write(partitions.retire, part)
+
+    async def drop_retired(self) -> Optional[str]:
+        return await self._write(partitions.drop_retired)
+
+    async def vacuum_step(self, pages: int) -> int:
+        return await self._write(partitions.vacuum_step, pages)
+
+    def queue_depth(self) -> int:
+        """Writes waiting for the writer thread"""
+        return self._writes.qsize()
+
+    @staticmethod
+    def _insert_metrics(conn: sqlite3.Connection, device_id: str, snapshot: Dict[str, Any]) -> None:
+        conn.execute(
+            "INSERT INTO device_metrics (device_id, uptime_s, free_heap, min_free_heap, queue_depth, counters, histograms) "
+            "VALUES (?, ?, ?, ?, ?, ?, ?)",
+            (device_id, snapshot["uptime_s"], snapshot["free_heap"], snapshot["min_free_heap"],
+             snapshot["queue_depth"], json.dumps(snapshot["counters"]), json.dumps(snapshot["histograms"])),
+        )
+
+    @staticmethod
+    def _latest_metrics(conn: sqlite3.Connection) -> List[Dict[str, Any]]:
+        sql = """
+            SELECT m.device_id, m.uptime_s, m.free_heap, m.min_free_heap, m.queue_depth,
+                   m.counters, m.histograms, m.received_at
+            FROM device_metrics m
+            JOIN (SELECT device_id, MAX(id) AS id FROM device_metrics GROUP BY device_id) latest
+              ON m.id = latest.id
+            ORDER BY m.device_id
+        """
+        items = []
+        for r in conn.execute(sql):
+            item = dict(r)
+            item["counters"] = json.loads(item["counters"])
+            item["histograms"] = json.loads(item["histograms"])
+            items.append(item)
+        return items
+
+    async def insert_metrics(self, device_id: str, snapshot: Dict[str, Any]) -> None:
+        """Store one decoded firmware metrics snapshot"""
+        await self._write(self._insert_metrics, device_id, snapshot)
+
+    async def latest_metrics(self) -> List[Dict[str, Any]]:
+        """Most recent metrics snapshot of every device"""
+        return await self._read(self._latest_metrics)
+
+# opened by lifespan (or ingest_worker.py), importing main does not touch the file
 db = SQLite(DATABASE_PATH)
 
+metrics.GaugeFunc("tc_db_write_queue_depth", "Writes waiting for the SQLite writer thread", db.queue_depth)
+metrics.GaugeFunc("tc_device_last_seen_timestamp_seconds", "Unix time of the last accepted record per device",
+                  lambda: DEVICE_LAST_SEEN, ["device_id"])
+metrics.GaugeFunc("tc_latest_devices", "Devices held in the latest state table", lambda: len(LATEST))
+metrics.GaugeFunc("tc_geofences", "Geofences in the evaluation index",
+                  lambda: len(GEOFENCES.index) if GEOFENCES is not None else 0)
+metrics.GaugeFunc("tc_stream_viewers", "Connected /stream viewers", lambda: FEED.viewers)
+metrics.GaugeFunc("tc_ingest_pending", "HTTP ingest requests in progress", lambda: ADMISSION.pending)
+
 # ------------------------------------------------------------
 # Payload Processing
 # ------------------------------------------------------------
-def decode_payload(payload_hex: str) -> Dict[str, float]:
-    """Decode 5-byte hex payload: [lat_u16_be][lon_u16_be][battery_u8].
-    Latitude spans [-90,+90]; longitude spans [-180,+180]; battery 0..100.
+class TelemetryRecord(NamedTuple):
+    """Decoded telemetry, field order matches partitions.insert_one"""
+    device_id: str
+    longitude: float
+    latitude: float
+    battery: int
+    date: str
+    time: str
+    seq: Optional[int]
+    sample_ts: Optional[int]
+
+
+_PAYLOAD = struct.Struct('!HHB')
+_REQUIRED_FIELDS = frozenset(("id", "payload", "date", "time"))
+# tuple.__new__ skips the namedtuple __new__ wrapper, this runs per message
+_new_record = functools.partial(tuple.__new__, TelemetryRecord)
+
+class _Scale(dict):
+    """u16 -> degrees, the inverse scaling (mirror of the encoder) and rounding
+    done the first time a value is seen instead of per message"""
+
+    def __init__(self, span: float) -> None:
+        super().__init__()
+        self._span = span
+        self._half = span / 2.0
+
+    def __missing__(self, u: int) -> float:
+        value = self[u] = round((u / 65535.0) * self._span - self._half, 2)
+        return value
+
+
+class _Clock(dict):
+    """Seconds of the day -> HH:MM:SS, formatted the first time it is seen"""
+
+    def __missing__(self, seconds: int) -> str:
+        value = self[seconds] = f"{seconds // 3600:02d}:{seconds // 60 % 60:02d}:{seconds % 60:02d}"
+        return value
+
+
+_CLOCK = _Clock()
+
+# The payload only has 65536 possible lat/lon values. Filled on demand, a full
+# table up front cost ~150 ms of every start.
+_LATITUDES = _Scale(180.0)
+_LONGITUDES = _Scale(360.0)
+
+
+# RFC 1924 / base64.b85encode alphabet. Pairs of characters are looked up at
+# once, a 7 character payload is then three lookups and no bytes object.
+_B85_ALPHABET = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz!#$%&()*+-;<=>?@^_`{|}~"
+_B85 = {c: i for i, c in enumerate(_B85_ALPHABET)}
+_B85_PAIRS = {a + b: _B85[a] * 85 + _B85[b] for a in _B85_ALPHABET for b in _B85_ALPHABET}
+_B85_PAD = 84 * 85 * 85 + 84 * 85 + 84  # the three "~" b85encode cut off the last group
+_PAYLOAD_ENCODINGS = {"hex": 10, "b64": 8, "b85": 7}
+_ENCODING_BY_LENGTH = {n: enc for enc, n in _PAYLOAD_ENCODINGS.items()}
+
+
+def unpack_payload(text: str, enc: Optional[str] = None) -> Tuple[int, int, int]:
+    """(lat_u16, lon_u16, battery) of the 5 payload bytes in text.
+
+    enc is "hex", "b64" (padded) or "b85". Without it the length decides: 10
+    characters are hex, which every firmware sent before the other encodings,
+    8 are base64 and 7 base85.
     """
-    h = payload_hex.strip().upper()
-    if len(h) != 10:
-        raise ValueError("Payload must be exactly 10 hex characters (5 bytes)")
+    n = len(text)
+    if enc is None:
+        enc = _ENCODING_BY_LENGTH.get(n)
+    elif _PAYLOAD_ENCODINGS.get(enc, n) != n:
+        raise ValueError(f"Payload must be {_PAYLOAD_ENCODINGS[enc]} {enc} characters (5 bytes)")
+    try:
+        if enc == "hex":
+            return _PAYLOAD.unpack(bytes.fromhex(text))
+        if enc == "b64":
+            return _PAYLOAD.unpack(binascii.a2b_base64(text, strict_mode=True))
+        if enc == "b85":
+            value = (_B85_PAIRS[text[:2]] * 7225 + _B85_PAIRS[text[2:4]]) * 85 + _B85[text[4]]
+            last = _B85_PAIRS[text[5:]] * 614125 + _B85_PAD
+            if value <= 0xFFFFFFFF and last <= 0xFFFFFFFF:
+                return value >> 16, value & 0xFFFF, last >> 24
+            raise ValueError("Payload is not valid base85")
+    except (KeyError, binascii.Error, struct.error):
+        raise ValueError(f"Payload is not valid {enc}") from None
+    if enc is None:
+        raise ValueError("Payload must be 10 hex, 8 base64 or 7 base85 characters (5 bytes)")
+    raise ValueError("enc must be hex, b64 or b85")
 
-    b = bytes.fromhex(h)
-    lat_u16, lon_u16, batt = struct.unpack('!HHB', b)
 
-    # inverse scaling (mirror of the encoder)
-    lat = (lat_u16 / 65535.0) * 180.0 - 90.0
-    lon = (lon_u16 / 65535.0) * 360.0 - 180.0
+def decode_payload(payload_text: str, enc: Optional[str] = None) -> Dict[str, float]:
+    """Decode the 5-byte payload: [lat_u16_be][lon_u16_be][battery_u8].
+    Latitude spans [-90,+90]; longitude spans [-180,+180]; battery 0..100.
+    """
+    lat_u16, lon_u16, batt = unpack_payload(payload_text.strip(), enc)
 
     return {
-        "latitude": round(lat, 2),
-        "longitude": round(lon, 2),
+        "latitude": _LATITUDES[lat_u16],
+        "longitude": _LONGITUDES[lon_u16],
         "battery": batt,
     }
 
-    
-def process_telemetry_message(message: Dict[str, str]) -> Dict[str, Any]:
+
+# seq is the firmware's uint32; ts must fit a SQLite INTEGER
+_SEQ_MAX = 0xFFFFFFFF
+_TS_MAX = envelope.TS_MAX
+_TRACE_LIMITS = (("seq", _SEQ_MAX), ("ts", _TS_MAX))
+
+
+def _check_trace(seq: Any, sample_ts: Any) -> None:
+    for (name, limit), value in zip(_TRACE_LIMITS, (seq, sample_ts)):
+        if value is not None and (type(value) is not int or not 0 <= value <= limit):
+            raise ValueError(f"{name} must be an integer from 0 to {limit}")
+
+
+def process_telemetry_message(message: Dict[str, str]) -> TelemetryRecord:
     """Process incoming telemetry message and return database record"""
-    required_fields = ["id", "payload", "date", "time"]
-    for field in required_fields:
+    if not _REQUIRED_FIELDS.issubset(message):
+        missing = next(f for f in ("id", "payload", "date", "time") if f not in message)
+        raise ValueError(f"Missing required field: {missing}")
+
+    for field in ("id", "date", "time"):
+        value = message[field]
+        if not isinstance(value, str) or not value:
+            raise ValueError(f"{field} must be a non-empty string")
+
+    h, enc = message["payload"], message.get("enc")
+    if not isinstance(h, str) or (enc is not None and not isinstance(enc, str)):
+        raise ValueError("payload and enc must be strings")
+    lat_u16, lon_u16, batt = unpack_payload(h.strip(), enc)
+
+    seq, sample_ts = message.get("seq"), message.get("ts")
+    _check_trace(seq, sample_ts)
+
+    return _new_record((message["id"], _LONGITUDES[lon_u16], _LATITUDES[lat_u16], batt,
+                        message["date"], message["time"], seq, sample_ts))
+
+
+# the firmware's compact layout; strings without escapes or control characters,
+# seq and ts plain decimal
+_FIRMWARE_JSON = re.compile(
+    r'\{"id":"([^"\\\x00-\x1f]+)","payload":"([^"\\\x00-\x1f]{7,10})",'
+    r'"date":"([^"\\\x00-\x1f]+)","time":"([^"\\\x00-\x1f]+)"'
+    r'(?:,"seq":(0|[1-9][0-9]*)(?:,"ts":(0|[1-9][0-9]*))?)?\}')
+
+
+def decode_telemetry(raw: bytes) -> TelemetryRecord:
+    """Decode a raw telemetry JSON body straight into a database record.
+
+    The firmware always sends the same compact layout
+    {"id":"..","payload":"..","date":"..","time":".."}, optionally followed by
+    ,"seq":N and ,"ts":N, which one compiled regex matches in full and splits
+    into fields without building a dict. The payload may be in any encoding
+    unpack_payload tells from its length. Anything else (other key order,
+    whitespace, escapes, non-string values, extra fields such as "enc") goes
+    through json.loads and process_telemetry_message.
+    """
+    m = _FIRMWARE_JSON.fullmatch(raw.decode())
+    if m is not None:
+        device_id, text, date, clock, seq, sample_ts = m.groups()
+        seq, sample_ts = seq and int(seq), sample_ts and int(sample_ts)
+        # out of range goes the slow way, which says what is wrong
+        if (seq is None or seq <= _SEQ_MAX) and (sample_ts is None or sample_ts <= _TS_MAX):
+            lat_u16, lon_u16, batt = unpack_payload(text)
+            return _new_record((device_id, _LONGITUDES[lon_u16], _LATITUDES[lat_u16], batt, date, clock,
+                                seq, sample_ts))
+
+    message = json.loads(raw)
+    if not isinstance(message, dict):
+        raise ValueError("Record must be a JSON object")
+    return process_telemetry_message(message)
+
+
+# year 10000, the date string would need a fifth digit
+_MAX_UNIX_TIME = 253402300800
+
+
+def process_binary_envelope(message: Any) -> TelemetryRecord:
+    """Database record from a decoded CBOR or msgpack envelope (envelope.py).
+
+    Date and time are derived from "t" in UTC, like for binary batch frames.
+    """
+    if not isinstance(message, dict):
+        raise ValueError("Record must be a map")
+    for field in ("id", "payload", "t"):
         if field not in message:
             raise ValueError(f"Missing required field: {field}")
-    
-    device_id = message["id"]
-    payload = message["payload"]
-    date = message["date"]
-    time = message["time"]
-    
-    # Validate payload format
-    decoded = decode_payload(payload)
-    
+
+    device_id, payload, timestamp = message["id"], message["payload"], message["t"]
+    if not isinstance(device_id, str) or not device_id:
+        raise ValueError("id must be non-empty text")
+    if isinstance(payload, bytes) and len(payload) == 5:
+        lat_u16, lon_u16, batt = _PAYLOAD.unpack(payload)
+    elif isinstance(payload, str):
+        lat_u16, lon_u16, batt = unpack_payload(payload.strip(), message.get("enc"))
+    else:
+        raise ValueError("payload must be 5 bytes")
+    if type(timestamp) is not int or not 0 <= timestamp < _MAX_UNIX_TIME:
+        raise ValueError("t must be unix seconds")
+
+    seq, sample_ts = message.get("seq"), message.get("ts")
+    _check_trace(seq, sample_ts)
+
+    return _envelope_record(device_id, lat_u16, lon_u16, batt, timestamp, seq, sample_ts)
+
+
+def _envelope_record(device_id: str, lat_u16: int, lon_u16: int, batt: int, timestamp: int,
+                     seq: Optional[int], sample_ts: Optional[int]) -> TelemetryRecord:
+    day, seconds = divmod(timestamp, 86400)
+    return _new_record((device_id, _LONGITUDES[lon_u16], _LATITUDES[lat_u16], batt, _utc_date(day),
+                        _CLOCK[seconds], seq, sample_ts))
+
+
+def decode_envelope(raw: bytes, content_type: Optional[str] = None) -> TelemetryRecord:
+    """decode_telemetry for a JSON, CBOR or msgpack body, told apart by
+    content_type or the first byte (envelope.detect)"""
+    fmt = envelope.detect(raw, content_type)
+    if fmt == envelope.JSON:
+        return decode_telemetry(raw)
+    fields = envelope.firmware_fields(raw, fmt)
+    if fields is not None:
+        device_id, payload, timestamp, seq, sample_ts = fields
+        lat_u16, lon_u16, batt = _PAYLOAD.unpack(payload)
+        return _envelope_record(device_id, lat_u16, lon_u16, batt, timestamp, seq, sample_ts)
+    if fmt == envelope.CBOR:
+        return process_binary_envelope(envelope.decode_cbor(raw))
+    return process_binary_envelope(envelope.decode_msgpack(raw))
+
+
+def process_telemetry_frame(frame: bytes) -> TelemetryRecord:
+    """Process one binary batch frame and return database record.
+
+    Frame body: [id_len_u8][id ascii][unix_time_u32_be][payload_t 5 bytes].
+    """
+    if not frame:
+        raise ValueError("Empty frame")
+    id_len = frame[0]
+    if id_len == 0:
+        raise ValueError("Device id must not be empty")
+    if len(frame) != 1 + id_len + 4 + 5:
+        raise ValueError("Frame length does not match id length")
+    try:
+        device_id = frame[1:1 + id_len].decode("ascii")
+    except UnicodeDecodeError:
+        raise ValueError("Device id must be ASCII")
+    (timestamp,) = struct.unpack_from('!I', frame, 1 + id_len)
+    lat_u16, lon_u16, batt = _PAYLOAD.unpack_from(frame, 1 + id_len + 4)
+    day, seconds = divmod(timestamp, 86400)
+
+    return _new_record((device_id, _LONGITUDES[lon_u16], _LATITUDES[lat_u16], batt, _utc_date(day),
+                        _CLOCK[seconds], None, None))
+
+
+# Names in firmware order, see tc-firmware/main/tc_metrics.h
+METRICS_COUNTERS = ("samples", "publish_failed", "mqtt_reconnects", "wifi_reconnects")
+METRICS_HISTOGRAMS = ("loop_us", "encode_us", "publish_us")
+_METRICS_HEADER = struct.Struct('!BBBBIIIII')
+
+def _bucket_quantile(buckets: List[int], count: int, q: float) -> Optional[int]:
+    """Upper bound in microseconds of the log2 bucket holding quantile q"""
+    if count == 0:
+        return None
+    rank = q * count
+    seen = 0
+    for i, n in enumerate(buckets):
+        seen += n
+        if seen >= rank:
+            return 1 << (i + 1)
+    return 1 << len(buckets)
+
+def decode_metrics_snapshot(raw: bytes) -> Dict[str, Any]:
+    """Decode a firmware metrics snapshot (tc_metrics_snapshot) into a dict.
+
+    Counters and histograms the cloud does not know yet are kept under their
+    index, so a newer firmware never makes a snapshot undecodable.
+    """
+    if len(raw) < _METRICS_HEADER.size:
+        raise ValueError("Metrics snapshot too short")
+    version, n_counters, n_histograms, n_buckets, uptime_s, free_heap, min_free_heap, queue_depth, _ = \
+        _METRICS_HEADER.unpack_from(raw)
+    if version != 1:
+        raise ValueError(f"Unsupported metrics snapshot version: {version}")
+    expected = _METRICS_HEADER.size + 4 * n_counters + n_histograms * (8 + 4 * n_buckets)
+    if len(raw) != expected:
+        raise ValueError(f"Metrics snapshot must be {expected} bytes, got {len(raw)}")
+
+    values = struct.unpack_from(f"!{(expected - _METRICS_HEADER.size) // 4}I", raw, _METRICS_HEADER.size)
+    counters = {
+        METRICS_COUNTERS[i] if i < len(METRICS_COUNTERS) else str(i): values[i]
+        for i in range(n_counters)
+    }
+    histograms = {}
+    offset = n_counters
+    for i in range(n_histograms):
+        count, sum_us = values[offset], values[offset + 1]
+        buckets = list(values[offset + 2:offset + 2 + n_buckets])
+        offset += 2 + n_buckets
+        histograms[METRICS_HISTOGRAMS[i] if i < len(METRICS_HISTOGRAMS) else str(i)] = {
+            "count": count,
+            "sum_us": sum_us,
+            "buckets": buckets,
+        }
     return {
-        "device_id": device_id,
-        "longitude": decoded["longitude"],
-        "latitude": decoded["latitude"],
-        "battery": decoded["battery"],
-        "date": date,
-        "time": time,
+        "uptime_s": uptime_s,
+        "free_heap": free_heap,
+        "min_free_heap": min_free_heap,
+        "queue_depth": queue_depth,
+        "counters": counters,
+        "histograms": histograms,
+    }
+
+@functools.lru_cache(maxsize=64)
+def _utc_date(day: int) -> str:
+    """Format days since the epoch as YYYY-MM-DD (UTC)"""
+    return datetime.fromtimestamp(day * 86400, tz=timezone.utc).strftime("%Y-%m-%d")
+
+
+async def _ndjson_lines(stream: AsyncIterator[bytes]) -> AsyncIterator[bytes]:
+    """Split a byte stream into NDJSON lines as chunks arrive"""
+    buffer = b""
+    async for chunk in stream:
+        buffer += chunk
+        *lines, buffer = buffer.split(b"\n")
+        for line in lines:
+            yield line
+    yield buffer
+
+
+async def _binary_frames(stream: AsyncIterator[bytes]) -> AsyncIterator[Optional[bytes]]:
+    """Split a byte stream into [len_u16_be][body] frames as chunks arrive.
+
+    Yields None for a truncated trailing frame.
+    """
+    buffer = bytearray()
+    async for chunk in stream:
+        buffer += chunk
+        pos = 0
+        while len(buffer) - pos >= 2:
+            size = (buffer[pos] << 8) | buffer[pos + 1]
+            if len(buffer) - pos - 2 < size:
+                break
+            yield bytes(buffer[pos + 2:pos + 2 + size])
+            pos += 2 + size
+        del buffer[:pos]
+    if buffer:
+        yield None
+
+
+async def process_telemetry_batch(request: Request) -> Tuple[List[TelemetryRecord], List[List[Any]]]:
+    """Decode an NDJSON or binary batch body into records and [index, error] pairs"""
+    records: List[TelemetryRecord] = []
+    errors: List[List[Any]] = []
+    content_type = request.headers.get("content-type", "").split(";")[0].strip().lower()
+    binary = content_type == "application/octet-stream"
+
+    index = 0
+    items = _binary_frames(request.stream()) if binary else _ndjson_lines(request.stream())
+    async for item in items:
+        if not binary and not item.strip():
+            continue
+        if index >= INGEST_BATCH_MAX_RECORDS:
+            raise HTTPException(status_code=413, detail=f"Batch exceeds {INGEST_BATCH_MAX_RECORDS} records")
+        try:
+            if binary:
+                if item is None:
+                    raise ValueError("Truncated frame")
+                records.append(process_telemetry_frame(item))
+            else:
+                records.append(decode_telemetry(item))
+        except ValueError as ve:
+            # json.JSONDecodeError is a ValueError as well
+            errors.append([index, str(ve)])
+        index += 1
+    return records, errors
+
+# ------------------------------------------------------------
+# Deduplication
+# ------------------------------------------------------------
+class RecentKeyFilter:
+    """Bloom filter over recently stored (device_id, seq, t) keys.
+
+    Two generations of `capacity` keys: when the current one is full it
+    replaces the previous one, so every key from the last `capacity` inserts is
+    always found. A miss means the key is new within that window and needs no
+    database lookup; a hit is confirmed against the database, about 1% of new
+    keys hit falsely with 10 bits per key and 5 probes. Older duplicates are
+    still rejected by the unique index on insert.
+    """
+    _HASHES = 5
+    _BITS_PER_KEY = 10
+
+    def __init__(self, capacity: int) -> None:
+        self._capacity = max(1, capacity)
+        self._bits = self._capacity * self._BITS_PER_KEY
+        self._current = bytearray(self._bits // 8 + 1)
+        self._previous = bytearray(len(self._current))
+        self._count = 0
+
+    def _probes(self, key: Tuple[str, int, int]) -> List[int]:
+        # double hashing from one 64-bit hash
+        h = hash(key) & 0xFFFFFFFFFFFFFFFF
+        h1, h2 = h & 0xFFFFFFFF, (h >> 32) | 1
+        return [(h1 + i * h2) % self._bits for i in range(self._HASHES)]
+
+    def check_and_add(self, key: Tuple[str, int, int]) -> bool:
+        """Add key, returns True if it may have been added before"""
+        probes = self._probes(key)
+        current, previous = self._current, self._previous
+        seen = (all(current[i >> 3] & (1 << (i & 7)) for i in probes)
+                or all(previous[i >> 3] & (1 << (i & 7)) for i in probes))
+        for i in probes:
+            current[i >> 3] |= 1 << (i & 7)
+        self._count += 1
+        if self._count >= self._capacity:
+            self._previous, self._current = current, bytearray(len(current))
+            self._count = 0
+        return seen
+
+
+SEQ_FILTER = RecentKeyFilter(DEDUP_WINDOW)
+# device_id -> (highest seq stored, its sample time), for gap detection,
+# bounded like DEVICE_LAST_SEEN
+LAST_SEQ: Dict[str, Tuple[int, int]] = {}
+
+def _dedup_key(record: TelemetryRecord) -> Tuple[str, int, int]:
+    """(device_id, seq, t): a replay has the sample time of the original, a seq
+    reused after the device's NVS was erased has a later one"""
+    return record.device_id, record.seq, partitions.sample_time(record)
+
+def _is_late(device_id: str, seq: int, t: int) -> bool:
+    """Lower seq than the newest stored for the device, and not newer either"""
+    last = LAST_SEQ.get(device_id)
+    return last is not None and seq < last[0] and t <= last[1]
+
+def _track_seq(device_id: str, seq: int, t: int) -> None:
+    last = LAST_SEQ.get(device_id)
+    if last is None or seq > last[0]:
+        if last is not None and seq > last[0] + 1:
+            SEQ_GAPS.inc()
+            SEQ_MISSING.inc(seq - last[0] - 1)
+        _remember(LAST_SEQ, device_id, (seq, t))
+    elif seq < last[0]:
+        if t > last[1]:
+            SEQ_RESETS.inc()
+            _remember(LAST_SEQ, device_id, (seq, t))
+        else:
+            SEQ_LATE.inc()
+
+async def store_record(record: TelemetryRecord, trace: Optional["Trace"] = None) -> bool:
+    """Insert record unless its (device_id, seq, t) is already stored, True if inserted"""
+    key = _dedup_key(record) if record.seq is not None else None
+    if key is not None and SEQ_FILTER.check_and_add(key):
+        DEDUP_DB_CHECKS.inc()
+        if await db.existing_seqs([key]):
+            return False
+    row_id = await db.insert(record, trace)
+    if not row_id:
+        return False
+    LATEST.apply(row_id, *record[:6])
+    events = _geofence_transitions(record, key)
+    if key is not None:
+        _track_seq(*key)
+    if events:
+        await db.insert_geofence_events(events)
+    return True
+
+async def store_records(records: List[TelemetryRecord]) -> int:
+    """Insert the records not stored yet in one transaction, returns how many were new"""
+    keys = [_dedup_key(r) if r.seq is not None else None for r in records]
+    candidates = [key for key in keys if key is not None and SEQ_FILTER.check_and_add(key)]
+    if candidates:
+        DEDUP_DB_CHECKS.inc(len(candidates))
+        existing = await db.existing_seqs(candidates)
+        if existing:
+            kept = [(r, key) for r, key in zip(records, keys) if key not in existing]
+            records, keys = [r for r, _ in kept], [key for _, key in kept]
+    if not records:
+        return 0
+    inserted = await db.insert_many(records)
+    # executemany has no per row ids, the refresher reads the new rows back
+    LATEST.request_refresh()
+    # only stored records move geofence state and the sequence, like in store_record
+    events = []
+    for i in inserted:
+        events += _geofence_transitions(records[i], keys[i])
+        if keys[i] is not None:
+            _track_seq(*keys[i])
+    if events:
+        await db.insert_geofence_events(events)
+    return len(inserted)
+
+# ------------------------------------------------------------
+# Admission Control
+# ------------------------------------------------------------
+class DeviceRateLimiter:
+    """Token bucket per device_id.
+
+    Every device earns `rate` tokens per second up to `burst` and spends one per
+    record. Buckets are refilled lazily on the device's next request. Above
+    `capacity` devices the least recently seen one is forgotten, which only
+    hands it a full bucket again.
+    """
+
+    def __init__(self, rate: float, burst: float, capacity: int) -> None:
+        self._rate = rate
+        self._burst = max(1.0, burst)
+        self._capacity = max(1, capacity)
+        # device_id -> (tokens, monotonic time of the last refill), oldest first
+        self._buckets: Dict[str, Tuple[float, float]] = {}
+
+    def acquire(self, device_id: str) -> float:
+        """Take a token: 0.0 if the device may send, else seconds until it may"""
+        if self._rate <= 0:
+            return 0.0
+        now = time.monotonic()
+        buckets = self._buckets
+        state = buckets.pop(device_id, None)
+        if state is None:
+            tokens = self._burst
+            if len(buckets) >= self._capacity:
+                del buckets[next(iter(buckets))]
+        else:
+            tokens = min(self._burst, state[0] + (now - state[1]) * self._rate)
+        if tokens >= 1.0:
+            buckets[device_id] = (tokens - 1.0, now)
+            return 0.0
+        buckets[device_id] = (tokens, now)
+        return (1.0 - tokens) / self._rate
+
+
+class Admission:
+    """Bound on the HTTP ingest requests in progress, applied as ASGI middleware.
+
+    Without it every request is accepted and queues behind the others, so under
+    overload latency grows until clients time out. Above max_pending requests
+    to the ingest paths are answered 503 here, before routing or reading the
+    body, which costs a small fraction of serving one; the admitted ones keep a
+    latency of about max_pending / throughput.
+    """
+    PATHS = frozenset(("/ingest", "/ingest/batch"))
+
+    def __init__(self, max_pending: int) -> None:
+        self.max_pending = max_pending
+        self.pending = 0
+        body = b'{"detail":"Ingest queue full"}'
+        self._rejection = {"type": "http.response.start", "status": 503, "headers": [
+            (b"content-type", b"application/json"), (b"content-length", str(len(body)).encode()),
+            (b"retry-after", str(INGEST_RETRY_AFTER).encode())]}
+        self._rejection_body = {"type": "http.response.body", "body": body}
+
+    def middleware(self, app: Any) -> Any:
+        """Wrap an ASGI app, for app.add_middleware"""
+        async def admit(scope, receive, send) -> None:
+            if scope["type"] != "http" or scope["path"] not in self.PATHS:
+                await app(scope, receive, send)
+            elif 0 < self.max_pending <= self.pending:
+                INGEST_REJECTED_OVERLOAD.inc()
+                await send(self._rejection)
+                await send(self._rejection_body)
+            else:
+                self.pending += 1
+                try:
+                    await app(scope, receive, send)
+                finally:
+                    self.pending -= 1
+        return admit
+
+
+ADMISSION = Admission(INGEST_MAX_PENDING)
+
+
+RATE_LIMITER = DeviceRateLimiter(INGEST_DEVICE_RATE, INGEST_DEVICE_BURST, LATEST_MAX_DEVICES)
+
+def _check_rate(device_id: str) -> None:
+    wait = RATE_LIMITER.acquire(device_id)
+    if wait:
+        INGEST_REJECTED_RATE_LIMIT.inc()
+        raise HTTPException(status_code=429, detail="Device rate limit exceeded",
+                            headers={"Retry-After": str(max(1, math.ceil(wait)))})
+
+# ------------------------------------------------------------
+# Geofences
+# ------------------------------------------------------------
+# None until load_geofences(), also in processes that never load them
+GEOFENCES: Optional[GeofenceEngine] = None
+_geofence_signature: Optional[Tuple[int, int, int]] = None
+
+def _geofence_transitions(record: TelemetryRecord, key: Optional[Tuple[str, int, int]]) -> List[Tuple]:
+    """Enter/exit rows for geofence_events, call before _track_seq sees the
+    record; key is its _dedup_key, None without seq"""
+    engine = GEOFENCES
+    if engine is None or (not engine.index and not engine.state):
+        return []
+    # a late record (replay, reordering) must not move the device back
+    if key is not None and _is_late(*key):
+        return []
+    events = []
+    for t in engine.evaluate(record.device_id, record.latitude, record.longitude):
+        (GEOFENCE_ENTER if t.event == "enter" else GEOFENCE_EXIT).inc()
+        events.append((t.device_id, t.fence_id, t.event, record.latitude, record.longitude, record.date, record.time))
+    return events
+
+async def load_geofences() -> None:
+    """Build the index from the geofences table; the first call also loads device state"""
+    global GEOFENCES, _geofence_signature
+    signature, rows = await db.geofences()
+    fences = [Fence(r["id"], r["name"], validate_polygon(r["polygon"])) for r in rows]
+    index = await asyncio.to_thread(GeofenceIndex, fences)
+    if GEOFENCES is None:
+        state: Dict[str, set] = {}
+        for device_id, fence_id in await db.geofence_state():
+            state.setdefault(device_id, set()).add(fence_id)
+        GEOFENCES = GeofenceEngine(index, {d: frozenset(f) for d, f in state.items()})
+    GEOFENCES.replace_index(index)
+    _geofence_signature = signature
+    logger.info("Geofences loaded: %d fences, %d devices inside", len(index), len(GEOFENCES.state))
+
+async def watch_geofences() -> None:
+    """Pick up geofences added or deleted through another process"""
+    while True:
+        await asyncio.sleep(GEOFENCE_RELOAD_INTERVAL)
+        try:
+            if await db.geofence_signature() != _geofence_signature:
+                await load_geofences()
+        except Exception as e:
+            logger.warning("Geofence reload failed: %s", e)
+
+# ------------------------------------------------------------
+# Retention
+# ------------------------------------------------------------
+async def apply_retention() -> None:
+    """Roll up and drop the partitions older than RETENTION_DAYS.
+
+    Every step is its own short write: the rollup is computed on a reader
+    RETENTION_ROLLUP_ROWS rows at a time, the writer merges each piece and
+    finally swaps the partition out of the view, and its indexes and tables
+    are dropped and the file shrunk one at a time in between ingest.
+    """
+    cutoff = time.time() - RETENTION_DAYS * 86400
+    for part in await db.expired_partitions(cutoff):
+        rollups = 0
+        while True:
+            after, up_to, rows = await db.rollup(part, RETENTION_ROLLUP_ROWS)
+            if up_to == after:
+                break
+            if await db.merge_rollup(part, after, up_to, rows):
+                rollups += len(rows)
+        await db.retire(part)
+        PARTITIONS_RETIRED.inc()
+        logger.info("Retired partition %s: %d hourly rollups", part.name, rollups)
+    while await db.drop_retired() is not None:
+        pass
+    while await db.vacuum_step(RETENTION_VACUUM_PAGES):
+        pass
+
+async def run_retention() -> None:
+    while True:
+        try:
+            await apply_retention()
+        except Exception as e:
+            logger.warning("Retention run failed: %s", e)
+        await asyncio.sleep(RETENTION_INTERVAL)
+
+# ------------------------------------------------------------
+# Latest State
+# ------------------------------------------------------------
+_json_str = json.encoder.encode_basestring
+
+def _json_num(value: Optional[float]) -> str:
+    return "null" if value is None else repr(value)
+
+class LatestState:
+    """Newest committed record of every device, served by /devices/latest.
+
+    Rows are only applied after their commit and only if their id is higher
+    than the one held for the device, so the table matches the database no
+    matter in which order single inserts, batch read-backs and the refresher
+    deliver them. Each device is one bytes value, the row id followed by the
+    device's JSON object, so serving is a join instead of encoding every
+    device (about 250 bytes per device with the dict entry and key, ~250 MB for
+    1M devices). Above LATEST_MAX_DEVICES the least recently updated device is
+    dropped.
+    """
+    _ID = struct.Struct("<q")
+    _REFRESH_ROWS = 10000
+
+    def __init__(self, capacity: int) -> None:
+        self._capacity = max(1, capacity)
+        # device_id -> row id + JSON object, dict order is update order
+        self._rows: Dict[str, bytes] = {}
+        # every row up to this id has been applied
+        self._after_id = 0
+        self._loaded = False
+        # set once load() has finished
+        self.ready = asyncio.Event()
+        self._dirty = asyncio.Event()
+        self._body: Tuple[int, bytes] = (-1, b"")
+        self._etag_prefix = f"{os.getpid():x}.{time.time_ns():x}"
+        self.version = 0
+
+    def __len__(self) -> int:
+        return len(self._rows)
+
+    def apply(self, row_id: int, device_id: str, longitude: float, latitude: float, battery: int,
+              date: str, time_: str) -> None:
+        if not self._loaded:
+            # headless ingest workers never serve it, load() covers the rest
+            return
+        rows = self._rows
+        current = rows.get(device_id)
+        if current is not None:
+            if self._ID.unpack_from(current)[0] >= row_id:
+                return
+            del rows[device_id]
+        elif len(rows) >= self._capacity:
+            del rows[next(iter(rows))]
+            LATEST_EVICTIONS.inc()
+        item = (f'{{"id":{row_id},"device_id":{_json_str(device_id)},"longitude":{_json_num(longitude)},'
+                f'"latitude":{_json_num(latitude)},"battery":{_json_num(battery)},'
+                f'"date":{_json_str(date)},"time":{_json_str(time_)}}}')
+        encoded = item.encode()
+        rows[device_id] = self._ID.pack(row_id) + encoded
+        self.version += 1
+        FEED.publish(encoded)
+
+    async def load(self) -> None:
+        """Rebuild from the database, once before serving"""
+        self._loaded = True
+        max_id, rows = await db.latest_rows()
+        for row in rows:
+            self.apply(*row)
+        self._after_id = max(self._after_id, max_id)
+        self.ready.set()
+        logger.info("Latest state loaded: %d devices", len(self._rows))
+
+    async def refresh(self) -> None:
+        """Apply rows committed since the last refresh, by this or any other process"""
+        while True:
+            rows = await db.rows_after(self._after_id, self._REFRESH_ROWS)
+            for row in rows:
+                self.apply(*row)
+            if rows:
+                self._after_id = rows[-1][0]
+            if len(rows) < self._REFRESH_ROWS:
+                return
+
+    def request_refresh(self) -> None:
+        self._dirty.set()
+
+    async def run(self) -> None:
+        """Load in the background of a serving app, retrying until it works, then refresh"""
+        while True:
+            try:
+                await self.load()
+                break
+            except Exception as e:
+                logger.warning("Latest state load failed: %s", e)
+                await asyncio.sleep(1.0)
+        await self.run_refresher()
+
+    async def run_refresher(self) -> None:
+        """Refresh on request, and every LATEST_REFRESH_INTERVAL (0 = on request only)"""
+        while True:
+            try:
+                await asyncio.wait_for(self._dirty.wait(), LATEST_REFRESH_INTERVAL or None)
+            except asyncio.TimeoutError:
+                pass
+            self._dirty.clear()
+            try:
+                await self.refresh()
+            except Exception as e:
+                logger.warning("Latest state refresh failed: %s", e)
+
+    def etag(self, version: Optional[int] = None) -> str:
+        return f'"{self._etag_prefix}.{self.version if version is None else version:x}"'
+
+    @staticmethod
+    def _encode(values: List[bytes]) -> bytes:
+        return b'{"count":%d,"items":[%b]}' % (len(values), b",".join([v[8:] for v in values]))
+
+    async def render(self) -> Tuple[int, bytes]:
+        """(version, JSON body), built once per version off the event loop"""
+        version, body = self._body
+        if version != self.version:
+            version = self.version
+            body = await asyncio.to_thread(self._encode, list(self._rows.values()))
+            if version > self._body[0]:
+                self._body = (version, body)
+        return version, body
+
+
+LATEST = LatestState(LATEST_MAX_DEVICES)
+
+# ------------------------------------------------------------
+# Live Feed
+# ------------------------------------------------------------
+class LiveFeed:
+    """Fan out of newly applied records to /stream viewers.
+
+    Publishing appends to one ring of STREAM_BUFFER records and never waits
+    for a viewer, whatever the number of viewers. Every STREAM_INTERVAL a
+    ticker wakes the viewers once; each sends what arrived since its cursor as
+    one event, shared between viewers at the same cursor. A viewer that falls
+    more than STREAM_BUFFER records behind (its socket stopped draining) skips
+    ahead and is told how many records it dropped.
+    """
+
+    def __init__(self, capacity: int) -> None:
+        self._capacity = max(1, capacity)
+        self._ring: List[bytes] = [b""] * self._capacity
+        # sequence number of the next record, and the last one viewers were woken for
+        self._head = 0
+        self._flushed = 0
+        self._wakeup = asyncio.Event()
+        # (start, end) -> encoded event, valid until the next tick
+        self._events: Dict[Tuple[int, int], bytes] = {}
+        self.viewers = 0
+
+    def publish(self, item: bytes) -> None:
+        if not self.viewers:
+            return
+        self._ring[self._head % self._capacity] = item
+        self._head += 1
+
+    async def run_ticker(self) -> None:
+        while True:
+            await asyncio.sleep(STREAM_INTERVAL)
+            if self._flushed != self._head:
+                self._flushed = self._head
+                self._events = {}
+                wakeup, self._wakeup = self._wakeup, asyncio.Event()
+                wakeup.set()
+
+    def _read(self, cursor: int) -> Tuple[int, int, bytes]:
+        """(new cursor, dropped, SSE event with the records from cursor on)"""
+        end = self._flushed
+        start = max(cursor, end - self._capacity, self._head - self._capacity)
+        event = self._events.get((start, end))
+        if event is None:
+            ring, cap = self._ring, self._capacity
+            items = b",".join([ring[i % cap] for i in range(start, end)])
+            event = self._events[(start, end)] = b"event: records\ndata: [%b]\n\n" % items
+        return end, start - cursor, event
+
+    async def events(self) -> AsyncIterator[bytes]:
+        """SSE stream for one viewer, starting at the next record"""
+        self.viewers += 1
+        cursor = self._flushed
+        try:
+            yield b"retry: 2000\n\n"
+            while True:
+                if cursor == self._flushed:
+                    try:
+                        await asyncio.wait_for(self._wakeup.wait(), 15.0)
+                    except asyncio.TimeoutError:
+                        yield b": keepalive\n\n"
+                        continue
+                # the send below waits while this viewer's socket is full, the
+                # ring keeps moving and the next read skips what it missed
+                cursor, dropped, event = self._read(cursor)
+                if dropped:
+                    STREAM_DROPPED.inc(dropped)
+                    yield b"event: dropped\ndata: %d\n\n" % dropped
+                yield event
+        finally:
+            self.viewers -= 1
+
+
+FEED = LiveFeed(STREAM_BUFFER)
+
+# ------------------------------------------------------------
+# Tracing
+# ------------------------------------------------------------
+trace_logger = logging.getLogger(f"{__name__}.trace")
+
+class Trace:
+    """Timestamps (unix seconds) of one sampled message on its way to the database"""
+    __slots__ = ("transport", "device_id", "seq", "sample_ts", "received", "decoded", "committed")
+
+    def __init__(self, transport: str, received: float) -> None:
+        self.transport = transport
+        self.received = received
+        self.device_id: Optional[str] = None
+        self.seq: Optional[int] = None
+        self.sample_ts: Optional[float] = None
+        self.decoded: Optional[float] = None
+        self.committed: Optional[float] = None
+
+    def stages(self) -> Dict[str, Optional[float]]:
+        """Latency per stage in milliseconds.
+
+        network_broker: device sample to cloud receive, includes the device
+        clock offset (SNTP). decode: receive to decoded record. database: writer
+        queue and group commit.
+        """
+        return {
+            "network_broker_ms": (self.received - self.sample_ts) * 1000.0 if self.sample_ts else None,
+            "decode_ms": (self.decoded - self.received) * 1000.0,
+            "database_ms": (self.committed - self.decoded) * 1000.0,
+        }
+
+    def as_dict(self) -> Dict[str, Any]:
+        return {
+            "transport": self.transport,
+            "device_id": self.device_id,
+            "seq": self.seq,
+            "sample_ts": self.sample_ts,
+            "received": self.received,
+            "decoded": self.decoded,
+            "committed": self.committed,
+            **{k: None if v is None else round(v, 3) for k, v in self.stages().items()},
+        }
+
+
+TRACES: "deque[Trace]" = deque(maxlen=TRACE_BUFFER)
+
+def _start_trace(transport: str) -> Optional[Trace]:
+    """A Trace for the sampled fraction of messages, None for the rest"""
+    if TRACE_SAMPLE_RATE <= 0.0 or random.random() >= TRACE_SAMPLE_RATE:
+        return None
+    return Trace(transport, time.time())
+
+def _decoded_trace(trace: Trace, record: TelemetryRecord) -> None:
+    trace.decoded = time.time()
+    trace.device_id = record.device_id
+    trace.seq = record.seq
+    trace.sample_ts = record.sample_ts / 1000.0 if record.sample_ts is not None else None
+
+def _finish_trace(trace: Trace) -> None:
+    if trace.committed is None:
+        return
+    TRACES.append(trace)
+    if trace_logger.isEnabledFor(logging.INFO):
+        trace_logger.info(json.dumps(trace.as_dict(), separators=(",", ":")))
+
+def trace_report() -> Dict[str, Any]:
+    """Percentiles per stage over the buffered traces"""
+    traces = list(TRACES)
+    stages: Dict[str, List[float]] = {}
+    for trace in traces:
+        for name, value in trace.stages().items():
+            if value is not None:
+                stages.setdefault(name, []).append(value)
+
+    report = {}
+    for name, values in stages.items():
+        values.sort()
+        n = len(values)
+        report[name] = {
+            "count": n,
+            "p50": round(values[n // 2], 3),
+            "p90": round(values[min(n - 1, int(n * 0.90))], 3),
+            "p99": round(values[min(n - 1, int(n * 0.99))], 3),
+            "max": round(values[-1], 3),
+        }
+    return {
+        "traces": len(traces),
+        "sample_rate": TRACE_SAMPLE_RATE,
+        "stages": report,
+        # the stage where a typical message spends most of its time
+        "bottleneck": max(report, key=lambda k: report[k]["p50"]) if report else None,
     }
 
 # ------------------------------------------------------------
 # FastAPI + MQTT
 # ------------------------------------------------------------
-mqtt_config = MQTTConfig(host=MQTT_HOST, port=MQTT_PORT, keepalive=60)
-fast_mqtt = FastMQTT(config=mqtt_config)
+# fastapi_mqtt (and gmqtt) are imported by mqtt_client(), once MQTT is started
+fast_mqtt: Optional[Any] = None
+_mqtt_task: Optional["asyncio.Task[None]"] = None
 
-@asynccontextmanager
-async def lifespan(_app: FastAPI):
-    # Start MQTT client if enabled
-    started = False
-    if MQTT_ENABLED:
+async def _watch_event_loop_lag() -> None:
+    """Record how late a periodic wakeup runs, i.e. how long callbacks block the loop"""
+    loop = asyncio.get_running_loop()
+    while True:
+        expected = loop.time() + EVENT_LOOP_LAG_INTERVAL
+        await asyncio.sleep(EVENT_LOOP_LAG_INTERVAL)
+        EVENT_LOOP_LAG.observe(max(0.0, loop.time() - expected))
+
+async def _connect_mqtt() -> None:
+    """Connect without holding up startup, retrying until the broker answers"""
+    delay = min(1.0, MQTT_RETRY_MAX)
+    while True:
         try:
-            await fast_mqtt.mqtt_startup()
-            started = True
+            await mqtt_client().mqtt_startup()
             logger.info("MQTT client started successfully")
+            return
         except Exception as e:
-            logger.warning("MQTT startup failed (%s:%s): %s. Continuing without MQTT.", MQTT_HOST, MQTT_PORT, e)
+            logger.warning("MQTT startup failed (%s:%s): %s. Retrying in %.0f s.", MQTT_HOST, MQTT_PORT, e, delay)
+        await asyncio.sleep(delay)
+        delay = min(delay * 2.0, MQTT_RETRY_MAX)
+
+def readiness() -> Dict[str, Any]:
+    """State of everything a serving instance needs, see /health/ready"""
+    checks = {
+        "database": db.is_open,
+        "geofences": GEOFENCES is not None,
+        "latest_state": LATEST.ready.is_set(),
+    }
+    if MQTT_ENABLED:
+        checks["mqtt"] = fast_mqtt is not None and bool(fast_mqtt.client.is_connected)
+    return {"ready": all(checks.values()), "checks": checks}
+
+@asynccontextmanager
+async def lifespan(_app: FastAPI):
+    global _mqtt_task
+    # Only what ingest needs to be correct is awaited here. The latest state
+    # and MQTT come up in the background while requests are already served.
+    db.open()
+    await load_geofences()
+    lag_watcher = asyncio.create_task(_watch_event_loop_lag())
+    latest = asyncio.create_task(LATEST.run())
+    feed_ticker = asyncio.create_task(FEED.run_ticker())
+    geofence_watcher = asyncio.create_task(watch_geofences())
+    retention = asyncio.create_task(run_retention()) if RETENTION_DAYS > 0 else None
+    if MQTT_ENABLED:
+        _mqtt_task = asyncio.create_task(_connect_mqtt())
     else:
         logger.info("MQTT is disabled via MQTT_ENABLED env var.")
-    
+
     try:
         yield
     finally:
-        if started:
-            try:
-                await fast_mqtt.mqtt_shutdown()
-            except Exception:
-                pass
+        lag_watcher.cancel()
+        latest.cancel()
+        feed_ticker.cancel()
+        geofence_watcher.cancel()
+        if retention is not None:
+            retention.cancel()
+        try:
+            if _mqtt_task is not None:
+                _mqtt_task.cancel()
+                # fast_mqtt stays None when shutdown comes before _connect_mqtt got to it
+                if fast_mqtt is not None and fast_mqtt.client.is_connected:
+                    try:
+                        await fast_mqtt.mqtt_shutdown()
+                    except Exception:
+                        pass
+        finally:
+            db.close()
 
 app = FastAPI(lifespan=lifespan)
-templates = Jinja2Templates(directory="templates")
+# outermost, so a rejected request never reaches FastAPI
+app.add_middleware(ADMISSION.middleware)
+_templates = None
+
+def _dashboard_templates():
+    # jinja2 is only imported by the first dashboard request
+    global _templates
+    if _templates is None:
+        from fastapi.templating import Jinja2Templates
+        _templates = Jinja2Templates(directory="templates")
+    return _templates
 
-@fast_mqtt.on_connect()
 def _on_connect(client, flags, rc, properties):
-    logger.info("MQTT connected: rc=%s host=%s", rc, MQTT_HOST)
+    logger.info("MQTT connected: rc=%s host=%s client_id=%s session_present=%s",
+                rc, MQTT_HOST, MQTT_CLIENT_ID, flags)
 
-@fast_mqtt.on_disconnect()
 def _on_disconnect(client, packet, exc=None):
     logger.info("MQTT disconnected")
 
-# Subscribe to telemetry topic pattern
-@fast_mqtt.subscribe("tc-bn/telemetry/+")
+def _owns_topic(topic: str) -> bool:
+    """True if the device publishing on topic belongs to this worker's partition"""
+    if MQTT_PARTITIONS <= 1:
+        return True
+    device_id = topic.rsplit("/", 1)[-1]
+    return zlib.crc32(device_id.encode()) % MQTT_PARTITIONS == MQTT_PARTITION
+
+def _content_type(properties: Any) -> Optional[str]:
+    """The MQTT 5 content type of a message, None for MQTT 3.1.1"""
+    if not isinstance(properties, dict):
+        return None
+    value = properties.get("content_type")
+    if isinstance(value, (list, tuple)):
+        value = value[0] if value else None
+    return value if isinstance(value, str) else None
+
 async def _on_message(client, topic: str, payload: bytes, qos: int, properties):
+    if not _owns_topic(topic):
+        return
+    trace = _start_trace("mqtt")
     try:
-        message = json.loads(payload.decode())
-        logger.info("Received MQTT message on topic %s: %s", topic, message)
-        
-        record = process_telemetry_message(message)
-        logger.info(record)
-        db.insert(record)
-        logger.info("MQTT telemetry stored: device_id=%s", record["device_id"])
-        
+        record = decode_envelope(payload, _content_type(properties))
+    except ValueError as e:
+        DECODE_FAILURES_MQTT.inc()
+        logger.warning("Invalid MQTT telemetry on %s: %s", topic, e)
+        return
+
+    try:
+        if trace is not None:
+            _decoded_trace(trace, record)
+        if not await store_record(record, trace):
+            DUPLICATES_MQTT.inc()
+            logger.debug("MQTT telemetry duplicate: %s", record)
+            return
+        INGEST_MQTT.inc()
+        _remember(DEVICE_LAST_SEEN, record.device_id, time.time())
+        if trace is not None:
+            _finish_trace(trace)
+        logger.debug("MQTT telemetry stored: %s", record)
     except Exception as e:
         logger.exception("Failed to process MQTT message on %s: %s", topic, e)
 
+async def _on_metrics(client, topic: str, payload: bytes, qos: int, properties):
+    if not _owns_topic(topic):
+        return
+    device_id = topic.rsplit("/", 1)[-1]
+    try:
+        snapshot = decode_metrics_snapshot(payload)
+        await db.insert_metrics(device_id, snapshot)
+        logger.debug("MQTT metrics stored: device_id=%s", device_id)
+    except Exception as e:
+        logger.exception("Failed to process MQTT metrics on %s: %s", topic, e)
+
+def mqtt_client() -> Any:
+    """The FastMQTT client with the handlers above, created on first use"""
+    global fast_mqtt
+    if fast_mqtt is None:
+        from fastapi_mqtt import FastMQTT, MQTTConfig
+        client = FastMQTT(
+            config=MQTTConfig(host=MQTT_HOST, port=MQTT_PORT, keepalive=60),
+            client_id=MQTT_CLIENT_ID,
+            clean_session=MQTT_CLEAN_SESSION,
+            session_expiry_interval=MQTT_SESSION_EXPIRY,
+            # PUBACK once the handlers returned, i.e. the record is committed;
+            # the broker redelivers whatever a restart interrupted
+            optimistic_acknowledgement=False,
+        )
+        # gmqtt acknowledges with the reason code on_message returns, FastMQTT
+        # returns the list of handler results
+        dispatch = client.client.on_message
+
+        async def _acknowledge(*args: Any) -> int:
+            await dispatch(*args)
+            return 0
+
+        client.client.on_message = _acknowledge
+        client.on_connect()(_on_connect)
+        client.on_disconnect()(_on_disconnect)
+        # Subscribe to telemetry topic pattern
+        client.subscribe(TELEMETRY_SUBSCRIPTION, qos=MQTT_QOS)(_on_message)
+        client.subscribe(METRICS_SUBSCRIPTION, qos=MQTT_QOS)(_on_metrics)
+        fast_mqtt = client
+    return fast_mqtt
+
 # ------------------------------------------------------------
 # HTTP Endpoints
 # ------------------------------------------------------------
 @app.post("/ingest")
 async def ingest(request: Request):
-    """Receive telemetry data via HTTP POST"""
+    """Receive telemetry data via HTTP POST.
+
+    The body is JSON, CBOR or msgpack, by Content-Type or its first byte (see
+    envelope.py). Answers 429 with Retry-After when the device is over its rate
+    limit, and 503 while INGEST_MAX_PENDING requests are in progress (see
+    Admission).
+    """
+    trace = _start_trace("http")
+    body = await request.body()
+    
     try:
-        body = await request.json()
-    except Exception:
+        record = decode_envelope(body, request.headers.get("content-type"))
+    except json.JSONDecodeError:
+        DECODE_FAILURES_HTTP.inc()
         raise HTTPException(status_code=400, detail="Invalid JSON")
-    
+    except ValueError as ve:
+        DECODE_FAILURES_HTTP.inc()
+        raise HTTPException(status_code=400, detail=str(ve))
+    _check_rate(record.device_id)
+
     try:
-        record = process_telemetry_message(body)
-        logger.info(record)
-        db.insert(record)
+        if trace is not None:
+            _decoded_trace(trace, record)
+        inserted = await store_record(record, trace)
+        if inserted:
+            INGEST_HTTP.inc()
+            _remember(DEVICE_LAST_SEEN, record.device_id, time.time())
+            if trace is not None:
+                _finish_trace(trace)
+            logger.debug("HTTP telemetry stored: %s", record)
+        else:
+            DUPLICATES_HTTP.inc()
         return JSONResponse(content={
             "status": "success",
-            "device_id": record["device_id"],
-            "longitude": record["longitude"],
-            "latitude": record["latitude"], 
-            "battery": record["battery"]
+            "device_id": record.device_id,
+            "longitude": record.longitude,
+            "latitude": record.latitude, 
+            "battery": record.battery,
+            "duplicate": not inserted,
         })
-    except ValueError as ve:
-        raise HTTPException(status_code=400, detail=str(ve))
     except Exception as e:
         logger.exception("Failed to ingest via HTTP: %s", e)
         raise HTTPException(status_code=500, detail="Internal server error")
 
+@app.post("/ingest/batch")
+async def ingest_batch(request: Request):
+    """Receive many telemetry records in one request.
+
+    Content-Type application/x-ndjson: one JSON object per line, same shape as /ingest.
+    Content-Type application/octet-stream: length-prefixed binary frames, see
+    process_telemetry_frame. Valid records are committed in one transaction,
+    invalid ones are reported as [index, error] pairs. Counts as one request
+    against INGEST_MAX_PENDING; device rate limits do not apply, gateways
+    upload backlogs.
+    """
+    records, errors = await process_telemetry_batch(request)
+    DECODE_FAILURES_HTTP_BATCH.inc(len(errors))
+    try:
+        inserted = await store_records(records) if records else 0
+    except Exception as e:
+        logger.exception("Failed to ingest batch via HTTP: %s", e)
+        raise HTTPException(status_code=500, detail="Internal server error")
+
+    INGEST_HTTP_BATCH.inc(inserted)
+    DUPLICATES_HTTP_BATCH.inc(len(records) - inserted)
+    now = time.time()
+    for record in records:
+        _remember(DEVICE_LAST_SEEN, record.device_id, now)
+
+    return JSONResponse(
+        status_code=200 if records or not errors else 400,
+        content={
+            "status": "success" if not errors else "partial" if records else "failed",
+            "accepted": len(records),
+            "duplicates": len(records) - inserted,
+            "rejected": len(errors),
+            "errors": errors,
+        },
+    )
+
 @app.get("/records")
 async def list_records():
     """Get recent telemetry records"""
-    items = db.list()
+    items = await db.list()
+    return {
+        "count": len(items),
+        "items": items
+    }
+
+def _etag_matches(header: Optional[str], etag: str) -> bool:
+    if not header:
+        return False
+    tags = [t.strip() for t in header.split(",")]
+    return "*" in tags or etag in tags or f"W/{etag}" in tags
+
+GEO_QUERY_MAX_DEVICES = 10000
+
+def _check_coordinates(lat: float, lon: float) -> None:
+    if not (-90.0 <= lat <= 90.0 and -180.0 <= lon <= 180.0):
+        raise HTTPException(status_code=400, detail="Latitude must be within [-90, 90] and longitude within [-180, 180]")
+
+def _time_window(start: Optional[datetime], end: Optional[datetime]) -> Tuple[Optional[float], Optional[float]]:
+    # naive datetimes are UTC, like the telemetry date/time fields
+    def _unix(value: Optional[datetime]) -> Optional[float]:
+        if value is None:
+            return None
+        return (value if value.tzinfo else value.replace(tzinfo=timezone.utc)).timestamp()
+    return _unix(start), _unix(end)
+
+@app.get("/query/bbox")
+async def query_bbox(min_lat: float, min_lon: float, max_lat: float, max_lon: float,
+                     start: Optional[datetime] = None, end: Optional[datetime] = None, limit: int = 1000):
+    """Devices that reported from inside the box between start and end.
+
+    start/end are ISO 8601 or unix seconds, both optional and inclusive.
+    min_lon > max_lon selects a box across the antimeridian.
+    """
+    _check_coordinates(min_lat, min_lon)
+    _check_coordinates(max_lat, max_lon)
+    if min_lat > max_lat:
+        raise HTTPException(status_code=400, detail="min_lat must not be greater than max_lat")
+    lon_ranges = [(min_lon, max_lon)] if min_lon <= max_lon else [(min_lon, 180.0), (-180.0, max_lon)]
+    t_start, t_end = _time_window(start, end)
+    items = await db.devices_in_area(lon_ranges, min_lat, max_lat, t_start, t_end,
+                                     limit=max(1, min(limit, GEO_QUERY_MAX_DEVICES)))
+    return {"count": len(items), "items": items}
+
+@app.get("/query/radius")
+async def query_radius(lat: float, lon: float, radius_m: float,
+                       start: Optional[datetime] = None, end: Optional[datetime] = None, limit: int = 1000):
+    """Devices that reported within radius_m meters of (lat, lon) between start and end"""
+    _check_coordinates(lat, lon)
+    if not radius_m > 0.0:
+        raise HTTPException(status_code=400, detail="radius_m must be positive")
+    # bounding box of the circle, the exact distance is checked per candidate
+    d_lat = math.degrees(radius_m / _EARTH_RADIUS_M)
+    min_lat, max_lat = max(-90.0, lat - d_lat), min(90.0, lat + d_lat)
+    cos_lat = min(math.cos(math.radians(min_lat)), math.cos(math.radians(max_lat)))
+    d_lon = 180.0 if cos_lat <= 1e-9 else math.degrees(radius_m / (_EARTH_RADIUS_M * cos_lat))
+    if d_lon >= 180.0 or min_lat == -90.0 or max_lat == 90.0:
+        lon_ranges = [(-180.0, 180.0)]
+    elif lon - d_lon < -180.0:
+        lon_ranges = [(lon - d_lon + 360.0, 180.0), (-180.0, lon + d_lon)]
+    elif lon + d_lon > 180.0:
+        lon_ranges = [(lon - d_lon, 180.0), (-180.0, lon + d_lon - 360.0)]
+    else:
+        lon_ranges = [(lon - d_lon, lon + d_lon)]
+    t_start, t_end = _time_window(start, end)
+    items = await db.devices_in_area(lon_ranges, min_lat, max_lat, t_start, t_end, (lat, lon, radius_m),
+                                     limit=max(1, min(limit, GEO_QUERY_MAX_DEVICES)))
+    return {"count": len(items), "items": items}
+
+def _track_line(device_id: str, total: int, track) -> bytes:
+    # grid steps back to the stored (rounded) coordinates, times to unix seconds
+    points = [[_LONGITUDES[lon], _LATITUDES[lat], t + GEO_EPOCH] for lon, lat, t in track.tolist()]
+    return json.dumps({"device_id": device_id, "points": total, "kept": len(points), "track": points},
+                      separators=(",", ":")).encode() + b"\n"
+
+@app.get("/tracks/simplified")
+async def tracks_simplified(tolerance_m: float = 25.0, device_id: Optional[str] = None,
+                            start: Optional[datetime] = None, end: Optional[datetime] = None):
+    """Douglas-Peucker simplified tracks as NDJSON, one line per device.
+
+    Every dropped point is within tolerance_m meters of the simplified line.
+    Without device_id all devices are streamed, each line as soon as its
+    track is done; devices without points in the window are left out. Track
+    points are [longitude, latitude, unix seconds] in time order.
+    """
+    if not tolerance_m >= 0.0:
+        raise HTTPException(status_code=400, detail="tolerance_m must not be negative")
+    t_start, t_end = _time_window(start, end)
+    device_ids = [device_id] if device_id is not None else await db.device_ids(t_start, t_end)
+
+    async def _lines() -> AsyncIterator[bytes]:
+        for d in device_ids:
+            total, track = await db.simplified_track(d, t_start, t_end, tolerance_m)
+            if total:
+                yield _track_line(d, total, track)
+
+    return StreamingResponse(_lines(), media_type="application/x-ndjson")
+
+@app.post("/geofences")
+async def create_geofence(request: Request):
+    """Add a geofence: {"name": "...", "polygon": [[lon, lat], ...]}"""
+    try:
+        body = await request.json()
+        name = body["name"]
+        polygon = validate_polygon(body["polygon"])
+    except (json.JSONDecodeError, KeyError, TypeError):
+        raise HTTPException(status_code=400, detail='Body must be {"name": str, "polygon": [[lon, lat], ...]}')
+    except ValueError as ve:
+        raise HTTPException(status_code=400, detail=str(ve))
+    if not isinstance(name, str) or not name:
+        raise HTTPException(status_code=400, detail="name must be a non-empty string")
+    fence_id = await db.insert_geofence(name, polygon)
+    await load_geofences()
+    return JSONResponse(status_code=201, content={"id": fence_id, "name": name, "polygon": polygon})
+
+@app.get("/geofences")
+async def list_geofences():
+    _, items = await db.geofences()
+    return {"count": len(items), "items": items}
+
+@app.delete("/geofences/{fence_id}")
+async def delete_geofence(fence_id: int):
+    """Remove a geofence, devices inside it get no exit event"""
+    if not await db.delete_geofence(fence_id):
+        raise HTTPException(status_code=404, detail="Geofence not found")
+    await load_geofences()
+    return {"status": "deleted", "id": fence_id}
+
+@app.get("/geofences/events")
+async def geofence_events(after: int = 0, limit: int = 100):
+    """Enter/exit events with id > after, oldest first.
+
+    Poll with after set to the returned `next` to follow new events.
+    """
+    items = await db.geofence_events(after, max(1, min(limit, RECORDS_PAGE_MAX)))
+    return {"items": items, "next": items[-1]["id"] if items else after}
+
+@app.get("/rollups/hourly")
+async def rollups_hourly(device_id: Optional[str] = None, start: Optional[datetime] = None,
+                         end: Optional[datetime] = None, limit: int = 1000):
+    """Per device and hour aggregates of the samples retention dropped.
+
+    hour and last_t are unix seconds; longitude, latitude and battery are the
+    hour's last sample.
+    """
+    t_start, t_end = _time_window(start, end)
+    return {"items": await db.hourly(device_id, t_start, t_end, max(1, min(limit, RECORDS_PAGE_MAX)))}
+
+@app.get("/devices/latest")
+async def devices_latest(request: Request):
+    """Latest position and battery of every device, least recently updated first.
+
+    Answers 304 when If-None-Match carries the current ETag, and 503 while the
+    state is still being loaded after a start.
+    """
+    if not LATEST.ready.is_set():
+        raise HTTPException(status_code=503, detail="Latest state is loading", headers={"Retry-After": "1"})
+    if _etag_matches(request.headers.get("if-none-match"), LATEST.etag()):
+        return Response(status_code=304, headers={"ETag": LATEST.etag()})
+    version, body = await LATEST.render()
+    return Response(content=body, media_type="application/json",
+                    headers={"ETag": LATEST.etag(version), "Cache-Control": "no-cache"})
+
+@app.get("/stream")
+async def stream():
+    """Server-Sent Events with the records stored from now on, see LiveFeed"""
+    return StreamingResponse(FEED.events(), media_type="text/event-stream",
+                             headers={"Cache-Control": "no-cache", "X-Accel-Buffering": "no"})
+
+@app.get("/records/page")
+async def records_page(before: Optional[int] = None, limit: int = 100):
+    """One page of records, newest first.
+
+    Pass the returned `next` as `before` for the following page; it is null on
+    the last page. Pages are keyed on the row id, so every page costs the same
+    and rows arriving meanwhile never shift the pages already served.
+    """
+    limit = max(1, min(limit, RECORDS_PAGE_MAX))
+    items = await db.page(before, limit)
+    return {
+        "items": items,
+        "next": items[-1]["id"] if len(items) == limit else None,
+    }
+
+@app.get("/metrics")
+async def metrics_endpoint():
+    """Ingest pipeline metrics in OpenMetrics text format, for Prometheus"""
+    return Response(content=metrics.REGISTRY.render(), media_type=metrics.CONTENT_TYPE)
+
+@app.get("/health/live")
+async def health_live():
+    """Liveness probe, answers as soon as requests are served"""
+    return {"status": "ok"}
+
+@app.get("/health/ready")
+async def health_ready():
+    """Readiness probe: 200 once the database, geofences, latest state and MQTT
+    (when enabled) are up, 503 with the failing checks before and whenever the
+    broker connection drops"""
+    state = readiness()
+    return JSONResponse(state, status_code=200 if state["ready"] else 503)
+
+@app.get("/trace/report")
+async def trace_report_endpoint():
+    """Latency breakdown (network/broker, decode, database) of sampled messages"""
+    return trace_report()
+
+@app.get("/trace/recent")
+async def trace_recent(limit: int = 100):
+    """Most recent sampled traces, newest first"""
+    # newest first straight off the deque; slicing a copy with [-limit:] gave everything for 0
+    recent = itertools.islice(reversed(TRACES), max(0, min(limit, TRACE_BUFFER)))
+    return {"items": [t.as_dict() for t in recent]}
+
+@app.get("/device-metrics")
+async def device_metrics():
+    """Latest firmware metrics per device, with approximate p50/p99 latencies"""
+    items = await db.latest_metrics()
+    for item in items:
+        for histogram in item["histograms"].values():
+            count = histogram["count"]
+            histogram["mean_us"] = histogram["sum_us"] // count if count else None
+            histogram["p50_us"] = _bucket_quantile(histogram["buckets"], count, 0.50)
+            histogram["p99_us"] = _bucket_quantile(histogram["buckets"], count, 0.99)
     return {
         "count": len(items),
         "items": items
@@ -218,79 +2337,111 @@ async def list_records():
 
 @app.get("/")
 async def dashboard(request: Request):
-    """Display telemetry dashboard"""
-    items = db.list()
-    
-    # Format records for display
-    view = []
-    for item in items:
-        view.append({
-            "id": item["device_id"],
-            "longitude": f"{item['longitude']:.2f}",
-            "latitude": f"{item['latitude']:.2f}",
-            "battery": f"{item['battery']}%",
-            "date": item["date"],
-            "time": item["time"],
-        })
-    
-    return templates.TemplateResponse(
+    """Display telemetry dashboard.
+
+    The page holds no records, the table loads them from /records/page while
+    scrolling and from /stream as they arrive, so it stays the same size
+    whatever the table size.
+    """
+    return _dashboard_templates().TemplateResponse(
         "index.html",
-        {"request": request, "records": view},
+        {"request": request, "page_size": min(DASHBOARD_PAGE_SIZE, RECORDS_PAGE_MAX)},
     )
 
-@app.get("/download-csv-raw")
-async def download_csv():
-    """Download telemetry records as CSV"""
-    items = db.list()
-    
-    # Create CSV content
-    csv_content = "Device ID,Longitude,Latitude,Battery,Date,Time,Inserted At\n"
-    for item in items:
-        csv_content += f"{item['device_id']},{item['longitude']},{item['latitude']},{item['battery']},{item['date']},{item['time']},{item['inserted_at']}\n"
-    
-    # Return CSV file
-    return Response(
-        content=csv_content,
-        media_type="text/csv",
-        headers={"Content-Disposition": "attachment; filename=telemetry_data.csv"}
-    )
+async def _export(fmt: str, compression: str, device_id: Optional[str], start: Optional[datetime],
+                  end: Optional[datetime]) -> AsyncIterator[bytes]:
+    t_start, t_end = _time_window(start, end)
+    encoder = columnar.Encoder(fmt, compression)
+    after = 0
+    while True:
+        after, batch = await db.export_batch(after, t_start, t_end, device_id, EXPORT_BATCH_ROWS)
+        # compression runs in pyarrow without the GIL
+        chunk = await asyncio.to_thread(encoder.write, batch)
+        if chunk:
+            yield chunk
+        if batch.num_rows < EXPORT_BATCH_ROWS:
+            break
+    yield encoder.close()
 
 
-@app.get("/download-csv-processed")
-async def download_csv_processed():
-    """Download processed telemetry records as CSV, with one hour intervals for a span of 12 hours"""
-    items = db.list()
-    df = pd.DataFrame(items)
-    # create datetime column
-    df['datetime'] = pd.to_datetime(df['date'] + ' ' + df['time'])
+def _check_export(compression: str, allowed: Tuple[str, ...]) -> None:
+    if compression not in allowed:
+        raise HTTPException(status_code=400, detail=f"compression must be one of {', '.join(allowed)}")
+    try:
+        columnar.schema()
+    except ImportError:
+        raise HTTPException(status_code=501, detail="Columnar export needs pyarrow")
+
+
+@app.get("/export.parquet")
+async def export_parquet(compression: str = "snappy", device_id: Optional[str] = None,
+                         start: Optional[datetime] = None, end: Optional[datetime] = None):
+    """Telemetry as a Parquet file, streamed one row group at a time.
+
+    start/end (sample time, inclusive) and device_id are applied in SQLite,
+    only the partitions overlapping the window are read.
+    """
+    _check_export(compression, columnar.PARQUET_COMPRESSION)
+    return StreamingResponse(
+        _export("parquet", compression, device_id, start, end), media_type="application/vnd.apache.parquet",
+        headers={"Content-Disposition": "attachment; filename=telemetry_data.parquet"})
 
-    # sort by datetime descending
-    df = df.sort_values(by='datetime', ascending=False)
 
-    # round to nearest hour boundary to assign each record to the closest hour
-    df['hour'] = df['datetime'].dt.round('H')
+@app.get("/export.arrow")
+async def export_arrow(compression: str = "none", device_id: Optional[str] = None,
+                       start: Optional[datetime] = None, end: Optional[datetime] = None):
+    """Telemetry as an Arrow IPC stream, filters as for /export.parquet"""
+    _check_export(compression, columnar.ARROW_COMPRESSION)
+    return StreamingResponse(
+        _export("arrow", compression, device_id, start, end), media_type="application/vnd.apache.arrow.stream",
+        headers={"Content-Disposition": "attachment; filename=telemetry_data.arrows"})
 
-    # calculate the distance from each record to its assigned hour boundary
-    df['distance_to_hour'] = abs(df['datetime'] - df['hour'])
 
-    # sort by hour and distance, keeping the closest record to each hour
-    df = df.sort_values(by=['hour', 'distance_to_hour'], ascending=[False, True])
+async def _csv_export(start: Optional[float], end: Optional[float]) -> AsyncIterator[bytes]:
+    yield b"Device ID,Longitude,Latitude,Battery,Date,Time,Inserted At\n"
+    lo, hi = await db.id_range(start, end)
+    pending: deque = deque()
+    try:
+        # newest shard first, up to EXPORT_PARALLEL read at once, sent in order
+        for top in range(hi + 1, lo, -EXPORT_SHARD_ROWS):
+            pending.append(db.csv_shard(max(lo, top - EXPORT_SHARD_ROWS), top, start, end))
+            if len(pending) >= EXPORT_PARALLEL:
+                chunk = await pending.popleft()
+                if chunk:
+                    yield chunk
+        while pending:
+            chunk = await pending.popleft()
+            if chunk:
+                yield chunk
+    finally:
+        for future in pending:
+            future.cancel()
 
-    # drop duplicates to keep only one record per hour (the closest one)
-    df = df.drop_duplicates(subset=['hour'])
 
-    # keep only the last 12 hours
-    df = df.head(12)
+@app.get("/download-csv-raw")
+async def download_csv(start: Optional[datetime] = None, end: Optional[datetime] = None):
+    """Download telemetry records as CSV, newest first.
+
+    start/end optionally limit the sample time, inclusive. The id range is
+    cut into shards that are read and formatted in parallel on the reader
+    pool and streamed in order.
+    """
+    t_start, t_end = _time_window(start, end)
+    return StreamingResponse(
+        _csv_export(t_start, t_end),
+        media_type="text/csv",
+        headers={"Content-Disposition": "attachment; filename=telemetry_data.csv"}
+    )
 
-    df.drop(['id', 'datetime', 'distance_to_hour'], axis=1, inplace=True)
 
-    items = df.to_dict(orient='records')
-    writeBuffer = io.StringIO()
-    df.to_csv(writeBuffer, index=False)
+@app.get("/download-csv-processed")
+async def download_csv_processed(device_id: Optional[str] = None):
+    """Download processed telemetry records as CSV, with one hour intervals for a span of 12 hours"""
+    csv_content = await db.resample_hourly(12, device_id)
 
     # Return CSV file
     return Response(
-        content=writeBuffer.getvalue(),
+        content=csv_content,
         media_type="text/csv",
         headers={"Content-Disposition": "attachment; filename=processed_telemetry_data.csv"}
-    )
\ No newline at end of file
+    )
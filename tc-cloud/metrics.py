@@ -0,0 +1,162 @@
+"""In-process metrics exposed as OpenMetrics text on /metrics.
+
+Kept deliberately small so recording costs one attribute add on the hot path:
+every series is a plain object bound once at import time, and every series is
+written by a single thread (the event loop, or the SQLite writer thread for
+commit metrics), so no locks are taken. Rendering reads the values as they are;
+a scrape may see a histogram mid update, which Prometheus tolerates.
+"""
+import bisect
+import math
+from typing import Callable, Dict, Iterable, List, Tuple
+
+CONTENT_TYPE = "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+
+def _escape(value: str) -> str:
+    return value.replace("\\", "\\\\").replace("\n", "\\n").replace('"', '\\"')
+
+
+def _labels(names: Tuple[str, ...], values: Tuple[str, ...], extra: str = "") -> str:
+    parts = [f'{n}="{_escape(v)}"' for n, v in zip(names, values)]
+    if extra:
+        parts.append(extra)
+    return "{" + ",".join(parts) + "}" if parts else ""
+
+
+def _number(value: float) -> str:
+    if value == math.inf:
+        return "+Inf"
+    if isinstance(value, float) and value.is_integer() and abs(value) < 1e15:
+        return str(int(value))
+    return repr(value)
+
+
+class Registry:
+    def __init__(self) -> None:
+        self._families: List["_Family"] = []
+
+    def register(self, family: "_Family") -> "_Family":
+        self._families.append(family)
+        return family
+
+    def render(self) -> str:
+        lines: List[str] = []
+        for family in self._families:
+            family.render(lines)
+        lines.append("# EOF")
+        return "\n".join(lines) + "\n"
+
+
+REGISTRY = Registry()
+
+
+class _Family:
+    kind = ""
+
+    def __init__(self, name: str, help_: str, labels: Iterable[str] = (), registry: Registry = REGISTRY):
+        self.name = name
+        self.help = help_
+        self.label_names = tuple(labels)
+        self._children: Dict[Tuple[str, ...], object] = {}
+        registry.register(self)
+
+    def labels(self, *values: str):
+        """Child series for the label values, bind it once and keep it"""
+        child = self._children.get(values)
+        if child is None:
+            child = self._children[values] = self._new_child()
+        return child
+
+    def _new_child(self):
+        raise NotImplementedError
+
+    def render(self, lines: List[str]) -> None:
+        lines.append(f"# TYPE {self.name} {self.kind}")
+        lines.append(f"# HELP {self.name} {_escape(self.help)}")
+        for values, child in list(self._children.items()):
+            self._render_child(lines, values, child)
+
+    def _render_child(self, lines: List[str], values: Tuple[str, ...], child) -> None:
+        raise NotImplementedError
+
+
+class _CounterValue:
+    __slots__ = ("value",)
+
+    def __init__(self) -> None:
+        self.value = 0
+
+    def inc(self, n: int = 1) -> None:
+        self.value += n
+
+
+class Counter(_Family):
+    kind = "counter"
+
+    def _new_child(self) -> _CounterValue:
+        return _CounterValue()
+
+    def _render_child(self, lines, values, child) -> None:
+        lines.append(f"{self.name}_total{_labels(self.label_names, values)} {_number(child.value)}")
+
+
+class _HistogramValue:
+    __slots__ = ("bounds", "buckets", "sum")
+
+    def __init__(self, bounds: Tuple[float, ...]) -> None:
+        self.bounds = bounds
+        self.buckets = [0] * (len(bounds) + 1)
+        self.sum = 0.0
+
+    def observe(self, value: float) -> None:
+        self.buckets[bisect.bisect_left(self.bounds, value)] += 1
+        self.sum += value
+
+
+class Histogram(_Family):
+    kind = "histogram"
+
+    def __init__(self, name: str, help_: str, buckets: Iterable[float], labels: Iterable[str] = (),
+                 registry: Registry = REGISTRY):
+        self.bounds = tuple(sorted(buckets))
+        super().__init__(name, help_, labels, registry)
+
+    def _new_child(self) -> _HistogramValue:
+        return _HistogramValue(self.bounds)
+
+    def _render_child(self, lines, values, child) -> None:
+        cumulative = 0
+        for bound, n in zip(self.bounds + (math.inf,), child.buckets):
+            cumulative += n
+            le = f'le="{_number(float(bound))}"'
+            lines.append(f"{self.name}_bucket{_labels(self.label_names, values, le)} {cumulative}")
+        lines.append(f"{self.name}_count{_labels(self.label_names, values)} {cumulative}")
+        lines.append(f"{self.name}_sum{_labels(self.label_names, values)} {_number(child.sum)}")
+
+
+class GaugeFunc(_Family):
+    """Gauge read at scrape time.
+
+    fn returns a number for an unlabelled gauge, or a {label_values: number}
+    mapping when labels are given.
+    """
+    kind = "gauge"
+
+    def __init__(self, name: str, help_: str, fn: Callable[[], object], labels: Iterable[str] = (),
+                 registry: Registry = REGISTRY):
+        self._fn = fn
+        super().__init__(name, help_, labels, registry)
+
+    def render(self, lines: List[str]) -> None:
+        lines.append(f"# TYPE {self.name} gauge")
+        lines.append(f"# HELP {self.name} {_escape(self.help)}")
+        value = self._fn()
+        if not self.label_names:
+            if value is not None:
+                lines.append(f"{self.name} {_number(value)}")
+            return
+        for key, v in list(value.items()):
+            key = key if isinstance(key, tuple) else (key,)
+            lines.append(f"{self.name}{_labels(self.label_names, key)} {_number(v)}")
+
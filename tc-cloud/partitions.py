@@ -0,0 +1,473 @@
+"""Time partitioned telemetry storage.
+
+Rows live in one table per PARTITION_DAYS of sample time, telemetry_pYYYYMMDD,
+each with its own indexes and its own R*Tree (telemetry_geo_pYYYYMMDD) kept by
+triggers. An insert only touches the partition of its sample time, so its cost
+depends on the size of one partition and not on the history, and old data goes
+away with a DROP TABLE instead of a DELETE over one big table.
+
+telemetry_partitions is the catalog, with the sample time range every
+partition holds. The telemetry view is the UNION ALL of all of them, for
+exports and ad hoc SQL. Hot queries build their own UNION ALL over only the
+partitions they need with union_all(), where SQLite merges arms that are
+already in id order instead of sorting them.
+
+Ids stay global: every insert takes the next ones from telemetry_ids inside
+its transaction, so id order is still commit order across partitions and
+across ingest processes. Replays of a sample carry the same sample time, so
+they land in the same partition and its (device_id, seq, t) index still
+rejects them. t is in the key because a device whose NVS was erased numbers
+from 1 again: its new samples reuse old seqs with a later sample time.
+
+A database from before partitioning keeps its table as the read-only
+partition telemetry_legacy until retention retires it. Samples falling in its
+time range go to a new partition, after a lookup in its (device_id, seq)
+index so replays of old samples are still rejected.
+"""
+import bisect
+import calendar
+import time
+from datetime import datetime, timezone
+import sqlite3
+from typing import Dict, Iterable, List, NamedTuple, Optional, Sequence, Tuple
+
+DAY = 86400
+GEO_EPOCH = 1577836800  # 2020-01-01T00:00:00Z
+# sample times are clamped to what telemetry_geo stores as int32 seconds since GEO_EPOCH
+T_MIN = GEO_EPOCH - 2 ** 31
+T_MAX = GEO_EPOCH + 2 ** 31 - 1
+LON_Q = "CAST(round(({row}longitude + 180.0) / 360.0 * 65535) AS INTEGER)"
+LAT_Q = "CAST(round(({row}latitude + 90.0) / 180.0 * 65535) AS INTEGER)"
+
+COLUMNS = "id, device_id, longitude, latitude, battery, date, time, inserted_at, seq, sample_ts, t"
+_MAX_ARMS = 400  # below SQLITE_MAX_COMPOUND_SELECT (500)
+_DATE_CACHE_MAX = 4096
+
+
+class Partition(NamedTuple):
+    name: str
+    geo: str
+    start_t: int  # sample time range, unix seconds, end exclusive
+    end_t: int
+    writable: bool
+
+
+class Connection(sqlite3.Connection):
+    """sqlite3 connection that can hold the cached catalog, see catalog()"""
+
+
+def migrate(conn: sqlite3.Connection) -> None:
+    """Schema migration from the single telemetry table"""
+    conn.execute("CREATE TABLE telemetry_partitions (name TEXT PRIMARY KEY, geo TEXT NOT NULL, "
+                 "start_t INTEGER NOT NULL, end_t INTEGER NOT NULL, writable INTEGER NOT NULL, "
+                 "retired INTEGER NOT NULL DEFAULT 0, rolled_up INTEGER NOT NULL DEFAULT 0)")
+    conn.execute("CREATE TABLE telemetry_ids (last INTEGER NOT NULL)")
+    # hourly rollups of retired partitions: count, average battery and the
+    # last sample of the hour
+    conn.execute("CREATE TABLE telemetry_hourly (device_id TEXT NOT NULL, hour INTEGER NOT NULL, "
+                 "points INTEGER NOT NULL, last_t INTEGER NOT NULL, longitude REAL, latitude REAL, "
+                 "battery INTEGER, battery_avg REAL, PRIMARY KEY (device_id, hour)) WITHOUT ROWID")
+    # AUTOINCREMENT never reused ids, neither do we
+    last = conn.execute("SELECT max(COALESCE((SELECT MAX(id) FROM telemetry), 0), "
+                        "COALESCE((SELECT seq FROM sqlite_sequence WHERE name = 'telemetry'), 0))").fetchone()[0]
+    conn.execute("INSERT INTO telemetry_ids VALUES (?)", (last,))
+
+    if conn.execute("SELECT EXISTS (SELECT 1 FROM telemetry)").fetchone()[0]:
+        conn.execute("ALTER TABLE telemetry RENAME TO telemetry_legacy")
+        conn.execute("ALTER TABLE telemetry_legacy ADD COLUMN t INTEGER")
+        # same time as the telemetry_geo backfill gave these rows
+        conn.execute(f"UPDATE telemetry_legacy SET t = (SELECT min_t FROM telemetry_geo g "
+                     f"WHERE g.id = telemetry_legacy.id) + {GEO_EPOCH}")
+        conn.execute("DROP TRIGGER IF EXISTS telemetry_geo_insert")
+        start_t, end_t = conn.execute("SELECT MIN(t), MAX(t) + 1 FROM telemetry_legacy").fetchone()
+        conn.execute("INSERT INTO telemetry_partitions (name, geo, start_t, end_t, writable) "
+                     "VALUES ('telemetry_legacy', 'telemetry_geo', ?, ?, 0)", (start_t, end_t))
+    else:
+        conn.execute("DROP TABLE telemetry")
+        conn.execute("DROP TABLE telemetry_geo")
+    _rebuild_view(conn)
+
+
+def rekey_seq(conn: sqlite3.Connection) -> None:
+    """Schema migration of the writable partitions' unique index from
+    (device_id, seq) to (device_id, seq, t)"""
+    for (name,) in conn.execute("SELECT name FROM telemetry_partitions WHERE writable AND NOT retired").fetchall():
+        conn.execute(f"DROP INDEX {name}_device_seq")
+        conn.execute(f"CREATE UNIQUE INDEX {name}_device_seq ON {name} (device_id, seq, t)")
+
+
+def _rebuild_view(conn: sqlite3.Connection) -> None:
+    parts = conn.execute("SELECT name, geo, start_t, end_t, writable FROM telemetry_partitions "
+                         "WHERE NOT retired ORDER BY start_t, name").fetchall()
+    conn.execute("DROP VIEW IF EXISTS telemetry")
+    if parts:
+        body = union_all([Partition(*p) for p in parts], f"SELECT {COLUMNS} FROM {{name}}")
+    else:
+        body = "SELECT " + ", ".join(f"NULL AS {c}" for c in COLUMNS.split(", ")) + " WHERE 0"
+    conn.execute(f"CREATE VIEW telemetry AS {body}")
+
+
+# -------------------- catalog --------------------
+class _Catalog(NamedTuple):
+    version: int
+    partitions: Tuple[Partition, ...]
+    starts: List[int]  # start_t of the writable partitions, for bisect
+    writable: List[Partition]
+    readonly: List[Partition]
+
+
+def _catalog(conn: sqlite3.Connection) -> _Catalog:
+    # every catalog change comes with DDL, so schema_version tells when to reload
+    version = conn.execute("PRAGMA schema_version").fetchone()[0]
+    cached = getattr(conn, "tc_catalog", None)
+    if cached is not None and cached.version == version:
+        return cached
+    parts = tuple(Partition(r[0], r[1], r[2], r[3], bool(r[4])) for r in conn.execute(
+        "SELECT name, geo, start_t, end_t, writable FROM telemetry_partitions WHERE NOT retired "
+        "ORDER BY start_t, name"))
+    writable = [p for p in parts if p.writable]
+    cached = _Catalog(version, parts, [p.start_t for p in writable], writable, [p for p in parts if not p.writable])
+    try:
+        conn.tc_catalog = cached
+    except AttributeError:
+        pass  # plain sqlite3.Connection, reloaded every time
+    return cached
+
+
+def forget(conn: sqlite3.Connection) -> None:
+    """Drop the cached catalog, after a rollback that may have undone DDL"""
+    try:
+        conn.tc_catalog = None
+    except AttributeError:
+        pass
+
+
+def catalog(conn: sqlite3.Connection, start: Optional[float] = None,
+            end: Optional[float] = None) -> Tuple[Partition, ...]:
+    """Partitions that may hold samples between start and end (unix seconds, inclusive)"""
+    parts = _catalog(conn).partitions
+    if start is None and end is None:
+        return parts
+    lo = T_MIN if start is None else start
+    hi = T_MAX if end is None else end
+    return tuple(p for p in parts if p.start_t <= hi and p.end_t > lo)
+
+
+def union_all(parts: Sequence[Partition], arm: str, order_by: Optional[str] = None) -> str:
+    """arm, formatted with {name} and {geo}, once per partition joined by UNION ALL.
+
+    With order_by the whole gets ORDER BY order_by LIMIT :limit. Arms already
+    in that order (rowid order) are merged, reading only about :limit rows.
+    """
+    arms = [arm.format(name=p.name, geo=p.geo) for p in parts]
+    tail = f" ORDER BY {order_by} LIMIT :limit" if order_by else ""
+    while len(arms) > _MAX_ARMS:
+        arms = [f"SELECT * FROM ({' UNION ALL '.join(arms[i:i + _MAX_ARMS])}{tail})"
+                for i in range(0, len(arms), _MAX_ARMS)]
+    return " UNION ALL ".join(arms) + tail
+
+
+# -------------------- inserts --------------------
+_DAYS: Dict[str, Optional[int]] = {}
+
+
+def _day(date: str) -> Optional[int]:
+    day = _DAYS.get(date, -1)
+    if day == -1:
+        try:
+            d = datetime.strptime(date, "%Y-%m-%d")
+            day = calendar.timegm(d.timetuple())
+        except ValueError:
+            day = None
+        if len(_DAYS) >= _DATE_CACHE_MAX:
+            _DAYS.clear()
+        _DAYS[date] = day
+    return day
+
+
+def sample_time(record: Sequence) -> int:
+    """Sample time of a TelemetryRecord in unix seconds.
+
+    sample_ts when the device sent one, else date + time, else now, the same
+    rules the telemetry_geo backfill used for rows from before partitioning.
+    """
+    sample_ts, date, time_ = record[7], record[4], record[5]
+    if sample_ts is not None:
+        t = int(sample_ts) // 1000 if sample_ts >= 0 else -(-int(sample_ts) // 1000)
+    else:
+        day = _day(date) if isinstance(date, str) else None
+        t = None
+        if day is not None and isinstance(time_, str):
+            if len(time_) == 8 and time_[2] == ":" and time_[5] == ":" and time_.replace(":", "").isdigit():
+                h, m, s = int(time_[0:2]), int(time_[3:5]), int(time_[6:8])
+                if h < 24 and m < 60 and s < 60:
+                    t = day + h * 3600 + m * 60 + s
+            else:
+                try:
+                    moment = datetime.fromisoformat(f"{date} {time_}")
+                    if moment.tzinfo is None:
+                        moment = moment.replace(tzinfo=timezone.utc)
+                    t = int(moment.timestamp())
+                except ValueError:
+                    pass
+        if t is None:
+            t = int(time.time())
+    return max(T_MIN, min(T_MAX, t))
+
+
+def _create(conn: sqlite3.Connection, t: int, partition_days: int) -> None:
+    span = max(1, partition_days) * DAY
+    start = t - t % span
+    end = start + span
+    # partitions made with another PARTITION_DAYS may cover part of the span
+    cat = _catalog(conn)
+    for p in cat.writable:
+        if p.end_t <= t:
+            start = max(start, p.end_t)
+        elif p.start_t > t:
+            end = min(end, p.start_t)
+    suffix = time.strftime("%Y%m%d", time.gmtime(start)) if start >= 0 else f"m{-start // DAY}"
+    name, geo = f"telemetry_p{suffix}", f"telemetry_geo_p{suffix}"
+    conn.execute(f"""
+        CREATE TABLE {name} (
+            id INTEGER PRIMARY KEY,
+            device_id TEXT NOT NULL,
+            longitude REAL,
+            latitude REAL,
+            battery INTEGER,
+            date TEXT NOT NULL,
+            time TEXT NOT NULL,
+            inserted_at TEXT NOT NULL DEFAULT (datetime('now')),
+            seq INTEGER,
+            sample_ts INTEGER,
+            t INTEGER NOT NULL
+        )
+    """)
+    # a retired partition of the same days keeps its index names until
+    # drop_retired() gets to them
+    index, n = name, 0
+    while conn.execute("SELECT 1 FROM sqlite_master WHERE type = 'index' AND name IN (?, ?)",
+                       (f"{index}_device_seq", f"{index}_device")).fetchone():
+        n += 1
+        index = f"{name}_{n}"
+    # rows without seq never conflict, NULLs are distinct in a unique index
+    conn.execute(f"CREATE UNIQUE INDEX {index}_device_seq ON {name} (device_id, seq, t)")
+    conn.execute(f"CREATE INDEX {index}_device ON {name} (device_id)")
+    conn.execute(f"CREATE VIRTUAL TABLE {geo} USING rtree_i32(id, min_lon, max_lon, min_lat, max_lat, min_t, max_t)")
+    point = (f"{LON_Q.format(row='new.')}, {LON_Q.format(row='new.')}, {LAT_Q.format(row='new.')}, "
+             f"{LAT_Q.format(row='new.')}, new.t - {GEO_EPOCH}, new.t - {GEO_EPOCH}")
+    conn.execute(f"CREATE TRIGGER {geo}_insert AFTER INSERT ON {name} BEGIN "
+                 f"INSERT INTO {geo} VALUES (new.id, {point}); END")
+    conn.execute(f"CREATE TRIGGER {geo}_delete AFTER DELETE ON {name} BEGIN "
+                 f"DELETE FROM {geo} WHERE id = old.id; END")
+    conn.execute("INSERT INTO telemetry_partitions (name, geo, start_t, end_t, writable) VALUES (?, ?, ?, ?, 1)",
+                 (name, geo, start, end))
+    _rebuild_view(conn)
+
+
+def _partition(conn: sqlite3.Connection, t: int, partition_days: int) -> str:
+    cat = _catalog(conn)
+    i = bisect.bisect_right(cat.starts, t) - 1
+    if i >= 0 and t < cat.writable[i].end_t:
+        return cat.writable[i].name
+    _create(conn, t, partition_days)
+    return _partition(conn, t, partition_days)
+
+
+def _insert_sql(name: str) -> str:
+    return (f"INSERT INTO {name} (id, device_id, longitude, latitude, battery, date, time, seq, sample_ts, t) "
+            "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?) ON CONFLICT (device_id, seq, t) DO NOTHING")
+
+
+def _next_ids(conn: sqlite3.Connection, count: int) -> int:
+    """First of count new ids. Takes the write lock, so call before reading the catalog."""
+    rows = conn.execute("UPDATE telemetry_ids SET last = last + ? RETURNING last", (count,)).fetchall()
+    return rows[0][0] - count + 1
+
+
+def _replayed(conn: sqlite3.Connection, record: Sequence, t: int) -> bool:
+    """True if a read-only partition covering t already has the record's (device_id, seq, t)"""
+    if record[6] is None:
+        return False
+    for p in _catalog(conn).readonly:
+        if p.start_t <= t < p.end_t and conn.execute(
+                f"SELECT 1 FROM {p.name} WHERE device_id = ? AND seq = ? AND t = ?",
+                (record[0], record[6], t)).fetchone():
+            return True
+    return False
+
+
+def insert_one(conn: sqlite3.Connection, record: Sequence, partition_days: int) -> int:
+    """Insert one TelemetryRecord, returns its id or 0 if (device_id, seq, t) is already stored"""
+    row_id = _next_ids(conn, 1)
+    t = sample_time(record)
+    if _replayed(conn, record, t):
+        return 0
+    cur = conn.execute(_insert_sql(_partition(conn, t, partition_days)), (row_id, *record, t))
+    return row_id if cur.rowcount > 0 else 0
+
+
+def insert_many(conn: sqlite3.Connection, records: Sequence[Sequence], partition_days: int,
+                inserted: Optional[List[int]] = None) -> int:
+    """Insert TelemetryRecords, ids in list order, returns how many were new.
+
+    With inserted, the positions in records of the new ones are added to it in
+    order. executemany has no per row result, but the ids are known, so only a
+    partition where some rows were ignored is read back by id range.
+    """
+    if not records:
+        return 0
+    row_id = _next_ids(conn, len(records))
+    check = bool(_catalog(conn).readonly)
+    by_partition: Dict[str, List[Tuple]] = {}
+    for i, record in enumerate(records):
+        t = sample_time(record)
+        if check and _replayed(conn, record, t):
+            continue
+        by_partition.setdefault(_partition(conn, t, partition_days), []).append((row_id + i, *record, t))
+    total, new = 0, []
+    for name, rows in by_partition.items():
+        count = conn.executemany(_insert_sql(name), rows).rowcount
+        total += count
+        if inserted is None or count == 0:
+            continue
+        if count == len(rows):
+            new += [row[0] - row_id for row in rows]
+        else:
+            ids = {r[0] for r in conn.execute(f"SELECT id FROM {name} WHERE id BETWEEN ? AND ?",
+                                              (rows[0][0], rows[-1][0]))}
+            new += [row[0] - row_id for row in rows if row[0] in ids]
+    if inserted is not None:
+        inserted += sorted(new)
+    return total
+
+
+# -------------------- retention --------------------
+_ROLLUP_SQL = """
+    SELECT device_id, t / 3600 * 3600 AS hour, COUNT(*), MAX(t), longitude, latitude, battery, AVG(battery)
+    FROM {name} WHERE id > ? AND id <= ? GROUP BY device_id, hour
+"""
+# bare longitude/latitude/battery come from the row with MAX(t)
+_UPSERT_ROLLUP_SQL = """
+    INSERT INTO telemetry_hourly (device_id, hour, points, last_t, longitude, latitude, battery, battery_avg)
+    VALUES (?, ?, ?, ?, ?, ?, ?, ?)
+    ON CONFLICT (device_id, hour) DO UPDATE SET
+        battery_avg = (COALESCE(battery_avg, 0) * points + COALESCE(excluded.battery_avg, 0) * excluded.points)
+                      / (points + excluded.points),
+        points = points + excluded.points,
+        longitude = CASE WHEN excluded.last_t >= last_t THEN excluded.longitude ELSE longitude END,
+        latitude = CASE WHEN excluded.last_t >= last_t THEN excluded.latitude ELSE latitude END,
+        battery = CASE WHEN excluded.last_t >= last_t THEN excluded.battery ELSE battery END,
+        last_t = max(last_t, excluded.last_t)
+"""
+
+
+def expired(conn: sqlite3.Connection, before_t: float) -> List[Partition]:
+    """Partitions whose whole time range is older than before_t"""
+    return [p for p in catalog(conn) if p.end_t <= before_t]
+
+
+def rollup(conn: sqlite3.Connection, part: Partition, rows: int) -> Tuple[int, int, List[Tuple]]:
+    """(after, up_to, hourly rollup rows of the next ids after..up_to) of a partition.
+
+    Runs on a reader. after is where the previous merge_rollup() stopped and
+    up_to is at most rows ids further; after == up_to when all are rolled up.
+    """
+    after = conn.execute("SELECT rolled_up FROM telemetry_partitions WHERE name = ?", (part.name,)).fetchone()[0]
+    up_to = conn.execute(f"SELECT COALESCE((SELECT id FROM {part.name} WHERE id > ? ORDER BY id LIMIT 1 OFFSET ?), "
+                         f"(SELECT MAX(id) FROM {part.name}), 0)", (after, max(0, rows - 1))).fetchone()[0]
+    if up_to <= after:
+        return after, after, []
+    cur = conn.cursor()
+    cur.row_factory = None
+    return after, up_to, cur.execute(_ROLLUP_SQL.format(name=part.name), (after, up_to)).fetchall()
+
+
+def merge_rollup(conn: sqlite3.Connection, part: Partition, after: int, up_to: int, rows: List[Tuple]) -> bool:
+    """Add a rollup() result to telemetry_hourly, in the writer. False if the
+    partition moved on since it was read, the rows are then left out."""
+    cur = conn.execute("UPDATE telemetry_partitions SET rolled_up = ? WHERE name = ? AND rolled_up = ?",
+                       (up_to, part.name, after))
+    if cur.rowcount == 0:
+        return False
+    conn.executemany(_UPSERT_ROLLUP_SQL, rows)
+    return True
+
+
+def retire(conn: sqlite3.Connection, part: Partition) -> None:
+    """Take a rolled up partition out of the catalog, in the writer.
+
+    Rows that arrived after the last merge_rollup() are rolled up here. The
+    tables are renamed away and the triggers dropped, so a late sample for the
+    same days starts a new partition; drop_retired() deletes the rest later.
+    """
+    after = conn.execute("SELECT rolled_up FROM telemetry_partitions WHERE name = ?", (part.name,)).fetchone()[0]
+    tail = conn.execute(_ROLLUP_SQL.format(name=part.name), (after, (1 << 63) - 1)).fetchall()
+    conn.executemany(_UPSERT_ROLLUP_SQL, [tuple(r) for r in tail])
+    suffix, n = f"_r{after}", 0
+    # an earlier retired partition of the same days may still be waiting for drop_retired()
+    while conn.execute("SELECT 1 FROM sqlite_master WHERE name IN (?, ?)",
+                       (part.name + suffix, part.geo + suffix)).fetchone():
+        n += 1
+        suffix = f"_r{after}_{n}"
+    # nothing is inserted into a retired partition, and trigger names do not follow a rename
+    conn.execute(f"DROP TRIGGER IF EXISTS {part.geo}_insert")
+    conn.execute(f"DROP TRIGGER IF EXISTS {part.geo}_delete")
+    conn.execute(f"ALTER TABLE {part.name} RENAME TO {part.name}{suffix}")
+    conn.execute(f"ALTER TABLE {part.geo} RENAME TO {part.geo}{suffix}")
+    conn.execute("UPDATE telemetry_partitions SET name = ?, geo = ?, retired = 1 WHERE name = ?",
+                 (part.name + suffix, part.geo + suffix, part.name))
+    _rebuild_view(conn)
+
+
+def drop_retired(conn: sqlite3.Connection) -> Optional[str]:
+    """Drop one index or table of a retired partition, returns its name or None
+    if none was left. Dropping frees every page of it under the write lock, one
+    object at a time keeps that short."""
+    row = conn.execute("SELECT name, geo FROM telemetry_partitions WHERE retired LIMIT 1").fetchone()
+    if row is None:
+        return None
+    name, geo = row[0], row[1]
+    index = conn.execute("SELECT name FROM sqlite_master WHERE type = 'index' AND tbl_name = ? AND sql IS NOT NULL "
+                         "LIMIT 1", (name,)).fetchone()
+    if index is not None:
+        conn.execute(f"DROP INDEX {index[0]}")
+        return index[0]
+    for table in (name, geo):
+        if conn.execute("SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = ?", (table,)).fetchone():
+            conn.execute(f"DROP TABLE {table}")
+            return table
+    conn.execute("DELETE FROM telemetry_partitions WHERE name = ?", (name,))
+    return name
+
+
+def vacuum_step(conn: sqlite3.Connection, pages: int) -> int:
+    """Return up to pages free pages to the file system, how many are still free.
+
+    Only databases created with auto_vacuum = INCREMENTAL shrink; older files
+    reuse the free pages for new partitions instead.
+    """
+    if conn.execute("PRAGMA auto_vacuum").fetchone()[0] != 2:
+        return 0
+    free = conn.execute("PRAGMA freelist_count").fetchone()[0]
+    # every step of the pragma frees one page, and the sqlite3 module steps a
+    # statement without result columns only once
+    for _ in range(min(free, pages)):
+        conn.execute("PRAGMA incremental_vacuum")
+    return conn.execute("PRAGMA freelist_count").fetchone()[0]
+
+
+def seed(conn: sqlite3.Connection, records: Iterable[Sequence], partition_days: int = 1,
+         chunk: int = 100000) -> int:
+    """Insert records in chunks of one transaction each, for tools and benchmarks"""
+    total, batch = 0, []
+    for record in records:
+        batch.append(record)
+        if len(batch) >= chunk:
+            with conn:
+                total += insert_many(conn, batch, partition_days)
+            batch = []
+    if batch:
+        with conn:
+            total += insert_many(conn, batch, partition_days)
+    return total
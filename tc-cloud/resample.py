@@ -0,0 +1,103 @@
+"""Single pass hourly resampling for /download-csv-processed.
+
+Every record belongs to the hour its date + time rounds to (half to even, the
+way pandas rounds), and each hour is represented by the record closest to
+it; on equal distance the later record wins, then the one seen first. Only
+the newest `hours` hours are kept.
+
+Rows can come in any order. The resampler holds one candidate per hour for
+at most `hours` hours, so memory does not depend on the table size.
+"""
+import csv
+import heapq
+import io
+from datetime import datetime, timedelta, timezone
+from typing import Dict, List, Optional, Sequence, Tuple
+
+COLUMNS = ("device_id", "longitude", "latitude", "battery", "date", "time", "inserted_at", "hour")
+_HOUR_US = 3600 * 1000000
+_EPOCH = datetime(1970, 1, 1)
+
+
+_DAYS: Dict[str, Optional[int]] = {}
+
+
+def _day_us(date: str) -> Optional[int]:
+    day = _DAYS.get(date, -1)
+    if day == -1:
+        try:
+            day = (datetime.strptime(date, "%Y-%m-%d") - _EPOCH).days * 86400 * 1000000
+        except ValueError:
+            day = None
+        if len(_DAYS) > 4096:
+            _DAYS.clear()
+        _DAYS[date] = day
+    return day
+
+
+def _timestamp_us(date: str, time_: str) -> Optional[int]:
+    """Microseconds since the epoch of a naive date + time, None if unparseable"""
+    # fast path for the firmware's YYYY-MM-DD HH:MM:SS, days are cached
+    if len(date) == 10 and len(time_) == 8 and time_[2] == ":" and time_[5] == ":":
+        day = _day_us(date)
+        if day is not None and time_[:2].isdigit() and time_[3:5].isdigit() and time_[6:].isdigit():
+            h, m, s = int(time_[:2]), int(time_[3:5]), int(time_[6:])
+            if h < 24 and m < 60 and s < 60:
+                return day + (h * 3600 + m * 60 + s) * 1000000
+    try:
+        moment = datetime.fromisoformat(f"{date} {time_}")
+    except ValueError:
+        return None
+    if moment.tzinfo is not None:
+        moment = moment.astimezone(timezone.utc).replace(tzinfo=None)
+    delta = moment - _EPOCH
+    return (delta.days * 86400 + delta.seconds) * 1000000 + delta.microseconds
+
+
+class HourlyResampler:
+    """Closest record per hour, see the module docstring"""
+
+    def __init__(self, hours: int = 12) -> None:
+        self.hours = hours
+        # hour -> (distance, -timestamp, row)
+        self._best: Dict[int, Tuple[int, int, Sequence]] = {}
+        self._heap: List[int] = []  # hours in _best, oldest on top
+
+    def add(self, row: Sequence) -> None:
+        """row: (device_id, longitude, latitude, battery, date, time, inserted_at)"""
+        if not isinstance(row[4], str) or not isinstance(row[5], str):
+            return
+        ts = _timestamp_us(row[4], row[5])
+        if ts is None:
+            return
+        hour, rest = divmod(ts, _HOUR_US)
+        if rest * 2 > _HOUR_US or (rest * 2 == _HOUR_US and hour % 2):
+            hour += 1
+        best = self._best.get(hour)
+        if best is None:
+            if len(self._heap) >= self.hours:
+                if hour < self._heap[0]:
+                    return
+                del self._best[heapq.heapreplace(self._heap, hour)]
+            else:
+                heapq.heappush(self._heap, hour)
+        else:
+            distance = abs(ts - hour * _HOUR_US)
+            if (distance, -ts) >= best[:2]:
+                return
+        self._best[hour] = (abs(ts - hour * _HOUR_US), -ts, row)
+
+    def rows(self) -> List[Tuple]:
+        """Kept records newest hour first, with the hour appended as YYYY-MM-DD HH:MM:SS"""
+        out = []
+        for hour in sorted(self._best, reverse=True):
+            moment = _EPOCH + timedelta(hours=hour)
+            out.append((*self._best[hour][2], moment.strftime("%Y-%m-%d %H:%M:%S")))
+        return out
+
+    def to_csv(self) -> str:
+        buffer = io.StringIO()
+        writer = csv.writer(buffer, lineterminator="\n")
+        writer.writerow(COLUMNS)
+        writer.writerows(self.rows())
+        return buffer.getvalue()
@@ -0,0 +1,101 @@
+"""Shape preserving track simplification (Douglas-Peucker) with numpy.
+
+Tracks are read from the telemetry partitions as the payload's uint16 grid
+steps. simplify_track projects them to meters around the track's mean
+latitude (equirectangular, fine for tracks up to a few hundred km across) and
+keeps the points needed so that no dropped point is further than the
+tolerance from the simplified line.
+
+The recursion is run breadth first: every pass measures all still undecided
+points against the segment they fall in with a handful of array operations,
+then splits every segment whose farthest point is out of tolerance. The number
+of passes is the recursion depth, about log2 of the points kept, so the Python
+overhead does not grow with the track length.
+"""
+import math
+from typing import Tuple
+
+import numpy as np
+
+GRID_STEPS = 65535
+_EARTH_RADIUS_M = 6371008.8
+_LAT_STEP_M = math.radians(180.0 / GRID_STEPS) * _EARTH_RADIUS_M
+_LON_STEP_M = math.radians(360.0 / GRID_STEPS) * _EARTH_RADIUS_M  # at the equator
+
+
+def douglas_peucker(x: np.ndarray, y: np.ndarray, tolerance: float) -> np.ndarray:
+    """Mask of the points to keep, the first and last always are"""
+    n = len(x)
+    keep = np.zeros(n, dtype=bool)
+    if n == 0:
+        return keep
+    keep[0] = keep[-1] = True
+    tolerance2 = tolerance * tolerance
+    active = np.arange(1, n - 1)
+    while active.size:
+        # active is sorted, so the points of each segment are one contiguous run
+        kept = np.flatnonzero(keep)
+        seg = np.searchsorted(kept, active) - 1
+        starts = np.flatnonzero(np.concatenate(([True], seg[1:] != seg[:-1])))
+        counts = np.diff(np.append(starts, active.size))
+        a, b = kept[seg[starts]], kept[seg[starts] + 1]
+        ax, ay = x[a], y[a]
+        dx, dy = x[b] - ax, y[b] - ay
+        length2 = dx * dx + dy * dy
+        inv_length2 = 1.0 / np.where(length2 > 0.0, length2, 1.0)
+
+        # squared distance to the segment, not the line, so backtracking is kept
+        px = x[active] - np.repeat(ax, counts)
+        py = y[active] - np.repeat(ay, counts)
+        dx, dy = np.repeat(dx, counts), np.repeat(dy, counts)
+        t = (px * dx + py * dy) * np.repeat(inv_length2, counts)
+        np.clip(t, 0.0, 1.0, out=t)
+        px -= t * dx
+        py -= t * dy
+        dist2 = px * px + py * py
+
+        run_max = np.maximum.reduceat(dist2, starts)
+        split = run_max > tolerance2
+        if not split.any():
+            break
+        # the first farthest point of every run that is split
+        in_split = np.repeat(split, counts)
+        at_max = np.flatnonzero((dist2 == np.repeat(run_max, counts)) & in_split)
+        run = np.repeat(np.arange(starts.size), counts)[at_max]
+        keep[active[at_max[np.concatenate(([True], run[1:] != run[:-1]))]]] = True
+        active = active[in_split & ~keep[active]]
+    return keep
+
+
+def simplify_track(points: np.ndarray, tolerance_m: float) -> np.ndarray:
+    """Rows of points (lon_q, lat_q, t), time ordered, that make up the simplified track"""
+    if len(points) < 3:
+        return points
+    # repeated grid cells (a parked device) add nothing to the shape
+    lon, lat = points[:, 0], points[:, 1]
+    moved = np.empty(len(points), dtype=bool)
+    moved[0] = moved[-1] = True
+    moved[1:-1] = (lon[1:-1] != lon[:-2]) | (lat[1:-1] != lat[:-2])
+    points = points[moved]
+    if len(points) < 3:
+        return points
+
+    lat = points[:, 1].astype(np.float64)
+    # unwrap longitude across the antimeridian, one step never spans half the globe
+    lon = points[:, 0].astype(np.float64)
+    d_lon = np.diff(lon)
+    d_lon -= GRID_STEPS * np.round(d_lon / GRID_STEPS)
+    lon[1:] = lon[0] + np.cumsum(d_lon)
+    mean_lat = math.radians(float(lat.mean()) * 180.0 / GRID_STEPS - 90.0)
+    x = lon * (_LON_STEP_M * math.cos(mean_lat))
+    y = lat * _LAT_STEP_M
+    return points[douglas_peucker(x, y, tolerance_m)]
+
+
+def track_array(rows) -> Tuple[np.ndarray, int]:
+    """(lon_q, lat_q, t) rows as a time ordered int64 array, and its length"""
+    points = np.array(rows, dtype=np.int64).reshape(-1, 3)
+    if len(points) > 1:
+        # stable, rows arrive in id order so equal times keep it
+        points = points[np.argsort(points[:, 2], kind="stable")]
+    return points, len(points)
@@ -0,0 +1,375 @@
+/*
+ * Host benchmark of the telemetry encode path.
+ *
+ * Runs every encoder and per sample logging variant over the same generated
+ * samples and prints one JSON document with ns per sample, heap allocations per
+ * sample, peak stack use and log output, so results can be compared commit over
+ * commit.
+ *************************************************************/
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <cJSON.h>
+#include <esp_log.h>
+
+#include "tc_codec.h"
+#include "tc_log.h"
+
+#ifndef TC_BENCH_REVISION
+#define TC_BENCH_REVISION "unknown"
+#endif
+
+#define BENCH_SAMPLES     1024
+#define BENCH_ITERATIONS  200000
+#define BENCH_WARMUP      10000
+#define BENCH_OUT_SIZE    256
+#define STACK_PROBE_SIZE  16384
+#define STACK_PATTERN     0xA5
+#define UART_BAUD         115200
+#define UART_BITS_PER_BYTE 10
+
+static const char* DEVICE_STR = "ESP32_12ABCD";
+static const char* TAG = "tc-bench";
+
+typedef int (*bench_fn_t)(const data_t* data, char* out, size_t out_len);
+
+typedef struct
+{
+    const char* name;
+    bench_fn_t fn;
+} bench_variant_t;
+
+/*********************************************
+ * Allocation counting through the cJSON hooks
+ *********************************************/
+
+static size_t s_alloc_count;
+static size_t s_alloc_bytes;
+
+static void* _counting_malloc(size_t size)
+{
+    s_alloc_count++;
+    s_alloc_bytes += size;
+    return malloc(size);
+}
+
+static void _counting_free(void* ptr)
+{
+    free(ptr);
+}
+
+/*********************************************
+ * Log sink: format like the UART driver would, count the bytes
+ *********************************************/
+
+static size_t s_log_bytes;
+
+static int _counting_vprintf(const char* format, va_list args)
+{
+    static char line[512];
+    const int len = vsnprintf(line, sizeof(line), format, args);
+    if (len > 0)
+    {
+        s_log_bytes += (size_t)len;
+    }
+    return len;
+}
+
+/*********************************************
+ * Encoder variants
+ *********************************************/
+
+static int _bench_noop(const data_t* data, char* out, size_t out_len)
+{
+    (void)data;
+    (void)out_len;
+    out[0] = '\0';
+    return 0;
+}
+
+static int _bench_encode_payload(const data_t* data, char* out, size_t out_len)
+{
+    (void)out_len;
+    const payload_t payload = tc_encode_payload(data);
+    memcpy(out, payload.raw, sizeof(payload.raw));
+    return sizeof(payload.raw);
+}
+
+static int _bench_hex_snprintf(const data_t* data, char* out, size_t out_len)
+{
+    const payload_t payload = tc_encode_payload(data);
+    return snprintf(out, out_len, "%02X%02X%02X%02X%02X",
+                    payload.raw[0], payload.raw[1], payload.raw[2],
+                    payload.raw[3], payload.raw[4]);
+}
+
+static int _bench_hex_table(const data_t* data, char* out, size_t out_len)
+{
+    (void)out_len;
+    const payload_t payload = tc_encode_payload(data);
+    tc_hex_encode(payload.raw, sizeof(payload.raw), out);
+    return (int)(sizeof(payload.raw) * 2);
+}
+
+static int _bench_b64(const data_t* data, char* out, size_t out_len)
+{
+    (void)out_len;
+    const payload_t payload = tc_encode_payload(data);
+    return (int)tc_payload_to_text(&payload, TC_PAYLOAD_ENC_B64, out);
+}
+
+static int _bench_b85(const data_t* data, char* out, size_t out_len)
+{
+    (void)out_len;
+    const payload_t payload = tc_encode_payload(data);
+    return (int)tc_payload_to_text(&payload, TC_PAYLOAD_ENC_B85, out);
+}
+
+static int _bench_json_cjson(const data_t* data, char* out, size_t out_len)
+{
+    cJSON* root = tc_create_json_payload(DEVICE_STR, data, TC_PAYLOAD_ENC_HEX);
+    char* json_str = cJSON_PrintUnformatted(root);
+    const int len = (int)strlen(json_str);
+    strncpy(out, json_str, out_len - 1);
+    cJSON_free(json_str);
+    cJSON_Delete(root);
+    return len;
+}
+
+static int _bench_json_cjson_prealloc(const data_t* data, char* out, size_t out_len)
+{
+    cJSON* root = tc_create_json_payload(DEVICE_STR, data, TC_PAYLOAD_ENC_HEX);
+    const cJSON_bool ok = cJSON_PrintPreallocated(root, out, (int)out_len, false);
+    cJSON_Delete(root);
+    return ok ? (int)strlen(out) : -1;
+}
+
+static int _bench_json_direct(const data_t* data, char* out, size_t out_len)
+{
+    return tc_format_json_payload(DEVICE_STR, data, TC_PAYLOAD_ENC_HEX, out, out_len);
+}
+
+static int _bench_json_direct_b85(const data_t* data, char* out, size_t out_len)
+{
+    return tc_format_json_payload(DEVICE_STR, data, TC_PAYLOAD_ENC_B85, out, out_len);
+}
+
+static int _bench_cbor_direct(const data_t* data, char* out, size_t out_len)
+{
+    return tc_format_binary_payload(DEVICE_STR, data, TC_ENVELOPE_CBOR, (uint8_t*)out, out_len);
+}
+
+static int _bench_msgpack_direct(const data_t* data, char* out, size_t out_len)
+{
+    return tc_format_binary_payload(DEVICE_STR, data, TC_ENVELOPE_MSGPACK, (uint8_t*)out, out_len);
+}
+
+/*
+ * Per sample logging as loop() did it before the hot path facade: five lines
+ * with localtime_r, then the publish line with the full JSON body.
+ */
+static int _bench_log_legacy(const data_t* data, char* out, size_t out_len)
+{
+    const int len = tc_format_json_payload(DEVICE_STR, data, TC_PAYLOAD_ENC_HEX, out, out_len);
+    ESP_LOGI(TAG, "Latitude: %.2f", data->latitude);
+    ESP_LOGI(TAG, "Longitude: %.2f", data->longitude);
+    ESP_LOGI(TAG, "Battery Percentage: %d%%", data->battery_percentage);
+    struct tm tm_s;
+    localtime_r(&data->timestamp, &tm_s);
+    ESP_LOGI(TAG, "Timestamp: %04d-%02d-%02d %02d:%02d:%02d",
+             tm_s.tm_year + 1900, tm_s.tm_mon + 1, tm_s.tm_mday,
+             tm_s.tm_hour, tm_s.tm_min, tm_s.tm_sec);
+    ESP_LOGI(TAG, "Sending MQTT message to topic: %s %s", "tc-bn/telemetry/ESP32_12ABCD", out);
+    return len;
+}
+
+static const char* _format_timestamp(const time_t timestamp, char* out, size_t out_len)
+{
+    struct tm tm_s;
+    localtime_r(&timestamp, &tm_s);
+    strftime(out, out_len, "%Y-%m-%d %H:%M:%S", &tm_s);
+    return out;
+}
+
+// the same lines through TC_LOGI_HOT, rate limited per call site
+static int _bench_log_hot(const data_t* data, char* out, size_t out_len)
+{
+    const int len = tc_format_json_payload(DEVICE_STR, data, TC_PAYLOAD_ENC_HEX, out, out_len);
+    char timestamp[20];
+    TC_LOGI_HOT(TAG, "Latitude: %.2f Longitude: %.2f Battery: %d%% Timestamp: %s",
+                data->latitude, data->longitude, data->battery_percentage,
+                _format_timestamp(data->timestamp, timestamp, sizeof(timestamp)));
+    TC_LOGI_HOT(TAG, "Sending MQTT message to topic: %s %.*s",
+                "tc-bn/telemetry/ESP32_12ABCD", len, out);
+    return len;
+}
+
+// above any selectable CONFIG_TC_LOG_HOT_LEVEL, so this is the stripped build
+static int _bench_log_stripped(const data_t* data, char* out, size_t out_len)
+{
+    const int len = tc_format_json_payload(DEVICE_STR, data, TC_PAYLOAD_ENC_HEX, out, out_len);
+    char timestamp[20];
+    TC_LOG_HOT(ESP_LOG_VERBOSE, TAG, "Latitude: %.2f Longitude: %.2f Battery: %d%% Timestamp: %s",
+               data->latitude, data->longitude, data->battery_percentage,
+               _format_timestamp(data->timestamp, timestamp, sizeof(timestamp)));
+    TC_LOG_HOT(ESP_LOG_VERBOSE, TAG, "Sending MQTT message to topic: %s %.*s",
+               "tc-bn/telemetry/ESP32_12ABCD", len, out);
+    return len;
+}
+
+static const bench_variant_t VARIANTS[] = {
+    {"noop", _bench_noop},
+    {"encode_payload", _bench_encode_payload},
+    {"hex_snprintf", _bench_hex_snprintf},
+    {"hex_table", _bench_hex_table},
+    {"b64", _bench_b64},
+    {"b85", _bench_b85},
+    {"json_cjson", _bench_json_cjson},
+    {"json_cjson_prealloc", _bench_json_cjson_prealloc},
+    {"json_direct", _bench_json_direct},
+    {"json_direct_b85", _bench_json_direct_b85},
+    {"cbor_direct", _bench_cbor_direct},
+    {"msgpack_direct", _bench_msgpack_direct},
+    {"log_legacy", _bench_log_legacy},
+    {"log_hot", _bench_log_hot},
+    {"log_stripped", _bench_log_stripped},
+};
+
+/*********************************************
+ * Measurement helpers
+ *********************************************/
+
+static uint64_t _now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static volatile uintptr_t s_probe_base;
+
+/*
+ * Stack high-water mark by painting: fill a region below the caller's frame,
+ * run the variant from the same caller so it reuses that region, then find the
+ * lowest byte it overwrote. The callee frames of _stack_used itself sit at the
+ * top of the region and do not affect the lowest touched address.
+ */
+__attribute__((noinline)) static void _stack_paint(void)
+{
+    uint8_t probe[STACK_PROBE_SIZE];
+    volatile uint8_t* p = probe;
+    for (size_t i = 0; i < sizeof(probe); i++)
+    {
+        p[i] = STACK_PATTERN;
+    }
+    s_probe_base = (uintptr_t)probe;
+}
+
+__attribute__((noinline)) static size_t _stack_used(void)
+{
+    const volatile uint8_t* probe = (const volatile uint8_t*)s_probe_base;
+    size_t untouched = 0;
+    while (untouched < STACK_PROBE_SIZE && probe[untouched] == STACK_PATTERN)
+    {
+        untouched++;
+    }
+    return STACK_PROBE_SIZE - untouched;
+}
+
+__attribute__((noinline)) static size_t _measure_stack(bench_fn_t fn, const data_t* data)
+{
+    static char out[BENCH_OUT_SIZE];
+    _stack_paint();
+    fn(data, out, sizeof(out));
+    return _stack_used();
+}
+
+static void _generate_samples(data_t* samples, size_t count)
+{
+    uint32_t state = 0x12345678;
+    for (size_t i = 0; i < count; i++)
+    {
+        // xorshift32, deterministic so every run encodes the same corpus
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        samples[i].latitude = 13.40f + (float)(state % 5000) / 10000.0f;
+        samples[i].longitude = 100.20f + (float)((state >> 12) % 8000) / 10000.0f;
+        samples[i].battery_percentage = (short)(10 + state % 91);
+        samples[i].timestamp = (time_t)(1762516800 + i * 15);
+        // trace context as sent with CONFIG_TC_TELEMETRY_TRACE
+        samples[i].seq = (uint32_t)(i + 1);
+        samples[i].timestamp_ms = (int64_t)samples[i].timestamp * 1000 + (int64_t)(state % 1000);
+    }
+}
+
+void app_main(void)
+{
+    static data_t samples[BENCH_SAMPLES];
+    static char out[BENCH_OUT_SIZE];
+    const size_t variant_count = sizeof(VARIANTS) / sizeof(VARIANTS[0]);
+
+    cJSON_Hooks hooks = {
+        .malloc_fn = _counting_malloc,
+        .free_fn = _counting_free,
+    };
+    cJSON_InitHooks(&hooks);
+    esp_log_set_vprintf(_counting_vprintf);
+    setenv("TZ", "UTC", 1);
+    tzset();
+
+    _generate_samples(samples, BENCH_SAMPLES);
+    const size_t stack_baseline = _measure_stack(_bench_noop, &samples[0]);
+
+    printf("{\"revision\":\"%s\",\"iterations\":%d,\"results\":[", TC_BENCH_REVISION,
+           BENCH_ITERATIONS);
+    for (size_t v = 0; v < variant_count; v++)
+    {
+        const bench_variant_t* variant = &VARIANTS[v];
+
+        for (int i = 0; i < BENCH_WARMUP; i++)
+        {
+            variant->fn(&samples[i % BENCH_SAMPLES], out, sizeof(out));
+        }
+
+        s_alloc_count = 0;
+        s_alloc_bytes = 0;
+        s_log_bytes = 0;
+        int output_len = 0;
+        const uint64_t start = _now_ns();
+        for (int i = 0; i < BENCH_ITERATIONS; i++)
+        {
+            output_len = variant->fn(&samples[i % BENCH_SAMPLES], out, sizeof(out));
+        }
+        const uint64_t elapsed = _now_ns() - start;
+
+        const size_t log_bytes = s_log_bytes;
+
+        const size_t stack = _measure_stack(variant->fn, &samples[0]);
+
+        // time the sampling task would block on a 115200 baud console
+        const double uart_us = (double)log_bytes * UART_BITS_PER_BYTE * 1e6 / UART_BAUD;
+        printf("%s{\"variant\":\"%s\",\"ns_per_sample\":%.1f,"
+               "\"allocs_per_sample\":%.2f,\"alloc_bytes_per_sample\":%.1f,"
+               "\"peak_stack_bytes\":%u,\"output_bytes\":%d,"
+               "\"log_bytes_per_sample\":%.2f,\"uart_us_per_sample\":%.2f}",
+               v == 0 ? "" : ",",
+               variant->name,
+               (double)elapsed / BENCH_ITERATIONS,
+               (double)s_alloc_count / BENCH_ITERATIONS,
+               (double)s_alloc_bytes / BENCH_ITERATIONS,
+               (unsigned)(stack > stack_baseline ? stack - stack_baseline : 0),
+               output_len,
+               (double)log_bytes / BENCH_ITERATIONS,
+               uart_us / BENCH_ITERATIONS);
+    }
+    printf("]}\n");
+    fflush(stdout);
+
+    exit(0);
+}
@@ -0,0 +1,120 @@
+/*
+ * Telemetry encoding, free of hardware and network dependencies.
+ *************************************************************/
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <cJSON.h>
+
+#define TC_PAYLOAD_SIZE     5
+#define TC_PAYLOAD_HEX_SIZE (TC_PAYLOAD_SIZE * 2 + 1)
+// hex is the longest text form, 10 characters against 8 (b64) and 7 (b85)
+#define TC_PAYLOAD_TEXT_SIZE TC_PAYLOAD_HEX_SIZE
+
+/*
+ * Text form of the payload in the JSON envelope. The cloud tells them apart by
+ * length, so the envelope does not carry the encoding.
+ */
+typedef enum
+{
+    TC_PAYLOAD_ENC_HEX = 0, // 10 characters, understood by every tc-cloud
+    TC_PAYLOAD_ENC_B64,     // 8 characters, RFC 4648 with padding
+    TC_PAYLOAD_ENC_B85,     // 7 characters, RFC 1924 alphabet (Python base64.b85encode)
+} tc_payload_enc_t;
+
+typedef struct data_s
+{
+    float latitude;
+    float longitude;
+    short battery_percentage;
+    time_t timestamp;
+    // optional fields, only sent when not 0
+    uint32_t seq;         // per device sequence number, survives reboots
+    int64_t timestamp_ms; // trace context: unix time of the sample in milliseconds
+} data_t;
+
+
+/* Considering WGS84 coordinate system used in GPS the latitude ranges from -90 to +90
+ * and longitude ranges from -180 to +180.
+ *
+ * We will encode latitude in 16 bits by scaling the continuous range [-90, +90] into [0, 65535]
+ *   lat_u16 = round( (latitude + 90) / 180 * 65535 )
+ *
+ * We will encode longitude in 16 bits by scaling the continuous range [-180, +180] into [0, 65535]
+ *   lon_u16 = round( (longitude + 180) / 360 * 65535 )
+ *
+ * Battery percentage will be stored in 8 bits (0-100).
+ *
+ * Total payload size = 16 + 16 + 8 = 40 bits = 5 bytes.
+ */
+#pragma pack(push, 1)
+typedef union
+{
+    struct
+    {
+        uint16_t lat_be; // big-endian
+        uint16_t lon_be; // big-endian
+        uint8_t battery_percent; // 0..100
+    } f;
+
+    uint8_t raw[TC_PAYLOAD_SIZE]; // raw bytes to hex-encode
+} payload_t;
+#pragma pack(pop)
+
+payload_t tc_encode_payload(const data_t* data);
+
+/*
+ * Hex encode len bytes as uppercase into out, which must hold 2 * len + 1 bytes.
+ */
+void tc_hex_encode(const uint8_t* in, size_t len, char* out);
+
+/*
+ * Write the payload as text in the given encoding into out, which must hold
+ * TC_PAYLOAD_TEXT_SIZE bytes. Returns the length written (excluding the
+ * terminator).
+ */
+size_t tc_payload_to_text(const payload_t* payload, tc_payload_enc_t enc, char* out);
+
+/*
+ * Binary telemetry envelopes, a map of the JSON fields with the payload as its
+ * 5 raw bytes and the sample time as one integer:
+ *   {"id": text, "payload": bytes(5), "t": uint32 unix seconds,
+ *    "seq": uint32, "ts": uint64 unix milliseconds}
+ * "seq" and "ts" are only written when set. Every integer is written in its
+ * full width, so the cloud can match the layout without a general decoder
+ * (tc-cloud/envelope.py).
+ */
+typedef enum
+{
+    TC_ENVELOPE_CBOR = 0, // RFC 8949, application/cbor
+    TC_ENVELOPE_MSGPACK,  // application/msgpack
+} tc_envelope_t;
+
+// longest id the envelope takes, its length goes into the text header
+#define TC_ENVELOPE_ID_MAX  23
+#define TC_ENVELOPE_MAX_SIZE (48 + TC_ENVELOPE_ID_MAX)
+
+/*
+ * Write the binary envelope of data into out, without heap allocations.
+ * Returns the length written, or -1 if out is too small or device_str too long.
+ */
+int tc_format_binary_payload(const char* device_str, const data_t* data,
+                             tc_envelope_t format, uint8_t* out, size_t out_len);
+
+/*
+ * Create JSON payload with device string, encoded payload, date and time, plus
+ * "seq" and "ts" when they are set.
+ * The caller owns the returned object.
+ */
+cJSON* tc_create_json_payload(const char* device_str, const data_t* data,
+                              tc_payload_enc_t enc);
+
+/*
+ * Write the same JSON as tc_create_json_payload + cJSON_PrintUnformatted directly
+ * into out, without heap allocations. Returns the length written (excluding the
+ * terminator), or -1 if out is too small.
+ */
+int tc_format_json_payload(const char* device_str, const data_t* data,
+                           tc_payload_enc_t enc, char* out, size_t out_len);
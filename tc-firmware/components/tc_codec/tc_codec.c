@@ -0,0 +1,259 @@
+/*
+ * Telemetry encoding, free of hardware and network dependencies.
+ *************************************************************/
+
+#include "tc_codec.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char HEX_DIGITS[] = "0123456789ABCDEF";
+static const char B64_DIGITS[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const char B85_DIGITS[] =
+    "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz!#$%&()*+-;<=>?@^_`{|}~";
+
+payload_t tc_encode_payload(const data_t* data)
+{
+    payload_t payload;
+    memset(&payload, 0, sizeof(payload));
+
+    // scale to uint16
+    const uint16_t lat_u16 = (uint16_t)lroundf(((data->latitude + 90.0f) / 180.0f) * 65535.0f);
+    const uint16_t lon_u16 = (uint16_t)lroundf(((data->longitude + 180.0f) / 360.0f) * 65535.0f);
+
+    // store big-endian, byte by byte so it does not depend on the host byte order
+    payload.raw[0] = (uint8_t)(lat_u16 >> 8);
+    payload.raw[1] = (uint8_t)(lat_u16 & 0xFF);
+    payload.raw[2] = (uint8_t)(lon_u16 >> 8);
+    payload.raw[3] = (uint8_t)(lon_u16 & 0xFF);
+    payload.f.battery_percent = (uint8_t)data->battery_percentage;
+
+    return payload;
+}
+
+void tc_hex_encode(const uint8_t* in, const size_t len, char* out)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        *out++ = HEX_DIGITS[in[i] >> 4];
+        *out++ = HEX_DIGITS[in[i] & 0x0F];
+    }
+    *out = '\0';
+}
+
+// 5 bytes: one full 3 byte group, then 2 bytes and a pad
+static size_t _b64_encode(const uint8_t* in, char* out)
+{
+    const uint32_t a = ((uint32_t)in[0] << 16) | ((uint32_t)in[1] << 8) | in[2];
+    const uint32_t b = ((uint32_t)in[3] << 16) | ((uint32_t)in[4] << 8);
+    out[0] = B64_DIGITS[a >> 18];
+    out[1] = B64_DIGITS[(a >> 12) & 0x3F];
+    out[2] = B64_DIGITS[(a >> 6) & 0x3F];
+    out[3] = B64_DIGITS[a & 0x3F];
+    out[4] = B64_DIGITS[b >> 18];
+    out[5] = B64_DIGITS[(b >> 12) & 0x3F];
+    out[6] = B64_DIGITS[(b >> 6) & 0x3F];
+    out[7] = '=';
+    out[8] = '\0';
+    return 8;
+}
+
+// 5 bytes: one full 4 byte group (5 digits), then 1 byte zero padded to a
+// group of which the first 2 digits are kept
+static size_t _b85_encode(const uint8_t* in, char* out)
+{
+    uint32_t value = ((uint32_t)in[0] << 24) | ((uint32_t)in[1] << 16) |
+                     ((uint32_t)in[2] << 8) | in[3];
+    for (int i = 4; i >= 0; i--)
+    {
+        out[i] = B85_DIGITS[value % 85];
+        value /= 85;
+    }
+    // in[4] << 24 is below 85^5, the top two digits are its quotient by 85^3
+    const uint32_t last = ((uint32_t)in[4] << 24) / (85 * 85 * 85);
+    out[5] = B85_DIGITS[last / 85];
+    out[6] = B85_DIGITS[last % 85];
+    out[7] = '\0';
+    return 7;
+}
+
+size_t tc_payload_to_text(const payload_t* payload, const tc_payload_enc_t enc, char* out)
+{
+    switch (enc)
+    {
+    case TC_PAYLOAD_ENC_B64:
+        return _b64_encode(payload->raw, out);
+    case TC_PAYLOAD_ENC_B85:
+        return _b85_encode(payload->raw, out);
+    case TC_PAYLOAD_ENC_HEX:
+    default:
+        tc_hex_encode(payload->raw, sizeof(payload->raw), out);
+        return sizeof(payload->raw) * 2;
+    }
+}
+
+typedef struct
+{
+    uint8_t map;         // map header with 0 entries
+    uint8_t text;        // short text header with length 0
+    uint8_t bytes[2];    // header of a 5 byte string
+    uint8_t bytes_len;
+    uint8_t u32;         // headers of fixed width unsigned integers
+    uint8_t u64;
+} envelope_format_t;
+
+static const envelope_format_t ENVELOPE_FORMATS[] = {
+    [TC_ENVELOPE_CBOR] = {.map = 0xA0, .text = 0x60, .bytes = {0x45}, .bytes_len = 1,
+                          .u32 = 0x1A, .u64 = 0x1B},
+    [TC_ENVELOPE_MSGPACK] = {.map = 0x80, .text = 0xA0, .bytes = {0xC4, 0x05}, .bytes_len = 2,
+                             .u32 = 0xCE, .u64 = 0xCF},
+};
+
+static uint8_t* _put_text(uint8_t* p, const envelope_format_t* f,
+                          const char* text, const size_t len)
+{
+    *p++ = f->text | (uint8_t)len;
+    memcpy(p, text, len);
+    return p + len;
+}
+
+static uint8_t* _put_u32(uint8_t* p, const envelope_format_t* f, const uint32_t value)
+{
+    *p++ = f->u32;
+    for (int shift = 24; shift >= 0; shift -= 8)
+    {
+        *p++ = (uint8_t)(value >> shift);
+    }
+    return p;
+}
+
+static uint8_t* _put_u64(uint8_t* p, const envelope_format_t* f, const uint64_t value)
+{
+    *p++ = f->u64;
+    for (int shift = 56; shift >= 0; shift -= 8)
+    {
+        *p++ = (uint8_t)(value >> shift);
+    }
+    return p;
+}
+
+int tc_format_binary_payload(const char* device_str, const data_t* data,
+                             const tc_envelope_t format, uint8_t* out, const size_t out_len)
+{
+    const size_t id_len = strlen(device_str);
+    if (id_len > TC_ENVELOPE_ID_MAX || out_len < 48 + id_len ||
+        (unsigned)format >= sizeof(ENVELOPE_FORMATS) / sizeof(ENVELOPE_FORMATS[0]))
+    {
+        return -1;
+    }
+    const envelope_format_t* f = &ENVELOPE_FORMATS[format];
+    const payload_t encoded_payload = tc_encode_payload(data);
+
+    uint8_t* p = out;
+    *p++ = f->map | (uint8_t)(3 + (data->seq != 0) + (data->timestamp_ms != 0));
+    p = _put_text(p, f, "id", 2);
+    p = _put_text(p, f, device_str, id_len);
+    p = _put_text(p, f, "payload", 7);
+    memcpy(p, f->bytes, f->bytes_len);
+    p += f->bytes_len;
+    memcpy(p, encoded_payload.raw, sizeof(encoded_payload.raw));
+    p += sizeof(encoded_payload.raw);
+    p = _put_text(p, f, "t", 1);
+    p = _put_u32(p, f, (uint32_t)data->timestamp);
+    if (data->seq != 0)
+    {
+        p = _put_text(p, f, "seq", 3);
+        p = _put_u32(p, f, data->seq);
+    }
+    if (data->timestamp_ms != 0)
+    {
+        p = _put_text(p, f, "ts", 2);
+        p = _put_u64(p, f, (uint64_t)data->timestamp_ms);
+    }
+    return (int)(p - out);
+}
+
+cJSON* tc_create_json_payload(const char* device_str, const data_t* data,
+                              const tc_payload_enc_t enc)
+{
+    char buffer[32];
+    cJSON* root = cJSON_CreateObject();
+    if (root == NULL)
+    {
+        return NULL;
+    }
+
+    cJSON_AddStringToObject(root, "id", device_str);
+
+    const payload_t encoded_payload = tc_encode_payload(data);
+    tc_payload_to_text(&encoded_payload, enc, buffer);
+    cJSON_AddStringToObject(root, "payload", buffer);
+
+    struct tm tm_s;
+    localtime_r(&data->timestamp, &tm_s);
+
+    snprintf(buffer, sizeof(buffer), "%04d-%02d-%02d",
+             tm_s.tm_year + 1900,
+             tm_s.tm_mon + 1,
+             tm_s.tm_mday);
+    cJSON_AddStringToObject(root, "date", buffer);
+
+    snprintf(buffer, sizeof(buffer), "%02d:%02d:%02d",
+             tm_s.tm_hour,
+             tm_s.tm_min,
+             tm_s.tm_sec);
+    cJSON_AddStringToObject(root, "time", buffer);
+
+    // both stay below 2^53, exact as a JSON double
+    if (data->seq != 0)
+    {
+        cJSON_AddNumberToObject(root, "seq", data->seq);
+    }
+    if (data->timestamp_ms != 0)
+    {
+        cJSON_AddNumberToObject(root, "ts", (double)data->timestamp_ms);
+    }
+
+    return root;
+}
+
+int tc_format_json_payload(const char* device_str, const data_t* data,
+                           const tc_payload_enc_t enc, char* out, const size_t out_len)
+{
+    char payload_text[TC_PAYLOAD_TEXT_SIZE];
+    const payload_t encoded_payload = tc_encode_payload(data);
+    tc_payload_to_text(&encoded_payload, enc, payload_text);
+
+    struct tm tm_s;
+    localtime_r(&data->timestamp, &tm_s);
+
+    // device_str is generated from the MAC address and never needs JSON escaping,
+    // and no payload encoding has a quote or a backslash in its alphabet
+    int len = snprintf(out, out_len,
+                       "{\"id\":\"%s\",\"payload\":\"%s\","
+                       "\"date\":\"%04d-%02d-%02d\",\"time\":\"%02d:%02d:%02d\"",
+                       device_str, payload_text,
+                       tm_s.tm_year + 1900, tm_s.tm_mon + 1, tm_s.tm_mday,
+                       tm_s.tm_hour, tm_s.tm_min, tm_s.tm_sec);
+    if (data->seq != 0 && len >= 0 && (size_t)len < out_len)
+    {
+        len += snprintf(out + len, out_len - len, ",\"seq\":%" PRIu32, data->seq);
+    }
+    if (data->timestamp_ms != 0 && len >= 0 && (size_t)len < out_len)
+    {
+        len += snprintf(out + len, out_len - len, ",\"ts\":%" PRId64, data->timestamp_ms);
+    }
+    if (len >= 0 && (size_t)len < out_len)
+    {
+        len += snprintf(out + len, out_len - len, "}");
+    }
+
+    if (len < 0 || (size_t)len >= out_len)
+    {
+        return -1;
+    }
+    return len;
+}
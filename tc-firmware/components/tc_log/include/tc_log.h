@@ -0,0 +1,58 @@
+/*
+ * Hot path logging: compile-time level floor and per call site rate limiting.
+ *
+ * TC_LOGx_HOT works like ESP_LOGx for code that runs every sample or on every
+ * network event. Levels above CONFIG_TC_LOG_HOT_LEVEL are constant-folded away,
+ * arguments included. Enabled call sites own a token bucket, so a tight loop or
+ * an event storm cannot block the caller on the UART.
+ *************************************************************/
+
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <esp_log.h>
+#include <sdkconfig.h>
+
+typedef struct
+{
+    uint32_t last_tick;
+    int32_t tokens;
+    uint32_t suppressed;
+} tc_log_bucket_t;
+
+#define TC_LOG_BUCKET_INIT {0, CONFIG_TC_LOG_HOT_BURST, 0}
+
+#define TC_LOG_HOT_ENABLED(level) (CONFIG_TC_LOG_HOT_LEVEL >= (level))
+
+/*
+ * Take a token from bucket. Returns false if the line must be dropped, otherwise
+ * stores the number of lines dropped since the last allowed one in suppressed.
+ * Buckets are not locked, a call site shared by two tasks may at worst let an
+ * extra line through.
+ */
+bool tc_log_allow(tc_log_bucket_t* bucket, uint32_t* suppressed);
+
+#define TC_LOG_HOT(level, tag, format, ...)                                         \
+    do                                                                              \
+    {                                                                               \
+        if (TC_LOG_HOT_ENABLED(level))                                              \
+        {                                                                           \
+            static tc_log_bucket_t __tc_log_bucket = TC_LOG_BUCKET_INIT;            \
+            uint32_t __tc_log_suppressed;                                           \
+            if (tc_log_allow(&__tc_log_bucket, &__tc_log_suppressed))               \
+            {                                                                       \
+                if (__tc_log_suppressed != 0)                                       \
+                {                                                                   \
+                    ESP_LOG_LEVEL_LOCAL(level, tag, "(%" PRIu32 " lines suppressed)", \
+                                        __tc_log_suppressed);                       \
+                }                                                                   \
+                ESP_LOG_LEVEL_LOCAL(level, tag, format, ##__VA_ARGS__);             \
+            }                                                                       \
+        }                                                                           \
+    } while (0)
+
+#define TC_LOGE_HOT(tag, format, ...) TC_LOG_HOT(ESP_LOG_ERROR, tag, format, ##__VA_ARGS__)
+#define TC_LOGW_HOT(tag, format, ...) TC_LOG_HOT(ESP_LOG_WARN, tag, format, ##__VA_ARGS__)
+#define TC_LOGI_HOT(tag, format, ...) TC_LOG_HOT(ESP_LOG_INFO, tag, format, ##__VA_ARGS__)
+#define TC_LOGD_HOT(tag, format, ...) TC_LOG_HOT(ESP_LOG_DEBUG, tag, format, ##__VA_ARGS__)
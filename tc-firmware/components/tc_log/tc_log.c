@@ -0,0 +1,45 @@
+/*
+ * Hot path logging: token bucket per call site.
+ *************************************************************/
+
+#include "tc_log.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+bool tc_log_allow(tc_log_bucket_t* bucket, uint32_t* suppressed)
+{
+    // at least one tick, so a short interval on a slow tick rate cannot divide by zero
+    const uint32_t interval = pdMS_TO_TICKS(CONFIG_TC_LOG_HOT_INTERVAL_MS) > 0
+                                  ? pdMS_TO_TICKS(CONFIG_TC_LOG_HOT_INTERVAL_MS)
+                                  : 1;
+    const uint32_t now = (uint32_t)xTaskGetTickCount();
+
+    if (bucket->tokens >= CONFIG_TC_LOG_HOT_BURST)
+    {
+        bucket->last_tick = now;
+    }
+    else
+    {
+        // one token per elapsed interval, unsigned math survives tick wrap
+        const uint32_t refill = (now - bucket->last_tick) / interval;
+        if (refill > 0)
+        {
+            bucket->last_tick += refill * interval;
+            bucket->tokens = refill >= (uint32_t)(CONFIG_TC_LOG_HOT_BURST - bucket->tokens)
+                                 ? CONFIG_TC_LOG_HOT_BURST
+                                 : bucket->tokens + (int32_t)refill;
+        }
+    }
+
+    if (bucket->tokens <= 0)
+    {
+        bucket->suppressed++;
+        return false;
+    }
+
+    bucket->tokens--;
+    *suppressed = bucket->suppressed;
+    bucket->suppressed = 0;
+    return true;
+}
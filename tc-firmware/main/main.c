@@ -1,6 +1,7 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/time.h>
 #include <time.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
@@ -8,169 +9,145 @@
 #include <esp_err.h>
 #include <esp_event.h>
 #include <esp_log.h>
-#include <math.h>
+#include <esp_timer.h>
 #include <nvs_flash.h>
 
-#include "byteswap.h"
-#include "cc.h"
+#include "tc_codec.h"
 #include "tc_hal.h"
+#include "tc_log.h"
+#include "tc_metrics.h"
 #include "tc_network.h"
+#include "tc_seq.h"
 #include "utils.h"
 
 
 static const char* TAG = "tc-firmware";
 
 
-typedef struct data_s
-{
-    float latitude;
-    float longitude;
-    short battery_percentage;
-    time_t timestamp;
-} data_t;
-
-
-/* Considering WGS84 coordinate system used in GPS the latitude ranges from -90 to +90
- * and longitude ranges from -180 to +180.
- *
- * We will encode latitude in 16 bits by scaling the continuous range [-90, +90] into [0, 65535]
- *   lat_u16 = round( (latitude + 90) / 180 * 65535 )
- *
- * We will encode longitude in 16 bits by scaling the continuous range [-180, +180] into [0, 65535]
- *   lon_u16 = round( (longitude + 180) / 360 * 65535 )
- *
- * Battery percentage will be stored in 8 bits (0-100).
- *
- * Total payload size = 16 + 16 + 8 = 40 bits = 5 bytes.
- */
-#pragma pack(1)
-typedef union
-{
-    struct
-    {
-        uint16_t lat_be; // big-endian
-        uint16_t lon_be; // big-endian
-        uint8_t battery_percent; // 0..100
-    } f;
-
-    uint8_t raw[5]; // raw bytes to hex-encode
-} payload_t;
-
-static payload_t _encode_payload(const data_t* data)
-{
-    payload_t payload;
-    CLEAR_STRUCT(payload);
+#if CONFIG_TC_MQTT_ENABLED
+static char publish_topic[64];
+static char metrics_topic[64];
+#endif
 
-    // scale to uint16
-    const uint16_t lat_u16 = (uint16_t)lroundf(((data->latitude + 90.0f) / 180.0f) * 65535.0f);
-    const uint16_t lon_u16 = (uint16_t)lroundf(((data->longitude + 180.0f) / 360.0f) * 65535.0f);
+#if CONFIG_TC_TELEMETRY_FORMAT_CBOR
+#define TELEMETRY_ENVELOPE TC_ENVELOPE_CBOR
+#elif CONFIG_TC_TELEMETRY_FORMAT_MSGPACK
+#define TELEMETRY_ENVELOPE TC_ENVELOPE_MSGPACK
+#endif
 
-    // store big-endian
-    payload.f.lat_be = htons(lat_u16);
-    payload.f.lon_be = htons(lon_u16);
-    payload.f.battery_percent = (uint8_t)data->battery_percentage;
+#if CONFIG_TC_PAYLOAD_ENCODING_B85
+#define PAYLOAD_ENCODING TC_PAYLOAD_ENC_B85
+#elif CONFIG_TC_PAYLOAD_ENCODING_B64
+#define PAYLOAD_ENCODING TC_PAYLOAD_ENC_B64
+#else
+#define PAYLOAD_ENCODING TC_PAYLOAD_ENC_HEX
+#endif
 
-    return payload;
-}
 
-/*
- * Create JSON payload with device string, latitude, longitude, and battery percentage.
- */
-static cJSON* _create_json_payload(const char* device_str, const data_t* payload)
+static const char* _format_timestamp(const time_t timestamp, char* out, const size_t out_len)
 {
-    char buffer[32];
-    cJSON* root = cJSON_CreateObject();
-    if (root == NULL)
-    {
-        ESP_LOGE(TAG, "Failed to create JSON object");
-        return NULL;
-    }
-
-    cJSON_AddStringToObject(root, "id", device_str);
-
-    const payload_t encoded_payload = _encode_payload(payload);
-    CLEAR_ARRAY(buffer);
-    // Hex encode 5 bytes: "%02X%02X%02X%02X%02X"
-    snprintf(buffer, sizeof(buffer),
-             "%02X%02X%02X%02X%02X",
-             encoded_payload.raw[0], encoded_payload.raw[1],
-             encoded_payload.raw[2], encoded_payload.raw[3],
-             encoded_payload.raw[4]);
-
-    cJSON_AddStringToObject(root, "payload", buffer);
-
     struct tm tm_s;
-    localtime_r(&payload->timestamp, &tm_s);
-
-    CLEAR_ARRAY(buffer);
-    sprintf(buffer, "%04d-%02d-%02d",
-            tm_s.tm_year + 1900,
-            tm_s.tm_mon + 1,
-            tm_s.tm_mday);
-
-    cJSON_AddStringToObject(root, "date", buffer);
-
-    CLEAR_ARRAY(buffer);
-    sprintf(buffer, "%02d:%02d:%02d",
-            tm_s.tm_hour,
-            tm_s.tm_min,
-            tm_s.tm_sec);
-    cJSON_AddStringToObject(root, "time", buffer);
-
-    return root;
+    localtime_r(&timestamp, &tm_s);
+    strftime(out, out_len, "%Y-%m-%d %H:%M:%S", &tm_s);
+    return out;
 }
 
-
-#if CONFIG_TC_MQTT_ENABLED
-static char publish_topic[64];
-#endif
-
-
 static void _print_data(const data_t* data)
 {
-    ESP_LOGI(TAG, "Latitude: %.2f", data->latitude);
-    ESP_LOGI(TAG, "Longitude: %.2f", data->longitude);
-    ESP_LOGI(TAG, "Battery Percentage: %d%%", data->battery_percentage);
-    struct tm tm_s;
-    localtime_r(&data->timestamp, &tm_s);
-    ESP_LOGI(TAG, "Timestamp: %04d-%02d-%02d %02d:%02d:%02d",
-             tm_s.tm_year + 1900,
-             tm_s.tm_mon + 1,
-             tm_s.tm_mday,
-             tm_s.tm_hour,
-             tm_s.tm_min,
-             tm_s.tm_sec);
+    // one line per sample, and the timestamp is only formatted when it is printed
+    char timestamp[20];
+    TC_LOGI_HOT(TAG, "Latitude: %.2f Longitude: %.2f Battery: %d%% Timestamp: %s",
+                data->latitude, data->longitude, data->battery_percentage,
+                _format_timestamp(data->timestamp, timestamp, sizeof(timestamp)));
 }
 
 static esp_err_t loop(const char* device_str)
 {
     data_t payload;
+    memset(&payload, 0, sizeof(payload));
+
+    // stamp before reading the sensors, the trace starts at the sample
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    payload.timestamp = now.tv_sec;
+#if CONFIG_TC_TELEMETRY_TRACE
+    payload.timestamp_ms = (int64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+#endif
+
     VERIFY_SUCCESS(tc_get_gps_location(&payload.latitude, &payload.longitude));
     VERIFY_SUCCESS(tc_get_battery_percentage(&payload.battery_percentage));
-    payload.timestamp = time(NULL);
+    // only a sample that is sent takes a number, a failed read is not a gap
+    payload.seq = tc_seq_next();
 
     _print_data(&payload);
-    cJSON* json_payload = _create_json_payload(device_str, &payload);
-    char* json_str = cJSON_PrintUnformatted(json_payload);
+    tc_metrics_count(TC_COUNTER_SAMPLES, 1);
+
+    const int64_t encode_start_us = esp_timer_get_time();
+#if CONFIG_TC_TELEMETRY_FORMAT_JSON
+    cJSON* json_payload = tc_create_json_payload(device_str, &payload, PAYLOAD_ENCODING);
+    if (json_payload == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to create JSON object");
+        return ESP_ERR_NO_MEM;
+    }
+    char* body = cJSON_PrintUnformatted(json_payload);
+    const size_t body_len = strlen(body);
+#else
+    // only this task encodes, the buffer is reused for every sample
+    static uint8_t envelope[TC_ENVELOPE_MAX_SIZE];
+    const int envelope_len = tc_format_binary_payload(device_str, &payload, TELEMETRY_ENVELOPE,
+                                                      envelope, sizeof(envelope));
+    if (envelope_len < 0)
+    {
+        ESP_LOGE(TAG, "Failed to encode telemetry envelope");
+        return ESP_ERR_INVALID_SIZE;
+    }
+    const char* body = (const char*)envelope;
+    const size_t body_len = (size_t)envelope_len;
+#endif
+    tc_metrics_observe(TC_HISTOGRAM_ENCODE_US,
+                       (uint32_t)(esp_timer_get_time() - encode_start_us));
 
 #if CONFIG_TC_MQTT_ENABLED
-    tc_mqtt_publish_telemetry(publish_topic, json_str, strlen(json_str));
+    const esp_err_t result = tc_mqtt_publish_telemetry(publish_topic, body, body_len);
 #else
-    tc_http_publish_telemetry(json_str, strlen(json_str));
+    const esp_err_t result = tc_http_publish_telemetry(body, body_len);
 #endif
+    if (result != ESP_OK)
+    {
+        tc_metrics_count(TC_COUNTER_PUBLISH_FAILED, 1);
+    }
 
-    free(json_str);
+#if CONFIG_TC_TELEMETRY_FORMAT_JSON
+    free(body);
     cJSON_Delete(json_payload);
+#endif
 
-    return ESP_OK;
+    return result;
 }
 
+#if CONFIG_TC_MQTT_ENABLED
+static void _publish_metrics(void)
+{
+    uint8_t snapshot[TC_METRICS_SNAPSHOT_SIZE];
+    const size_t len = tc_metrics_snapshot(snapshot, sizeof(snapshot),
+                                           tc_mqtt_outbox_size());
+    if (len == 0 || tc_mqtt_publish_metrics(metrics_topic, snapshot, len) != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to publish metrics snapshot");
+    }
+}
+#endif
+
 static esp_err_t _nvs_init(void)
 {
     esp_err_t ret = nvs_flash_init();
     if (ret == ESP_ERR_NVS_NO_FREE_PAGES ||
         ret == ESP_ERR_NVS_NEW_VERSION_FOUND)
     {
+        // the sequence number starts over at 1, the cloud tells the new
+        // samples from replays by their later sample time
+        ESP_LOGW(TAG, "Erasing NVS, telemetry sequence restarts");
         ESP_ERROR_CHECK(nvs_flash_erase());
         ret = nvs_flash_init();
     }
@@ -192,6 +169,7 @@ void app_main(void)
     ESP_LOGI(TAG, "Starting Technical Challenge Firmware");
 
     ESP_ERROR_CHECK(_nvs_init());
+    ESP_ERROR_CHECK(tc_seq_init());
     ESP_ERROR_CHECK(esp_event_loop_create_default());
 
     char device_str[13];
@@ -201,6 +179,7 @@ void app_main(void)
 #if CONFIG_TC_MQTT_ENABLED
     // prepare publish topic
     snprintf(publish_topic, 64, "tc-bn/telemetry/%s", device_str);
+    snprintf(metrics_topic, 64, "tc-bn/metrics/%s", device_str);
 #endif
 
     task_to_notify = xTaskGetCurrentTaskHandle();
@@ -213,17 +192,32 @@ void app_main(void)
     if (notification_value == 1)
     {
         const uint64_t interval_in_ms = CONFIG_TC_PAYLOAD_GPS_INTERVAL * 1000;
+#if CONFIG_TC_MQTT_ENABLED
+        int64_t last_metrics_us = esp_timer_get_time();
+#endif
 
         TickType_t xLastWakeTime = xTaskGetTickCount();
         while (true)
         {
+            const int64_t loop_start_us = esp_timer_get_time();
             const esp_err_t result = loop(device_str);
+            tc_metrics_observe(TC_HISTOGRAM_LOOP_US,
+                               (uint32_t)(esp_timer_get_time() - loop_start_us));
 
             if (result != ESP_OK)
             {
                 ESP_LOGE(TAG, "Error in loop: %s", esp_err_to_name(result));
             }
 
+#if CONFIG_TC_MQTT_ENABLED
+            if (esp_timer_get_time() - last_metrics_us >=
+                (int64_t)CONFIG_TC_METRICS_INTERVAL * 1000000)
+            {
+                last_metrics_us = esp_timer_get_time();
+                _publish_metrics();
+            }
+#endif
+
             vTaskDelayUntil(&xLastWakeTime, pdMS_TO_TICKS(interval_in_ms));
         }
     }
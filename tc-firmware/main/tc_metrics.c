@@ -0,0 +1,125 @@
+/*
+ * Runtime metrics: counters and latency histograms.
+ *
+ * Every core writes to its own slot with relaxed atomic adds, so recording never
+ * takes a lock or contends with the other core. The snapshot sums the slots.
+ *************************************************************/
+
+#include "tc_metrics.h"
+
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+
+typedef struct
+{
+    uint32_t count;
+    uint32_t sum_us;
+    uint32_t buckets[TC_METRICS_BUCKETS];
+} histogram_slot_t;
+
+typedef struct
+{
+    uint32_t counters[TC_COUNTER_MAX];
+    histogram_slot_t histograms[TC_HISTOGRAM_MAX];
+} metrics_slot_t;
+
+static metrics_slot_t slots[portNUM_PROCESSORS];
+
+static inline metrics_slot_t* _slot(void)
+{
+    return &slots[xPortGetCoreID()];
+}
+
+static inline uint32_t _bucket(const uint32_t value_us)
+{
+    if (value_us == 0)
+    {
+        return 0;
+    }
+    const uint32_t bucket = 31 - __builtin_clz(value_us);
+    return bucket < TC_METRICS_BUCKETS ? bucket : TC_METRICS_BUCKETS - 1;
+}
+
+static inline uint32_t _load(const uint32_t* value)
+{
+    return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+static uint8_t* _put_u32(uint8_t* out, const uint32_t value)
+{
+    out[0] = (uint8_t)(value >> 24);
+    out[1] = (uint8_t)(value >> 16);
+    out[2] = (uint8_t)(value >> 8);
+    out[3] = (uint8_t)value;
+    return out + 4;
+}
+
+void tc_metrics_count(const tc_counter_t counter, const uint32_t n)
+{
+    __atomic_fetch_add(&_slot()->counters[counter], n, __ATOMIC_RELAXED);
+}
+
+void tc_metrics_observe(const tc_histogram_t histogram, const uint32_t value_us)
+{
+    histogram_slot_t* h = &_slot()->histograms[histogram];
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum_us, value_us, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->buckets[_bucket(value_us)], 1, __ATOMIC_RELAXED);
+}
+
+size_t tc_metrics_snapshot(uint8_t* out, const size_t out_len, const uint32_t queue_depth)
+{
+    if (out_len < TC_METRICS_SNAPSHOT_SIZE)
+    {
+        return 0;
+    }
+
+    uint8_t* p = out;
+    *p++ = TC_METRICS_SNAPSHOT_VERSION;
+    *p++ = TC_COUNTER_MAX;
+    *p++ = TC_HISTOGRAM_MAX;
+    *p++ = TC_METRICS_BUCKETS;
+    p = _put_u32(p, (uint32_t)(esp_timer_get_time() / 1000000));
+    p = _put_u32(p, esp_get_free_heap_size());
+    p = _put_u32(p, esp_get_minimum_free_heap_size());
+    p = _put_u32(p, queue_depth);
+    p = _put_u32(p, 0);
+
+    for (int c = 0; c < TC_COUNTER_MAX; c++)
+    {
+        uint32_t total = 0;
+        for (int core = 0; core < portNUM_PROCESSORS; core++)
+        {
+            total += _load(&slots[core].counters[c]);
+        }
+        p = _put_u32(p, total);
+    }
+
+    for (int h = 0; h < TC_HISTOGRAM_MAX; h++)
+    {
+        uint32_t count = 0;
+        uint32_t sum_us = 0;
+        uint32_t buckets[TC_METRICS_BUCKETS];
+        memset(buckets, 0, sizeof(buckets));
+        for (int core = 0; core < portNUM_PROCESSORS; core++)
+        {
+            const histogram_slot_t* slot = &slots[core].histograms[h];
+            count += _load(&slot->count);
+            sum_us += _load(&slot->sum_us);
+            for (int b = 0; b < TC_METRICS_BUCKETS; b++)
+            {
+                buckets[b] += _load(&slot->buckets[b]);
+            }
+        }
+        p = _put_u32(p, count);
+        p = _put_u32(p, sum_us);
+        for (int b = 0; b < TC_METRICS_BUCKETS; b++)
+        {
+            p = _put_u32(p, buckets[b]);
+        }
+    }
+
+    return (size_t)(p - out);
+}
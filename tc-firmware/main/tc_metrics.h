@@ -0,0 +1,51 @@
+/*
+ * Runtime metrics: counters and latency histograms.
+ *************************************************************/
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <esp_err.h>
+
+/*
+ * The order of counters and histograms is part of the snapshot wire format,
+ * append only. The cloud decoder (tc-cloud/main.py) uses the same order.
+ */
+typedef enum
+{
+    TC_COUNTER_SAMPLES = 0,
+    TC_COUNTER_PUBLISH_FAILED,
+    TC_COUNTER_MQTT_RECONNECTS,
+    TC_COUNTER_WIFI_RECONNECTS,
+    TC_COUNTER_MAX,
+} tc_counter_t;
+
+typedef enum
+{
+    TC_HISTOGRAM_LOOP_US = 0,
+    TC_HISTOGRAM_ENCODE_US,
+    TC_HISTOGRAM_PUBLISH_US,
+    TC_HISTOGRAM_MAX,
+} tc_histogram_t;
+
+/*
+ * Histogram bucket i counts values in [2^i, 2^(i+1)) microseconds, bucket 0 also
+ * holds 0 and the last bucket everything above.
+ */
+#define TC_METRICS_BUCKETS          20
+#define TC_METRICS_SNAPSHOT_VERSION 1
+#define TC_METRICS_SNAPSHOT_SIZE    (24 + 4 * TC_COUNTER_MAX + \
+                                     TC_HISTOGRAM_MAX * (8 + 4 * TC_METRICS_BUCKETS))
+
+void tc_metrics_count(tc_counter_t counter, uint32_t n);
+void tc_metrics_observe(tc_histogram_t histogram, uint32_t value_us);
+
+/*
+ * Serialize all metrics (big-endian):
+ *   [version_u8][counters_u8][histograms_u8][buckets_u8]
+ *   [uptime_s_u32][free_heap_u32][min_free_heap_u32][queue_depth_u32][reserved_u32]
+ *   [counter_u32 x counters]
+ *   per histogram: [count_u32][sum_us_u32][bucket_u32 x buckets]
+ * Values are cumulative since boot. Returns the number of bytes written.
+ */
+size_t tc_metrics_snapshot(uint8_t* out, size_t out_len, uint32_t queue_depth);
@@ -13,11 +13,17 @@
 #include <time.h>
 #include <esp_netif_sntp.h>
 #if CONFIG_TC_MQTT_ENABLED
+#include <esp_random.h>
 #include <mqtt_client.h>
 #else
 #include <esp_http_client.h>
+#include <stdlib.h>
+#include <strings.h>
 #endif
 
+#include "tc_hal.h"
+#include "tc_log.h"
+#include "tc_metrics.h"
 #include "utils.h"
 
 static const char* TAG = "tc-network";
@@ -37,6 +43,35 @@ typedef enum mqtt_status_e
     MQTT_STATE_CONNECTED,
 } mqtt_status_t;
 
+// publishes waiting for the broker ack, used for the publish latency histogram
+#define MQTT_INFLIGHT_TRACKED 8
+
+typedef struct mqtt_inflight_s
+{
+    int msg_id;
+    int64_t start_us;
+} mqtt_inflight_t;
+
+// longest telemetry message kept in the HTTP deferral queue
+#define HTTP_QUEUE_MESSAGE_MAX 256
+
+// sent with HTTP; MQTT 3.1.1 has no content type, the cloud looks at the first byte
+#if CONFIG_TC_TELEMETRY_FORMAT_CBOR
+#define TELEMETRY_CONTENT_TYPE "application/cbor"
+#elif CONFIG_TC_TELEMETRY_FORMAT_MSGPACK
+#define TELEMETRY_CONTENT_TYPE "application/msgpack"
+#else
+#define TELEMETRY_CONTENT_TYPE "application/json"
+#endif
+// binary envelopes are logged by their size, JSON as the text
+#if CONFIG_TC_TELEMETRY_FORMAT_JSON
+#define BODY_FMT "%.*s"
+#define BODY_ARGS(data, len) (int)(len), (data)
+#else
+#define BODY_FMT "(%u bytes)"
+#define BODY_ARGS(data, len) (unsigned)(len)
+#endif
+
 static struct
 {
     struct
@@ -62,8 +97,23 @@ static struct
     {
         volatile mqtt_status_t state;
         char mqtt_host[128];
+        char client_id[13];
         esp_mqtt_client_handle_t client;
+        mqtt_inflight_t inflight[MQTT_INFLIGHT_TRACKED];
+        uint8_t inflight_next;
+        portMUX_TYPE inflight_lock;
     } mqtt;
+#else
+    // telemetry held back while the server asks us to retry later, oldest at
+    // head; only the telemetry task publishes, so there is no lock
+    struct
+    {
+        char queue[CONFIG_TC_HTTP_QUEUE_LEN][HTTP_QUEUE_MESSAGE_MAX];
+        uint16_t queue_len[CONFIG_TC_HTTP_QUEUE_LEN];
+        uint8_t head;
+        uint8_t count;
+        int64_t retry_at_us;
+    } http;
 #endif
 
     bool sntp_started;
@@ -86,11 +136,21 @@ static struct
         .connect_retries = 0,
         .connect_timer = NULL,
     },
-#if TC_MQTT_ENABLED
+#if CONFIG_TC_MQTT_ENABLED
     .mqtt = {
         .state = MQTT_STATE_UNINIT,
         .client = NULL,
         .mqtt_host = {0},
+        .client_id = {0},
+        .inflight = {{0}},
+        .inflight_next = 0,
+        .inflight_lock = portMUX_INITIALIZER_UNLOCKED,
+    },
+#else
+    .http = {
+        .head = 0,
+        .count = 0,
+        .retry_at_us = 0,
     },
 #endif
     .sntp_started = false,
@@ -148,6 +208,40 @@ esp_err_t _sntp_stop()
  * MQTT Related Functions
  *********************************************/
 
+#if CONFIG_TC_MQTT_QOS > 0
+static void _mqtt_inflight_add(const int msg_id, const int64_t start_us)
+{
+    taskENTER_CRITICAL(&context.mqtt.inflight_lock);
+    mqtt_inflight_t* slot = &context.mqtt.inflight[context.mqtt.inflight_next];
+    slot->msg_id = msg_id;
+    slot->start_us = start_us;
+    context.mqtt.inflight_next = (context.mqtt.inflight_next + 1) % MQTT_INFLIGHT_TRACKED;
+    taskEXIT_CRITICAL(&context.mqtt.inflight_lock);
+}
+#endif
+
+static void _mqtt_inflight_done(const int msg_id)
+{
+    int64_t start_us = 0;
+    taskENTER_CRITICAL(&context.mqtt.inflight_lock);
+    for (int i = 0; i < MQTT_INFLIGHT_TRACKED; i++)
+    {
+        if (context.mqtt.inflight[i].msg_id == msg_id)
+        {
+            start_us = context.mqtt.inflight[i].start_us;
+            context.mqtt.inflight[i].msg_id = 0;
+            break;
+        }
+    }
+    taskEXIT_CRITICAL(&context.mqtt.inflight_lock);
+
+    if (start_us != 0)
+    {
+        tc_metrics_observe(TC_HISTOGRAM_PUBLISH_US,
+                           (uint32_t)(esp_timer_get_time() - start_us));
+    }
+}
+
 static void mqtt_event_handler(void* handler_args, esp_event_base_t base,
                                const int32_t event_id, void* event_data)
 {
@@ -160,7 +254,8 @@ static void mqtt_event_handler(void* handler_args, esp_event_base_t base,
     {
     case MQTT_EVENT_CONNECTED:
         {
-            ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
+            ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED, session_present=%d",
+                     event->session_present);
             context.mqtt.state = MQTT_STATE_CONNECTED;
             // for mqtt the connection is established after mqtt connection is made.
             if (context.established_cb != NULL) context.established_cb();
@@ -170,6 +265,7 @@ static void mqtt_event_handler(void* handler_args, esp_event_base_t base,
     case MQTT_EVENT_DISCONNECTED:
         ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
         context.mqtt.state = MQTT_STATE_INIT;
+        tc_metrics_count(TC_COUNTER_MQTT_RECONNECTS, 1);
         break;
     case MQTT_EVENT_SUBSCRIBED:
         ESP_LOGI(TAG, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
@@ -178,7 +274,8 @@ static void mqtt_event_handler(void* handler_args, esp_event_base_t base,
         ESP_LOGI(TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
         break;
     case MQTT_EVENT_PUBLISHED:
-        ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+        TC_LOGD_HOT(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+        _mqtt_inflight_done(event->msg_id);
         break;
     case MQTT_EVENT_DATA:
         {
@@ -217,9 +314,20 @@ static esp_mqtt_client_config_t __make_client_config()
 
     ESP_LOGI(TAG, "connection url: %s", context.mqtt.mqtt_host);
 
+    // A stable client id lets the broker keep the session across reconnects.
+    CLEAR_ARRAY(context.mqtt.client_id);
+    ESP_ERROR_CHECK(tc_get_device_str(context.mqtt.client_id));
 
     esp_mqtt_client_config_t mqtt_cfg = {
-        .broker.address.uri = context.mqtt.mqtt_host
+        .broker.address.uri = context.mqtt.mqtt_host,
+        .credentials.client_id = context.mqtt.client_id,
+        .session = {
+            .disable_clean_session = true,
+            .keepalive = CONFIG_TC_MQTT_KEEPALIVE,
+        },
+        // spread reconnects so a broker restart does not get the whole fleet at once
+        .network.reconnect_timeout_ms = CONFIG_TC_MQTT_RECONNECT_TIMEOUT_MS +
+            (int)(esp_random() % (CONFIG_TC_MQTT_RECONNECT_JITTER_MS + 1)),
     };
 
     return mqtt_cfg;
@@ -258,20 +366,80 @@ static esp_err_t _mqtt_connect()
 }
 
 
+static esp_err_t _mqtt_publish(const char* topic, const char* data,
+                               const size_t data_len)
+{
+    const int64_t start_us = esp_timer_get_time();
+    int msg_id;
+
+    if (context.mqtt.state != MQTT_STATE_CONNECTED)
+    {
+#if CONFIG_TC_MQTT_QOS > 0
+        // keep the message in the outbox, it is sent once the session resumes
+        msg_id = esp_mqtt_client_enqueue(context.mqtt.client, topic, data,
+                                         (int)data_len, CONFIG_TC_MQTT_QOS, 0,
+                                         true);
+#else
+        return ESP_ERR_INVALID_STATE;
+#endif
+    }
+    else
+    {
+        msg_id = esp_mqtt_client_publish(context.mqtt.client, topic, data,
+                                         (int)data_len, CONFIG_TC_MQTT_QOS, 0);
+    }
+
+    if (msg_id < 0)
+    {
+        return ESP_FAIL;
+    }
+
+#if CONFIG_TC_MQTT_QOS > 0
+    // latency is measured up to the broker ack in MQTT_EVENT_PUBLISHED
+    _mqtt_inflight_add(msg_id, start_us);
+#else
+    tc_metrics_observe(TC_HISTOGRAM_PUBLISH_US,
+                       (uint32_t)(esp_timer_get_time() - start_us));
+#endif
+    return ESP_OK;
+}
+
+
 esp_err_t tc_mqtt_publish_telemetry(const char* topic, const char* data,
                                     const size_t data_len)
 {
-    if (context.mqtt.state != MQTT_STATE_CONNECTED)
+    if (context.mqtt.state == MQTT_STATE_UNINIT)
     {
         return ESP_ERR_INVALID_STATE;
     }
 
-    ESP_LOGI(TAG, "Sending MQTT message to topic: %s %s", topic, data);
+    TC_LOGI_HOT(TAG, "%s MQTT message to topic: %s " BODY_FMT,
+                context.mqtt.state == MQTT_STATE_CONNECTED ? "Sending" : "Queueing",
+                topic, BODY_ARGS(data, data_len));
+
+    return _mqtt_publish(topic, data, data_len);
+}
 
-    esp_mqtt_client_publish(context.mqtt.client, topic, data,
-                            (int)data_len, 0, 0);
 
-    return ESP_OK;
+esp_err_t tc_mqtt_publish_metrics(const char* topic, const uint8_t* data,
+                                  const size_t data_len)
+{
+    if (context.mqtt.state == MQTT_STATE_UNINIT)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    return _mqtt_publish(topic, (const char*)data, data_len);
+}
+
+
+uint32_t tc_mqtt_outbox_size(void)
+{
+    if (context.mqtt.state == MQTT_STATE_UNINIT)
+    {
+        return 0;
+    }
+    return (uint32_t)esp_mqtt_client_get_outbox_size(context.mqtt.client);
 }
 
 #else
@@ -279,30 +447,165 @@ esp_err_t tc_mqtt_publish_telemetry(const char* topic, const char* data,
  * HTTP Related Functions
  *********************************************/
 
-esp_err_t tc_http_publish_telemetry(const char* data,
-                                    const size_t data_len)
+static esp_err_t _http_event_handler(esp_http_client_event_t* evt)
 {
-    if (context.wifi.status != WIFI_STAT_CONNECTED)
+    if (evt->event_id == HTTP_EVENT_ON_HEADER &&
+        strcasecmp(evt->header_key, "Retry-After") == 0)
     {
-        return ESP_ERR_INVALID_STATE;
+        // delta-seconds only, an HTTP date falls back to the default delay
+        char* end = NULL;
+        const long seconds = strtol(evt->header_value, &end, 10);
+        if (end != evt->header_value && seconds >= 0)
+        {
+            *(int32_t*)evt->user_data = (int32_t)seconds;
+        }
     }
+    return ESP_OK;
+}
 
+// ESP_ERR_NOT_FINISHED when the server is overloaded (429 or 503) and
+// *retry_after_s is its Retry-After, -1 without one
+static esp_err_t _http_post(const char* data, const size_t data_len,
+                            int32_t* retry_after_s)
+{
+    *retry_after_s = -1;
     const esp_http_client_config_t config = {
         .url = CONFIG_TC_HTTP_SERVER_URL,
         .method = HTTP_METHOD_POST,
+        .event_handler = _http_event_handler,
+        .user_data = retry_after_s,
     };
 
+    const int64_t start_us = esp_timer_get_time();
     const esp_http_client_handle_t client = esp_http_client_init(&config);
-    VERIFY_SUCCESS(esp_http_client_set_post_field(client, data, data_len));
+    if (client == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    TC_LOGI_HOT(TAG, "Sending HTTP message to url: %s " BODY_FMT, config.url,
+                BODY_ARGS(data, data_len));
+
+    esp_err_t result = esp_http_client_set_header(client, "Content-Type",
+                                                  TELEMETRY_CONTENT_TYPE);
+    if (result == ESP_OK)
+    {
+        result = esp_http_client_set_post_field(client, data, data_len);
+    }
+    if (result == ESP_OK)
+    {
+        result = esp_http_client_perform(client);
+    }
+    if (result == ESP_OK)
+    {
+        const int status = esp_http_client_get_status_code(client);
+        TC_LOGI_HOT(TAG, "HTTP POST Status = %d, content_length = %llu", status,
+                    esp_http_client_get_content_length(client));
+        if (status == 429 || status == 503)
+        {
+            result = ESP_ERR_NOT_FINISHED;
+        }
+        else if (status < 200 || status >= 300)
+        {
+            TC_LOGW_HOT(TAG, "HTTP POST rejected with status %d", status);
+            result = ESP_FAIL;
+        }
+        else
+        {
+            tc_metrics_observe(TC_HISTOGRAM_PUBLISH_US,
+                               (uint32_t)(esp_timer_get_time() - start_us));
+        }
+    }
+
+    esp_http_client_cleanup(client);
+    return result;
+}
+
+static void _http_defer(const char* data, const size_t data_len)
+{
+    if (data_len > HTTP_QUEUE_MESSAGE_MAX)
+    {
+        TC_LOGW_HOT(TAG, "HTTP message of %u bytes too long to defer, dropped",
+                    (unsigned)data_len);
+        return;
+    }
+    if (context.http.count == CONFIG_TC_HTTP_QUEUE_LEN)
+    {
+        // full, the oldest sample makes room
+        context.http.head = (context.http.head + 1) % CONFIG_TC_HTTP_QUEUE_LEN;
+        context.http.count--;
+        TC_LOGW_HOT(TAG, "HTTP queue full, dropped the oldest message");
+    }
+    const uint8_t slot = (context.http.head + context.http.count) % CONFIG_TC_HTTP_QUEUE_LEN;
+    memcpy(context.http.queue[slot], data, data_len);
+    context.http.queue_len[slot] = (uint16_t)data_len;
+    context.http.count++;
+}
 
-    ESP_LOGI(TAG, "Sending HTTP message to url: %s %s", config.url, data);
+static void _http_back_off(int32_t retry_after_s)
+{
+    if (retry_after_s < 0)
+    {
+        retry_after_s = CONFIG_TC_HTTP_RETRY_AFTER_DEFAULT;
+    }
+    if (retry_after_s > CONFIG_TC_HTTP_RETRY_AFTER_MAX)
+    {
+        retry_after_s = CONFIG_TC_HTTP_RETRY_AFTER_MAX;
+    }
+    TC_LOGW_HOT(TAG, "HTTP server busy, retrying in %ld s with %u queued",
+                (long)retry_after_s, (unsigned)context.http.count);
+    context.http.retry_at_us = esp_timer_get_time() + (int64_t)retry_after_s * 1000000;
+}
 
-    VERIFY_SUCCESS(esp_http_client_perform(client));
-    ESP_LOGI(TAG, "HTTP POST Status = %d, content_length = %llu",
-             esp_http_client_get_status_code(client),
-             esp_http_client_get_content_length(client));
+esp_err_t tc_http_publish_telemetry(const char* data,
+                                    const size_t data_len)
+{
+    if (context.wifi.status != WIFI_STAT_CONNECTED)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // the server asked for a pause, keep the sample until it is over
+    if (esp_timer_get_time() < context.http.retry_at_us)
+    {
+        _http_defer(data, data_len);
+        return ESP_OK;
+    }
+
+    int32_t retry_after_s;
+    esp_err_t result;
 
-    return esp_http_client_cleanup(client);
+    // deferred samples first, so the server sees them in order
+    while (context.http.count > 0)
+    {
+        const uint8_t head = context.http.head;
+        result = _http_post(context.http.queue[head], context.http.queue_len[head],
+                            &retry_after_s);
+        if (result == ESP_ERR_NOT_FINISHED)
+        {
+            _http_back_off(retry_after_s);
+            _http_defer(data, data_len);
+            return ESP_OK;
+        }
+        if (result != ESP_OK && result != ESP_FAIL)
+        {
+            // transport error, try again with the next sample
+            _http_defer(data, data_len);
+            return result;
+        }
+        // delivered, or refused for good (ESP_FAIL) and not worth keeping
+        context.http.head = (head + 1) % CONFIG_TC_HTTP_QUEUE_LEN;
+        context.http.count--;
+    }
+
+    result = _http_post(data, data_len, &retry_after_s);
+    if (result == ESP_ERR_NOT_FINISHED)
+    {
+        _http_back_off(retry_after_s);
+        _http_defer(data, data_len);
+        return ESP_OK;
+    }
+    return result;
 }
 #endif
 
@@ -338,10 +641,11 @@ static void __wifi_event_sta_handler(int32_t event_id, void* event_data)
         {
             wifi_event_sta_disconnected_t* event =
                 (wifi_event_sta_disconnected_t*)event_data;
-            ESP_LOGI(TAG, "connect sta to %s : %s failed. reason %d. retry %d",
-                     event->ssid, event->bssid, event->reason,
-                     context.wifi.connect_retries);
+            TC_LOGW_HOT(TAG, "connect sta to %s : %s failed. reason %d. retry %d",
+                        event->ssid, event->bssid, event->reason,
+                        context.wifi.connect_retries);
             CLEAR_ARRAY(context.wifi.sta_ip);
+            tc_metrics_count(TC_COUNTER_WIFI_RECONNECTS, 1);
             context.wifi.connect_retries++;
             esp_timer_start_once(context.wifi.connect_timer,
                                  __wifi_get_next_connect());
@@ -379,7 +683,7 @@ _wifi_event_handler(__attribute__((unused)) void* arg,
                     __attribute__((unused)) esp_event_base_t event_base,
                     int32_t event_id, void* event_data)
 {
-    ESP_LOGI(TAG, "event %ld", event_id);
+    TC_LOGD_HOT(TAG, "event %ld", event_id);
 
     // station mode
     if (event_id == WIFI_EVENT_STA_START ||
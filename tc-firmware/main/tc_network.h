@@ -3,6 +3,8 @@
  *************************************************************/
 
 #pragma once
+#include <stddef.h>
+#include <stdint.h>
 #include <esp_err.h>
 
 typedef void (*tc_network_established_cb_t)(void);
@@ -11,6 +13,9 @@ esp_err_t tc_network_start(tc_network_established_cb_t cb);
 #if CONFIG_TC_MQTT_ENABLED
 esp_err_t tc_mqtt_publish_telemetry(const char* topic, const char* data,
                                     const size_t data_len);
+esp_err_t tc_mqtt_publish_metrics(const char* topic, const uint8_t* data,
+                                  const size_t data_len);
+uint32_t tc_mqtt_outbox_size(void);
 #else
 esp_err_t tc_http_publish_telemetry(const char* data,
                                     const size_t data_len);
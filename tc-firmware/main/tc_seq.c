@@ -0,0 +1,82 @@
+/*
+ * Per device telemetry sequence number, persisted in NVS.
+ *
+ * Writing NVS on every sample would wear the flash, so a block of
+ * CONFIG_TC_SEQ_NVS_BLOCK numbers is reserved at a time: NVS holds the first
+ * number of the next block. After a reboot numbering continues from there, so
+ * the unused rest of the block shows up as a gap in the cloud but a number is
+ * never sent twice. Only erasing NVS starts the sequence over at 1; the cloud
+ * deduplicates on (device, seq, sample time), so that loses nothing.
+ *************************************************************/
+
+#include "tc_seq.h"
+
+#include <esp_log.h>
+#include <nvs.h>
+
+#include "utils.h"
+
+static const char* TAG = "tc-seq";
+static const char* NVS_NAMESPACE = "tc";
+static const char* NVS_KEY = "seq_next";
+
+static struct
+{
+    uint32_t next;
+    uint32_t reserved_until;
+} context = {
+    .next = 1,
+    .reserved_until = 1,
+};
+
+static esp_err_t _reserve(const uint32_t until)
+{
+    nvs_handle_t handle;
+    VERIFY_SUCCESS(nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle));
+    esp_err_t ret = nvs_set_u32(handle, NVS_KEY, until);
+    if (ret == ESP_OK)
+    {
+        ret = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    if (ret == ESP_OK)
+    {
+        context.reserved_until = until;
+    }
+    return ret;
+}
+
+esp_err_t tc_seq_init(void)
+{
+    nvs_handle_t handle;
+    uint32_t stored = 1;
+    esp_err_t ret = nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle);
+    if (ret == ESP_OK)
+    {
+        ret = nvs_get_u32(handle, NVS_KEY, &stored);
+        nvs_close(handle);
+    }
+    if (ret != ESP_OK && ret != ESP_ERR_NVS_NOT_FOUND)
+    {
+        return ret;
+    }
+
+    context.next = stored;
+    ESP_LOGI(TAG, "Sequence continues at %lu", (unsigned long)context.next);
+    return _reserve(context.next + CONFIG_TC_SEQ_NVS_BLOCK);
+}
+
+uint32_t tc_seq_next(void)
+{
+    if (context.next >= context.reserved_until)
+    {
+        // if NVS fails keep counting, a reboot before the next successful
+        // reservation may then reuse numbers, with later sample times than
+        // the first use, so the cloud still keeps them apart
+        if (_reserve(context.next + CONFIG_TC_SEQ_NVS_BLOCK) != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to reserve sequence numbers in NVS");
+        }
+    }
+    return context.next++;
+}
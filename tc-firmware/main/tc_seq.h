@@ -0,0 +1,17 @@
+/*
+ * Per device telemetry sequence number, persisted in NVS.
+ *************************************************************/
+
+#pragma once
+#include <stdint.h>
+#include <esp_err.h>
+
+/*
+ * Load the next sequence number from NVS. Call after nvs_flash_init.
+ */
+esp_err_t tc_seq_init(void);
+
+/*
+ * Next sequence number, starting at 1 and increasing across reboots.
+ */
+uint32_t tc_seq_next(void);